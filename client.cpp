@@ -8,13 +8,28 @@
 #include <fstream>
 #include <thread>
 #include <chrono>
+#include <filesystem>
+#include <cerrno>
+#include <algorithm>
+#include <vector>
 #include <openssl/rand.h>
 
 #ifdef _WIN32
 #include <BaseTsd.h>
+#include <io.h>
+#include <fcntl.h>
 typedef SSIZE_T ssize_t; 
+#else
+#include <fcntl.h>
 #endif
 
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+/// False when run from the command line: stdin may be the data, so never prompt on it.
+bool interactive = true;
+
 /**
  * @brief Displays the main menu to the user.
  */
@@ -23,108 +38,645 @@ void show_menu() {
     std::cout << "1. Download a file from the server (RRQ)\n";
     std::cout << "2. Upload a file to the server (WRQ)\n";
     std::cout << "3. Delete a file on the server (DEL)\n";
-    std::cout << "4. Exit\n";
-    std::cout << "Choose an option (1-4): ";
+    std::cout << "4. Copy a file on the server (COPY)\n";
+    std::cout << "5. Rename a file on the server (RENAME)\n";
+    std::cout << "6. Restore an older version (RESTORE)\n";
+    std::cout << "7. Exit\n";
+    std::cout << "Choose an option (1-7): ";
+}
+
+/**
+ * @brief Prints a received error packet.
+ * @param buffer The received datagram.
+ * @param received The number of bytes received.
+ * @return True if the datagram was an error packet.
+ */
+bool report_server_error(const void* buffer, ssize_t received) {
+    TFTPErrorPacket error;
+    if (!parse_error_packet(buffer, received, &error)) {
+        return false;
+    }
+    std::cerr << "Server error (" << error.errorCode << "): " << error.errorMessage << '\n';
+    return true;
 }
 
 /**
  * @brief Sends a request packet to the server and waits for acknowledgment.
  * @details Retries sending the request up to 3 times if no acknowledgment is received.
+ * Only an ACK carrying the packet's block number counts; stale or duplicate datagrams are skipped.
+ * An error packet from the server fails the request immediately, without further retries.
  * @param sockfd The socket file descriptor.
  * @param serverAddr The server address structure.
  * @param packet The packet to send.
+ * @param response Optional output for the acknowledgment packet.
+ * @param responder Optional output for the address the acknowledgment came from (the session address).
+ * @param stats Optional statistics; the first attempt's round trip is split into network and server time.
  * @return True if the acknowledgment was received; false otherwise.
  */
-bool send_request_with_ack(int sockfd, const sockaddr_in& serverAddr, const Packet& packet) {
-    socklen_t serverLen = sizeof(serverAddr);
-    char ackBuffer[PACKET_SIZE];
-
-    for (int attempt = 0; attempt < 3; ++attempt) { // Retry up to 3 times
-        sendto(sockfd, (char*)&packet, sizeof(Packet), 0, (struct sockaddr*)&serverAddr, serverLen);
-
-        fd_set readfds;
-        struct timeval timeout = {0, ACK_TIMEOUT * 1000};
-        FD_ZERO(&readfds);
-        FD_SET(sockfd, &readfds);
-
-        int activity = select(sockfd + 1, &readfds, nullptr, nullptr, &timeout);
-        if (activity > 0 && FD_ISSET(sockfd, &readfds)) {
-            recvfrom(sockfd, ackBuffer, PACKET_SIZE, 0, nullptr, nullptr);
+bool send_request_with_ack(int sockfd, const sockaddr_in& serverAddr, const Packet& packet,
+                           Packet* response = nullptr, sockaddr_in* responder = nullptr, TransferStats* stats = nullptr) {
+    for (int attempt = 0; attempt < MAX_RETRIES; ++attempt) { // Retry up to 3 times
+        int64_t sentUs = send_packet(sockfd, packet, serverAddr);
+
+        while (wait_readable(sockfd, ACK_TIMEOUT)) {
+            uint8_t wire[WIRE_PACKET_SIZE];
+            sockaddr_in fromAddr = {};
+            int64_t receivedUs = 0;
+            ssize_t received = receive_datagram(sockfd, wire, sizeof(wire), &fromAddr, stats, &receivedUs);
+            if (report_server_error(wire, received)) {
+                return false;
+            }
+            Packet ack;
+            if (!decode_packet(wire, received, ack) || (ack.operationID != ACK && ack.operationID != OACK) ||
+                ack.blockNumber != packet.blockNumber) {
+                continue;
+            }
+            int64_t networkUs = receivedUs - sentUs - static_cast<int64_t>(ack.processingUs);
+            if (stats && attempt == 0 && networkUs >= 0) { // Karn: no sample from retried requests
+                ++stats->rttSamples;
+                stats->networkUs += static_cast<uint64_t>(networkUs);
+                stats->processingUs += ack.processingUs;
+            }
+            if (response) *response = ack;
+            if (responder) *responder = fromAddr;
             return true; // ACK received
         }
     }
 
+    if (!interactive) {
+        std::cerr << "Acknowledgment not received after 3 attempts.\n";
+        return false;
+    }
     std::cerr << "Acknowledgment not received after 3 attempts. Would you like to retry? (y/n): ";
     char choice;
     std::cin >> choice;
-    return (choice == 'y' || choice == 'Y') ? send_request_with_ack(sockfd, serverAddr, packet) : false;
+    return (choice == 'y' || choice == 'Y') ? send_request_with_ack(sockfd, serverAddr, packet, response, responder, stats) : false;
 }
 
 /**
- * @brief Sends a Read Request (RRQ) to download a file from the server.
+ * @brief Attaches the transfer options this client would like to use to a request.
+ * @param request The RRQ or WRQ packet.
+ * @param rangeOffset First byte of a ranged RRQ.
+ * @param rangeLength Length of a ranged RRQ (0 = whole file).
+ * @param resume WRQ: offer to continue an interrupted upload.
+ * @param follow RRQ: keep receiving what is appended to the file.
+ */
+void propose_options(Packet& request, uint64_t rangeOffset = 0, uint64_t rangeLength = 0, bool resume = false,
+                     bool follow = false) {
+    TransferOptions wanted;
+    wanted.rangeOffset = rangeOffset;
+    wanted.rangeLength = rangeLength;
+    wanted.resume = resume;
+    wanted.follow = follow;
+    wanted.blockSize = CHUNK_SIZE;
+    wanted.windowSize = 16;
+    wanted.cipher = CIPHER_AES_256_CBC;
+    wanted.checksum = CHECKSUM_CRC32;
+    wanted.zeroRuns = 1;
+    request.optionsLength = static_cast<uint16_t>(encode_options(wanted, request.options, sizeof(request.options)));
+}
+
+/**
+ * @brief Extracts the options a session will use from the server's first response.
+ * @details A plain ACK (a server without option support) means the defaults.
+ * @param response The ACK or OACK packet.
+ * @return The agreed transfer options.
+ */
+TransferOptions accepted_options(const Packet& response) {
+    if (response.operationID != OACK) {
+        return TransferOptions();
+    }
+    size_t length = std::min<size_t>(response.optionsLength, sizeof(response.options));
+    return negotiate_options(decode_options(response.options, length));
+}
+
+/// Receive-queue drops seen on the client socket before the current transfer.
+uint32_t socket_drops_baseline = 0;
+
+/**
+ * @brief Prints the loss counters of a finished transfer.
+ * @details The socket's SO_RXQ_OVFL counter is cumulative; only the drops seen during
+ * this transfer are reported.
+ * @param stats The transfer statistics (kernelDrops holds the socket counter).
+ * @param out Where to print them (stderr when stdout carries downloaded data).
+ */
+void report_transfer_stats(TransferStats stats, std::ostream& out = std::cout) {
+    uint32_t socketDrops = std::max(stats.kernelDrops, socket_drops_baseline);
+    stats.kernelDrops = socketDrops - socket_drops_baseline;
+    socket_drops_baseline = socketDrops;
+    out << "Transfer stats: " << format_transfer_stats(stats) << '\n';
+}
+
+/**
+ * @brief Sizes the socket buffers for a session's window, warning if the kernel grants less.
+ * @param sockfd The socket file descriptor.
+ * @param options The negotiated transfer options.
+ */
+void size_session_buffers(int sockfd, const TransferOptions& options) {
+    size_t wanted = socket_buffer_size(options);
+    size_t granted = size_socket_buffers(sockfd, wanted);
+    if (granted < wanted) {
+        std::cerr << "Warning: socket buffers capped at " << granted << " of " << wanted
+                  << " bytes by net.core.rmem_max/wmem_max; expect kernel drops.\n";
+    }
+}
+
+/**
+ * @brief Fetches the Merkle leaf hashes of a remote file with HASHQ requests.
+ * @param sockfd The socket file descriptor.
+ * @param serverAddr The server address structure.
+ * @param filename The remote file.
+ * @param leaves Receives the chunk hashes.
+ * @return True if every leaf was received.
+ */
+bool fetch_remote_leaves(int sockfd, const sockaddr_in& serverAddr, const std::string& filename, std::vector<Hash>& leaves) {
+    leaves.clear();
+    uint64_t total = 0;
+    do {
+        Packet query = {HASHQ, {}, {}, 0};
+        strncpy(query.filename, filename.c_str(), sizeof(query.filename) - 1);
+        query.blockNumber = leaves.size();
+
+        Packet reply;
+        if (!send_request_with_ack(sockfd, serverAddr, query, &reply)) {
+            return false;
+        }
+        total = reply.fileSize;
+        size_t count = std::min<size_t>(reply.dataSize, sizeof(reply.data)) / HASH_SIZE;
+        if (count == 0) {
+            break;
+        }
+        for (size_t i = 0; i < count; ++i) {
+            Hash leaf;
+            std::memcpy(leaf.data(), reply.data + i * HASH_SIZE, HASH_SIZE);
+            leaves.push_back(leaf);
+        }
+    } while (leaves.size() < total);
+    return leaves.size() == total;
+}
+
+/**
+ * @brief Writes a block at an offset of a file without moving a shared file position.
+ * @details Positional writes let blocks land in whatever order they arrive.
+ * @param fd The file descriptor, open for writing.
+ * @param offset Where the block goes.
+ * @param block The bytes to write.
+ * @return True if every byte was written.
  */
-void send_rrq(int sockfd, const sockaddr_in& serverAddr, const std::string& filename, const std::string& key, const std::string& iv) {
+bool write_at(int fd, uint64_t offset, const std::vector<uint8_t>& block) {
+#ifdef _WIN32
+    return _lseeki64(fd, static_cast<__int64>(offset), SEEK_SET) >= 0 &&
+           _write(fd, block.data(), static_cast<unsigned>(block.size())) == static_cast<int>(block.size());
+#else
+    size_t done = 0;
+    while (done < block.size()) {
+        ssize_t written = pwrite(fd, block.data() + done, block.size() - done, static_cast<off_t>(offset + done));
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            return false;
+        }
+        done += static_cast<size_t>(written);
+    }
+    return true;
+#endif
+}
+
+/**
+ * @brief Makes a range of a file read as zeros without storing them.
+ * @details The range becomes a hole (fallocate PUNCH_HOLE, keeping the file size); where
+ * the platform or filesystem cannot punch holes, zeros are written instead.
+ * @param fd The file descriptor, open for writing.
+ * @param offset Start of the range.
+ * @param length Length of the range.
+ * @return True if the range reads as zeros.
+ */
+bool zero_range(int fd, uint64_t offset, uint64_t length) {
+#if defined(FALLOC_FL_PUNCH_HOLE) && defined(FALLOC_FL_KEEP_SIZE)
+    if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, static_cast<off_t>(offset), static_cast<off_t>(length)) == 0) {
+        return true;
+    }
+#endif
+    std::vector<uint8_t> zeros(static_cast<size_t>(std::min<uint64_t>(length, 64 * 1024)), 0);
+    for (uint64_t done = 0; done < length; done += zeros.size()) {
+        zeros.resize(static_cast<size_t>(std::min<uint64_t>(zeros.size(), length - done)));
+        if (!write_at(fd, offset + done, zeros)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief Downloads a byte range of a remote file into place in a local file.
+ * @param sockfd The socket file descriptor.
+ * @param serverAddr The server address structure.
+ * @param filename The remote file.
+ * @param offset First byte of the range.
+ * @param length Length of the range.
+ * @param fd The local file, open for writing.
+ * @param key The AES encryption key.
+ * @param iv The AES initialization vector.
+ * @return True if the whole range was received.
+ */
+bool download_range(int sockfd, const sockaddr_in& serverAddr, const std::string& filename, uint64_t offset, uint64_t length,
+                    int fd, const std::string& key, const std::string& iv) {
     Packet packet = {RRQ, {}, {}, 0};
     strncpy(packet.filename, filename.c_str(), sizeof(packet.filename) - 1);
+    propose_options(packet, offset, length);
 
-    if (!send_request_with_ack(sockfd, serverAddr, packet)) {
-        std::cerr << "Error: Failed to send RRQ for " << filename << '\n';
-        return;
+    Packet response;
+    sockaddr_in sessionAddr;
+    if (!send_request_with_ack(sockfd, serverAddr, packet, &response, &sessionAddr)) {
+        return false;
     }
 
-    std::ofstream file(filename, std::ios::binary);
-    if (!file) {
-        std::cerr << "Error: Could not create file " << filename << '\n';
-        return;
+    uint64_t written = 0;
+    std::string error;
+    bool complete = receive_data_blocks_at(sockfd, sessionAddr, accepted_options(response), key, iv, length,
+        [fd, offset](uint64_t blockOffset, const std::vector<uint8_t>& block) {
+            return write_at(fd, offset + blockOffset, block);
+        }, written, error, nullptr,
+        [fd, offset](uint64_t runOffset, uint64_t runLength) {
+            return zero_range(fd, offset + runOffset, runLength);
+        });
+    return complete && written == length;
+}
+
+/**
+ * @brief Verifies a downloaded file against the server's Merkle root and repairs it.
+ * @details Chunk hashes are computed in parallel. If the root differs, the server's leaf
+ * hashes are fetched and only the chunks whose leaves differ are downloaded again with
+ * ranged RRQs (adjacent chunks are merged into one range).
+ * @param sockfd The socket file descriptor.
+ * @param serverAddr The server address structure.
+ * @param filename The downloaded file (same name locally and remotely).
+ * @param root The Merkle root announced by the server.
+ * @param key The AES encryption key.
+ * @param iv The AES initialization vector.
+ * @return True if the file matches the root (possibly after repair).
+ */
+bool verify_and_repair(int sockfd, const sockaddr_in& serverAddr, const std::string& filename, const Hash& root,
+                       const std::string& key, const std::string& iv) {
+    std::vector<Hash> local;
+    if (!compute_chunk_hashes(filename, local)) {
+        return false;
+    }
+    if (merkle_root(local) == root) {
+        return true;
     }
 
-    char buffer[PACKET_SIZE];
-    while (true) {
-        ssize_t received = recvfrom(sockfd, buffer, PACKET_SIZE, 0, nullptr, nullptr);
-        if (received <= 0) break;
+    std::vector<Hash> remote;
+    if (!fetch_remote_leaves(sockfd, serverAddr, filename, remote) || remote.size() != local.size()) {
+        std::cerr << "Error: Could not fetch chunk hashes for " << filename << '\n';
+        return false;
+    }
 
-        std::vector<uint8_t> decrypted = aes_decrypt(std::vector<uint8_t>(buffer, buffer + received), key, iv);
-        if (!verify_checksum(decrypted, packet.checksum)) {
-            std::cerr << "Error: Checksum mismatch for " << filename << '\n';
+    std::error_code ec;
+    uint64_t fileSize = std::filesystem::file_size(filename, ec);
+    int fd = open(filename.c_str(), O_WRONLY | O_BINARY);
+    if (fd < 0) {
+        std::cerr << "Error: Could not reopen " << filename << " for repair\n";
+        return false;
+    }
+    size_t repaired = 0;
+    for (size_t i = 0; i < local.size(); ++i) {
+        if (local[i] == remote[i]) {
             continue;
         }
-        file.write(reinterpret_cast<const char*>(decrypted.data()), decrypted.size());
+        size_t end = i;
+        while (end + 1 < local.size() && local[end + 1] != remote[end + 1]) {
+            ++end;
+        }
+        uint64_t offset = static_cast<uint64_t>(i) * MERKLE_CHUNK_SIZE;
+        uint64_t length = std::min<uint64_t>(static_cast<uint64_t>(end + 1) * MERKLE_CHUNK_SIZE, fileSize) - offset;
+        if (!download_range(sockfd, serverAddr, filename, offset, length, fd, key, iv)) {
+            close(fd);
+            std::cerr << "Error: Could not re-fetch chunks " << i << "-" << end << " of " << filename << '\n';
+            return false;
+        }
+        repaired += end - i + 1;
+        i = end;
+    }
+    close(fd);
+
+    std::cout << "Re-fetched " << repaired << " damaged chunk(s) of " << filename << '\n';
+    return compute_chunk_hashes(filename, local) && merkle_root(local) == root;
+}
 
-        Packet ack = {ACK, {}, {}, 0};
-        sendto(sockfd, (char*)&ack, sizeof(Packet), 0, (struct sockaddr*)&serverAddr, sizeof(serverAddr));
+/**
+ * @brief Sends a Read Request (RRQ) to download a file from the server.
+ * @details The server answers with the file size, which is used to preallocate the
+ * destination file. Blocks are written in place at their offsets, in whatever order they
+ * arrive, and zero runs are left as holes; the download completes once every block up to the one flagged with
+ * FLAG_LAST_BLOCK has been written and acknowledged.
+ * @return True if the whole file was written and matches the server's Merkle root.
+ */
+bool send_rrq(int sockfd, const sockaddr_in& serverAddr, const std::string& filename, const std::string& key, const std::string& iv) {
+    Packet packet = {RRQ, {}, {}, 0};
+    strncpy(packet.filename, filename.c_str(), sizeof(packet.filename) - 1);
+    propose_options(packet);
+
+    Packet response;
+    sockaddr_in sessionAddr;
+    TransferStats stats;
+    stats.kernelDrops = socket_drops_baseline;
+    if (!send_request_with_ack(sockfd, serverAddr, packet, &response, &sessionAddr, &stats)) {
+        std::cerr << "Error: Failed to send RRQ for " << filename << '\n';
+        return false;
+    }
+    TransferOptions options = accepted_options(response);
+    size_session_buffers(sockfd, options);
+
+    // Preallocate the destination, then write into it without truncating.
+    {
+        std::ofstream create(filename, std::ios::binary | std::ios::trunc);
+        if (!create) {
+            send_error_packet(sockfd, sessionAddr, error_code_from_errno(errno), "Client could not create file.");
+            std::cerr << "Error: Could not create file " << filename << '\n';
+            return false;
+        }
+    }
+    std::error_code ec;
+    std::filesystem::resize_file(filename, response.fileSize, ec);
+    int fd = open(filename.c_str(), O_WRONLY | O_BINARY);
+
+    // Blocks are written at their offsets as they arrive, so reordering costs no buffering.
+    // Zero runs stay holes of the sparse preallocated file.
+    uint64_t written = 0;
+    std::string error;
+    bool complete = fd >= 0 && receive_data_blocks_at(sockfd, sessionAddr, options, key, iv, response.fileSize,
+        [fd](uint64_t offset, const std::vector<uint8_t>& block) {
+            return write_at(fd, offset, block);
+        }, written, error, &stats,
+        [fd](uint64_t offset, uint64_t length) {
+            return zero_range(fd, offset, length);
+        });
+    if (fd < 0) {
+        send_error_packet(sockfd, sessionAddr, error_code_from_errno(errno), "Client could not open file.");
+        error = "could not open the file";
+    } else {
+        close(fd);
+    }
+    report_transfer_stats(stats);
+    if (!complete) {
+        std::cerr << "Error: Download of " << filename << " failed after " << written << " bytes (" << error << ")\n";
+        std::filesystem::remove(filename, ec);
+        return false;
+    }
+    if (written != response.fileSize) {
+        std::filesystem::resize_file(filename, written, ec);
+        std::cerr << "Warning: Expected " << response.fileSize << " bytes but received " << written << '\n';
     }
 
-    file.close();
+    Hash root;
+    std::memcpy(root.data(), response.digest, HASH_SIZE);
+    if (root != Hash{} && !verify_and_repair(sockfd, serverAddr, filename, root, key, iv)) {
+        std::cerr << "Error: " << filename << " does not match the server's Merkle root\n";
+        return false;
+    }
     std::cout << "File downloaded successfully: " << filename << '\n';
+    return true;
+}
+
+/**
+ * @brief Downloads a remote file into a sink, in order, as it arrives.
+ * @details Nothing touches the local disk: blocks that arrive ahead of a gap wait in a
+ * reorder buffer of at most one window, and zero runs reach the sink as zero blocks of
+ * at most MERKLE_CHUNK_SIZE bytes. The data is hashed as it passes and checked against
+ * the server's Merkle root at the end; the sink has already consumed it by then, so a
+ * mismatch is reported rather than repaired. A followed file has no root to check: the
+ * download goes on with its appends until the server's copy is deleted, moved or truncated.
+ * @param sockfd The socket file descriptor.
+ * @param serverAddr The server address structure.
+ * @param filename The remote file.
+ * @param sink Consumer of the file's bytes; returning false aborts the download.
+ * @param key The AES encryption key.
+ * @param iv The AES initialization vector.
+ * @param log Where to print errors and statistics.
+ * @param follow Follow the file like `tail -f`.
+ * @return True if the whole file was delivered and matches the server's Merkle root.
+ */
+bool download_to_sink(int sockfd, const sockaddr_in& serverAddr, const std::string& filename, const BlockWriter& sink,
+                      const std::string& key, const std::string& iv, std::ostream& log = std::cerr, bool follow = false) {
+    Packet packet = {RRQ, {}, {}, 0};
+    strncpy(packet.filename, filename.c_str(), sizeof(packet.filename) - 1);
+    propose_options(packet, 0, 0, false, follow);
+
+    Packet response;
+    sockaddr_in sessionAddr;
+    TransferStats stats;
+    stats.kernelDrops = socket_drops_baseline;
+    if (!send_request_with_ack(sockfd, serverAddr, packet, &response, &sessionAddr, &stats)) {
+        log << "Error: Failed to send RRQ for " << filename << '\n';
+        return false;
+    }
+    TransferOptions options = accepted_options(response);
+    size_session_buffers(sockfd, options);
+    follow = follow && options.follow;
+
+    // Merkle leaves of what the sink received: SHA-256(0x00 || chunk) per MERKLE_CHUNK_SIZE bytes.
+    std::vector<Hash> leaves;
+    std::vector<uint8_t> chunk(1, 0x00);
+    auto hash = [&leaves, &chunk](const uint8_t* data, size_t length) {
+        while (length > 0) {
+            size_t take = std::min(length, MERKLE_CHUNK_SIZE + 1 - chunk.size());
+            chunk.insert(chunk.end(), data, data + take);
+            data += take;
+            length -= take;
+            if (chunk.size() == MERKLE_CHUNK_SIZE + 1) {
+                leaves.push_back(sha256(chunk.data(), chunk.size()));
+                chunk.resize(1);
+            }
+        }
+    };
+
+    uint64_t received = 0;
+    std::string error;
+    bool complete = receive_data_blocks(sockfd, sessionAddr, options, key, iv, follow ? UNKNOWN_SIZE : response.fileSize,
+        [&sink, &hash](const std::vector<uint8_t>& block) {
+            hash(block.data(), block.size());
+            return sink(block);
+        }, received, error, &stats,
+        [&sink, &hash](uint64_t length) {
+            static const std::vector<uint8_t> zeros(MERKLE_CHUNK_SIZE, 0);
+            for (uint64_t done = 0; done < length; done += zeros.size()) {
+                size_t size = static_cast<size_t>(std::min<uint64_t>(zeros.size(), length - done));
+                std::vector<uint8_t> tail;
+                const std::vector<uint8_t>* block = &zeros;
+                if (size < zeros.size()) {
+                    tail.assign(size, 0);
+                    block = &tail;
+                }
+                hash(block->data(), block->size());
+                if (!sink(*block)) {
+                    return false;
+                }
+            }
+            return true;
+        });
+    report_transfer_stats(stats, log);
+    if (!complete) {
+        log << "Error: Download of " << filename << " failed after " << received << " bytes (" << error << ")\n";
+        return false;
+    }
+    if (chunk.size() > 1) {
+        leaves.push_back(sha256(chunk.data(), chunk.size()));
+    }
+
+    Hash root;
+    std::memcpy(root.data(), response.digest, HASH_SIZE);
+    if (!follow && root != Hash{} && merkle_root(leaves) != root) {
+        log << "Error: " << filename << " does not match the server's Merkle root\n";
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Downloads a remote file to standard output.
+ * @param sockfd The socket file descriptor.
+ * @param serverAddr The server address structure.
+ * @param filename The remote file.
+ * @param key The AES encryption key.
+ * @param iv The AES initialization vector.
+ * @param follow Follow the file, flushing each block as it arrives.
+ * @return True if the whole file was written and verified.
+ */
+bool download_to_stdout(int sockfd, const sockaddr_in& serverAddr, const std::string& filename,
+                        const std::string& key, const std::string& iv, bool follow = false) {
+#ifdef _WIN32
+    _setmode(_fileno(stdout), _O_BINARY);
+#endif
+    bool ok = download_to_sink(sockfd, serverAddr, filename,
+        [follow](const std::vector<uint8_t>& block) {
+            return std::fwrite(block.data(), 1, block.size(), stdout) == block.size() &&
+                   (!follow || std::fflush(stdout) == 0);
+        }, key, iv, std::cerr, follow);
+    return std::fflush(stdout) == 0 && ok;
 }
 
 /**
  * @brief Sends a Write Request (WRQ) to upload a file to the server.
+ * @details The WRQ announces the file size, the content's Merkle root and proposes transfer
+ * options. If the server already stores that content it answers with FLAG_CONTENT_EXISTS
+ * and the upload is done; otherwise the blocks are sent to the session address the server
+ * answered from, and the last one carries FLAG_LAST_BLOCK. If an earlier attempt to upload
+ * the same content was interrupted, the server answers with the offset it already holds
+ * and only the rest is sent. Holes and all-zero blocks of the file are sent as zero runs.
+ * @return True if the server stored the whole file.
  */
-void send_wrq(int sockfd, const sockaddr_in& serverAddr, const std::string& filename, const std::string& key, const std::string& iv) {
+bool send_wrq(int sockfd, const sockaddr_in& serverAddr, const std::string& filename, const std::string& key, const std::string& iv) {
     Packet packet = {WRQ, {}, {}, 0};
     strncpy(packet.filename, filename.c_str(), sizeof(packet.filename) - 1);
+    propose_options(packet, 0, 0, true);
 
     std::ifstream file(filename, std::ios::binary);
     if (!file) {
         std::cerr << "Error: File not found: " << filename << '\n';
-        return;
+        return false;
     }
+    std::error_code ec;
+    packet.fileSize = std::filesystem::file_size(filename, ec);
 
-    while (file.read(reinterpret_cast<char*>(packet.data), sizeof(packet.data)) || file.gcount() > 0) {
-        packet.dataSize = file.gcount();
-        std::vector<uint8_t> encrypted = aes_encrypt(std::vector<uint8_t>(packet.data, packet.data + packet.dataSize), key, iv);
-        memcpy(packet.data, encrypted.data(), encrypted.size());
-        packet.checksum = calculate_checksum(encrypted);
-
-        if (!send_request_with_ack(sockfd, serverAddr, packet)) {
-            std::cerr << "Error: Failed to send WRQ for " << filename << '\n';
-            break;
-        }
+    std::vector<Hash> leaves;
+    if (compute_chunk_hashes(filename, leaves)) {
+        Hash root = merkle_root(leaves);
+        std::memcpy(packet.digest, root.data(), HASH_SIZE);
     }
 
+    Packet response;
+    sockaddr_in sessionAddr;
+    TransferStats stats;
+    stats.kernelDrops = socket_drops_baseline;
+    if (!send_request_with_ack(sockfd, serverAddr, packet, &response, &sessionAddr, &stats)) {
+        std::cerr << "Error: Failed to send WRQ for " << filename << '\n';
+        return false;
+    }
+    if (response.flags & FLAG_CONTENT_EXISTS) {
+        std::cout << "File uploaded instantly (content already on server): " << filename << '\n';
+        return true;
+    }
+    TransferOptions options = accepted_options(response);
+    size_session_buffers(sockfd, options);
+    uint64_t offset = options.resume ? std::min(options.rangeOffset, packet.fileSize) : 0;
+    if (offset > 0) {
+        std::cout << "Resuming an interrupted upload at byte " << offset << " of " << packet.fileSize << '\n';
+    }
     file.close();
+
+    // Blocks are read and encrypted ahead on another thread while the window is in flight.
+    std::string error;
+    ReadAhead source(filename, offset, packet.fileSize - offset, options, key, iv);
+    bool sent = send_data_blocks(sockfd, sessionAddr, options, packet.fileSize - offset, source, error, &stats);
+
+    report_transfer_stats(stats);
+    if (!sent) {
+        std::cerr << "Error: Failed to upload " << filename << " (" << error << ")\n";
+        return false;
+    }
+    if (source.failed()) {
+        std::cerr << "Error: Reading " << filename << " failed; the upload is incomplete\n";
+        return false;
+    }
     std::cout << "File uploaded successfully: " << filename << '\n';
+    return true;
+}
+
+/**
+ * @brief Uploads a stream of unknown length (e.g. stdin) as a new version of a file, or appends it.
+ * @details The WRQ announces UNKNOWN_SIZE and no Merkle root; the stream is read ahead on
+ * another thread and sent until it ends, and the final block carries its size. Memory use
+ * is bounded by the read-ahead ring whatever the stream's length. A stream cannot be
+ * rewound, so the upload cannot be resumed or skipped as already stored. An APPEND is sent
+ * the same way; the server's answer announces the size the stream is appended at.
+ * @param sockfd The socket file descriptor.
+ * @param serverAddr The server address structure.
+ * @param filename The name to store the stream under.
+ * @param stream The stream to send.
+ * @param key The AES encryption key.
+ * @param iv The AES initialization vector.
+ * @param operation WRQ, or APPEND to extend the latest version.
+ * @return True if the server received the whole stream.
+ */
+bool send_wrq_stream(int sockfd, const sockaddr_in& serverAddr, const std::string& filename, std::FILE* stream,
+                     const std::string& key, const std::string& iv, int operation = WRQ) {
+    const char* request = operation == APPEND ? "APPEND" : "WRQ";
+    Packet packet = {operation, {}, {}, 0};
+    strncpy(packet.filename, filename.c_str(), sizeof(packet.filename) - 1);
+    propose_options(packet);
+    packet.fileSize = UNKNOWN_SIZE;
+
+    Packet response;
+    sockaddr_in sessionAddr;
+    TransferStats stats;
+    stats.kernelDrops = socket_drops_baseline;
+    if (!send_request_with_ack(sockfd, serverAddr, packet, &response, &sessionAddr, &stats)) {
+        std::cerr << "Error: Failed to send " << request << " for " << filename << '\n';
+        return false;
+    }
+    TransferOptions options = accepted_options(response);
+    size_session_buffers(sockfd, options);
+    if (operation == APPEND) {
+        std::cerr << "Appending to " << filename << " at byte " << response.fileSize << '\n';
+    }
+
+    std::string error;
+    ReadAhead source(stream, options, key, iv);
+    bool sent = send_data_blocks(sockfd, sessionAddr, options, UNKNOWN_SIZE, source, error, &stats);
+
+    report_transfer_stats(stats);
+    if (!sent) {
+        std::cerr << "Error: Failed to upload " << filename << " (" << error << ")\n";
+        return false;
+    }
+    if (source.failed()) {
+        std::cerr << "Error: Reading the input failed; the upload is incomplete\n";
+        return false;
+    }
+    std::cerr << (operation == APPEND ? "Appended successfully: " : "Stream uploaded successfully: ") << filename << '\n';
+    return true;
 }
 
 /**
@@ -142,10 +694,39 @@ void send_del(int sockfd, const sockaddr_in& serverAddr, const std::string& file
     std::cout << "Delete request sent successfully for file: " << filename << '\n';
 }
 
+/**
+ * @brief Sends a server-side operation (COPY, RENAME or RESTORE) and prints the stored name it produced.
+ * @param sockfd The socket file descriptor.
+ * @param serverAddr The server address structure.
+ * @param operation The operation code.
+ * @param filename The file the operation applies to.
+ * @param argument The destination name (COPY, RENAME) or version suffix (RESTORE).
+ */
+void send_server_op(int sockfd, const sockaddr_in& serverAddr, int operation, const std::string& filename, const std::string& argument) {
+    Packet packet = {operation, {}, {}, 0};
+    strncpy(packet.filename, filename.c_str(), sizeof(packet.filename) - 1);
+    packet.dataSize = static_cast<uint32_t>(std::min(argument.size(), sizeof(packet.data) - 1));
+    std::memcpy(packet.data, argument.data(), packet.dataSize);
+
+    Packet response;
+    if (!send_request_with_ack(sockfd, serverAddr, packet, &response)) {
+        std::cerr << "Error: Request for " << filename << " failed.\n";
+        return;
+    }
+
+    std::string storedName(reinterpret_cast<const char*>(response.data), std::min<size_t>(response.dataSize, sizeof(response.data)));
+    std::cout << "Server stored the result as: " << storedName.c_str() << '\n';
+}
+
 /**
  * @brief Main entry point for the client application.
+ * @details Without arguments the client shows its menu. `client put FILE` uploads a file
+ * and exits; `client put - NAME` uploads stdin as NAME (e.g. `pg_dump db | client put - db.sql`).
+ * `client get NAME` downloads a file; `client get NAME -` writes it to stdout instead.
+ * `client append FILE NAME` adds a local file (or stdin, as `-`) to the end of NAME.
+ * `client follow NAME` writes a file to stdout and then what is appended to it, like `tail -f`.
  */
-int main() {
+int main(int argc, char* argv[]) {
     std::string serverIP = "127.0.0.1";
     int port = 12345;
 
@@ -159,6 +740,8 @@ int main() {
         perror("Socket creation failed");
         return -1;
     }
+    enable_drop_monitoring(sockfd);
+    enable_timestamping(sockfd, true);
 
     // Generate AES key and IV
     std::string key(AES_KEY_SIZE, '\0');
@@ -170,13 +753,62 @@ int main() {
     sendto(sockfd, key.data(), key.size(), 0, (struct sockaddr*)&serverAddr, sizeof(serverAddr));
     sendto(sockfd, iv.data(), iv.size(), 0, (struct sockaddr*)&serverAddr, sizeof(serverAddr));
 
+    if (argc > 1) {
+        std::string command = argv[1];
+        std::string source = argc > 2 ? argv[2] : "";
+        std::string name = argc > 3 ? argv[3] : source;
+        bool valid = command == "put" ? name != "-"
+                   : command == "append" ? argc == 4 && name != "-"
+                   : command == "follow" ? source != "-" && argc == 3
+                   : command == "get" && source != "-" && (name == source || name == "-");
+        if (!valid || source.empty()) {
+            std::cerr << "Usage: " << argv[0] << " [put FILE | put - NAME | append FILE|- NAME | get NAME [-] | follow NAME]\n";
+            CLOSE_SOCKET(sockfd);
+            return 2;
+        }
+        interactive = false;
+        bool ok = true;
+        if (command == "append") {
+#ifdef _WIN32
+            _setmode(_fileno(stdin), _O_BINARY);
+#endif
+            std::FILE* input = source == "-" ? stdin : std::fopen(source.c_str(), "rb");
+            if (!input) {
+                std::cerr << "Error: File not found: " << source << '\n';
+                ok = false;
+            } else {
+                ok = send_wrq_stream(sockfd, serverAddr, name, input, key, iv, APPEND);
+                if (input != stdin) {
+                    std::fclose(input);
+                }
+            }
+        } else if (command == "follow") {
+            ok = download_to_stdout(sockfd, serverAddr, source, key, iv, true);
+        } else if (command == "get") {
+            if (name == "-") {
+                ok = download_to_stdout(sockfd, serverAddr, source, key, iv);
+            } else {
+                ok = send_rrq(sockfd, serverAddr, source, key, iv);
+            }
+        } else if (source == "-") {
+#ifdef _WIN32
+            _setmode(_fileno(stdin), _O_BINARY);
+#endif
+            ok = send_wrq_stream(sockfd, serverAddr, name, stdin, key, iv);
+        } else {
+            ok = send_wrq(sockfd, serverAddr, source, key, iv);
+        }
+        CLOSE_SOCKET(sockfd);
+        return ok ? 0 : 1;
+    }
+
     while (true) {
         show_menu();
 
         int choice;
         std::cin >> choice;
 
-        if (choice == 4) {
+        if (choice == 7) {
             std::cout << "Exiting...\n";
             break;
         }
@@ -195,6 +827,21 @@ int main() {
             case 3:
                 send_del(sockfd, serverAddr, filename);
                 break;
+            case 4:
+            case 5: {
+                std::string destination;
+                std::cout << "Enter new name: ";
+                std::cin >> destination;
+                send_server_op(sockfd, serverAddr, choice == 4 ? COPY : RENAME, filename, destination);
+                break;
+            }
+            case 6: {
+                std::string version;
+                std::cout << "Enter version (YYYYMMDDHHMMSS suffix): ";
+                std::cin >> version;
+                send_server_op(sockfd, serverAddr, RESTORE, filename, version);
+                break;
+            }
             default:
                 std::cerr << "Invalid choice! Please try again.\n";
                 break;
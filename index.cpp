@@ -0,0 +1,788 @@
+/**
+ * @file index.cpp
+ * @brief Persistent server index: a memory-mapped snapshot plus a write-ahead log
+ */
+
+#include "index.hpp"
+#include "udp_file_transfer.hpp"
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <cstring>
+#include <system_error>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+static const char SNAPSHOT_MAGIC[8] = {'U', 'F', 'T', 'I', 'D', 'X', '0', '1'};
+static const char LOG_MAGIC[8] = {'U', 'F', 'T', 'W', 'A', 'L', '0', '1'};
+
+/// Longest log record accepted on replay (keys and values are file names; a batch holds many).
+constexpr uint32_t MAX_LOG_RECORD = 16 * 1024 * 1024;
+
+/// Operation byte of a log record holding a batch of changes (single changes use 0 and 1).
+constexpr uint8_t BATCH_RECORD = 2;
+
+/**
+ * @brief Appends a value to a byte buffer in host byte order (the log never leaves the server).
+ */
+template <typename T>
+static void put(std::vector<uint8_t>& bytes, T value) {
+    bytes.insert(bytes.end(), reinterpret_cast<const uint8_t*>(&value), reinterpret_cast<const uint8_t*>(&value + 1));
+}
+
+/**
+ * @brief Fixed header at the start of a snapshot, followed by the table starts, the
+ * entries and the string data (all in host byte order: the file never leaves the server).
+ */
+struct SnapshotHeader {
+    char magic[8];
+    uint64_t generation; ///< Incremented by every checkpoint
+    uint64_t tables;
+    uint64_t entries;
+    uint64_t size;       ///< Size of the whole file
+    uint32_t checksum;   ///< CRC-32 of the header (with this field zero) and the table starts
+    uint32_t reserved;
+};
+
+/**
+ * @brief Computes the checksum of a snapshot header and its table starts.
+ *
+ * @param header The header (its checksum field is ignored).
+ * @param tableStarts The table starts (`header.tables + 1` values).
+ * @return uint32_t The checksum.
+ */
+static uint32_t snapshot_checksum(SnapshotHeader header, const uint64_t* tableStarts) {
+    header.checksum = 0;
+    std::vector<uint8_t> bytes(reinterpret_cast<const uint8_t*>(&header), reinterpret_cast<const uint8_t*>(&header + 1));
+    bytes.insert(bytes.end(), reinterpret_cast<const uint8_t*>(tableStarts),
+                 reinterpret_cast<const uint8_t*>(tableStarts + header.tables + 1));
+    return crc32(bytes.data(), bytes.size());
+}
+
+/**
+ * @brief Flushes a file to the kernel and, where supported, to the disk.
+ *
+ * @param file The open file.
+ * @return True on success.
+ */
+static bool sync_file(std::FILE* file) {
+    if (std::fflush(file) != 0) {
+        return false;
+    }
+#ifndef _WIN32
+    return fsync(fileno(file)) == 0;
+#else
+    return true;
+#endif
+}
+
+/**
+ * @brief Makes a rename in a directory durable.
+ *
+ * @param file A file in the directory.
+ */
+static void sync_directory(const std::string& file) {
+#ifndef _WIN32
+    std::string directory = std::filesystem::path(file).parent_path().string();
+    int fd = ::open(directory.empty() ? "." : directory.c_str(), O_RDONLY);
+    if (fd >= 0) {
+        fsync(fd);
+        close(fd);
+    }
+#else
+    (void)file;
+#endif
+}
+
+/**
+ * @brief Creates an empty, unopened index.
+ *
+ * @param tables The number of tables.
+ */
+PersistentIndex::PersistentIndex(size_t tables) : tables_(tables), overlay_(tables) {}
+
+/**
+ * @brief Closes the log and unmaps the snapshot.
+ */
+PersistentIndex::~PersistentIndex() {
+    if (log_) {
+        std::fclose(log_);
+    }
+    unmap_snapshot();
+}
+
+/**
+ * @brief Maps the snapshot and replays the log.
+ *
+ * @param path The path of both files, without extension.
+ * @param replayed Receives the (table, key) pairs changed by the replayed log records.
+ * @return True if a valid snapshot was loaded.
+ */
+bool PersistentIndex::open(const std::string& path, std::set<std::pair<size_t, std::string>>& replayed) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    path_ = path;
+    if (!map_snapshot(path_ + ".db")) {
+        return false;
+    }
+    replay_log(replayed);
+    return true;
+}
+
+/**
+ * @brief Maps a snapshot file and checks its structure, replacing the current snapshot.
+ * @details Only the header and the table starts are read: the entries are paged in by
+ * lookups. Entries pointing outside the file read as empty strings.
+ *
+ * @param file The snapshot file.
+ * @return True if the file is a valid snapshot for this index.
+ */
+bool PersistentIndex::map_snapshot(const std::string& file) {
+    const char* data = nullptr;
+    size_t size = 0;
+    std::vector<char> copy;
+#ifndef _WIN32
+    int fd = ::open(file.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat info;
+    if (fstat(fd, &info) == 0 && info.st_size >= static_cast<off_t>(sizeof(SnapshotHeader))) {
+        size = static_cast<size_t>(info.st_size);
+        void* mapped = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapped != MAP_FAILED) {
+            madvise(mapped, size, MADV_RANDOM); // Binary searches: no read-ahead
+            data = static_cast<const char*>(mapped);
+        }
+    }
+    close(fd);
+#else
+    std::ifstream in(file, std::ios::binary);
+    copy.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    size = copy.size();
+    data = size >= sizeof(SnapshotHeader) ? copy.data() : nullptr;
+#endif
+    if (!data) {
+        return false;
+    }
+
+    SnapshotHeader header;
+    std::memcpy(&header, data, sizeof(header));
+    const uint64_t* tableStarts = reinterpret_cast<const uint64_t*>(data + sizeof(header));
+    bool valid = std::memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) == 0 && header.tables == tables_ &&
+                 header.size == size && header.entries <= size / sizeof(Entry) &&
+                 sizeof(header) + (tables_ + 1) * sizeof(uint64_t) + header.entries * sizeof(Entry) <= size &&
+                 snapshot_checksum(header, tableStarts) == header.checksum && tableStarts[0] == 0 &&
+                 tableStarts[tables_] == header.entries;
+    for (size_t table = 0; valid && table < tables_; ++table) {
+        valid = tableStarts[table] <= tableStarts[table + 1];
+    }
+    if (!valid) {
+#ifndef _WIN32
+        munmap(const_cast<char*>(data), size);
+#endif
+        return false;
+    }
+
+    unmap_snapshot();
+    snapshot_ = data;
+    snapshotSize_ = size;
+    snapshotCopy_ = std::move(copy);
+    tableStarts_ = tableStarts;
+    entries_ = reinterpret_cast<const Entry*>(tableStarts + tables_ + 1);
+    generation_ = header.generation;
+    return true;
+}
+
+/**
+ * @brief Unmaps the current snapshot.
+ */
+void PersistentIndex::unmap_snapshot() {
+#ifndef _WIN32
+    if (snapshot_) {
+        munmap(const_cast<char*>(snapshot_), snapshotSize_);
+    }
+#endif
+    snapshotCopy_.clear();
+    snapshot_ = nullptr;
+    snapshotSize_ = 0;
+    tableStarts_ = nullptr;
+    entries_ = nullptr;
+}
+
+/**
+ * @brief Returns the key of a snapshot entry.
+ *
+ * @param entry The entry.
+ * @return std::string_view The key (empty if the entry is out of bounds).
+ */
+std::string_view PersistentIndex::entry_key(const Entry& entry) const {
+    if (entry.offset > snapshotSize_ || uint64_t(entry.keyLength) + entry.valueLength > snapshotSize_ - entry.offset) {
+        return {};
+    }
+    return std::string_view(snapshot_ + entry.offset, entry.keyLength);
+}
+
+/**
+ * @brief Returns the value of a snapshot entry.
+ *
+ * @param entry The entry.
+ * @return std::string_view The value (empty if the entry is out of bounds).
+ */
+std::string_view PersistentIndex::entry_value(const Entry& entry) const {
+    if (entry.offset > snapshotSize_ || uint64_t(entry.keyLength) + entry.valueLength > snapshotSize_ - entry.offset) {
+        return {};
+    }
+    return std::string_view(snapshot_ + entry.offset + entry.keyLength, entry.valueLength);
+}
+
+/**
+ * @brief Returns the snapshot entries of a table.
+ *
+ * @param table The table.
+ * @return std::pair<const Entry*, const Entry*> The entries as [first, last), empty without a snapshot.
+ */
+std::pair<const PersistentIndex::Entry*, const PersistentIndex::Entry*> PersistentIndex::table_entries(size_t table) const {
+    if (!snapshot_) {
+        return {nullptr, nullptr};
+    }
+    return {entries_ + tableStarts_[table], entries_ + tableStarts_[table + 1]};
+}
+
+/**
+ * @brief Binary-searches the snapshot entries of a table.
+ *
+ * @param table The table.
+ * @param key The key.
+ * @param value The value.
+ * @return const Entry* The first entry not ordered before (key, value).
+ */
+const PersistentIndex::Entry* PersistentIndex::lower_bound(size_t table, std::string_view key, std::string_view value) const {
+    auto range = table_entries(table);
+    return std::lower_bound(range.first, range.second, std::make_pair(key, value),
+        [this](const Entry& entry, const std::pair<std::string_view, std::string_view>& target) {
+            return std::make_pair(entry_key(entry), entry_value(entry)) < target;
+        });
+}
+
+/**
+ * @brief Checks the snapshot for a pair.
+ *
+ * @param table The table.
+ * @param key The key.
+ * @param value The value.
+ * @return True if the snapshot holds the pair.
+ */
+bool PersistentIndex::snapshot_contains(size_t table, const std::string& key, const std::string& value) const {
+    const Entry* entry = lower_bound(table, key, value);
+    return entry != table_entries(table).second && entry_key(*entry) == key && entry_value(*entry) == value;
+}
+
+/**
+ * @brief Applies a change to the overlay.
+ *
+ * @param insert True to add the pair, false to remove it.
+ * @param table The table.
+ * @param key The key.
+ * @param value The value.
+ */
+void PersistentIndex::apply(bool insert, size_t table, const std::string& key, const std::string& value) {
+    auto& overlay = overlay_[table];
+    if (insert == snapshot_contains(table, key, value)) {
+        overlay.erase({key, value}); // Back to what the snapshot says
+    } else {
+        overlay[{key, value}] = insert;
+    }
+}
+
+/**
+ * @brief Checks the overlay, then the snapshot, for a pair.
+ *
+ * @param table The table.
+ * @param key The key.
+ * @param value The value.
+ * @return True if the pair is in the index.
+ */
+bool PersistentIndex::present(size_t table, const std::string& key, const std::string& value) const {
+    auto it = overlay_[table].find({key, value});
+    return it != overlay_[table].end() ? it->second : snapshot_contains(table, key, value);
+}
+
+/**
+ * @brief Applies a change and appends it to the log.
+ * @details A record is `crc32 | length | op | table | keyLength | key | value`, the CRC
+ * covering everything after the length.
+ *
+ * @param insert True to add the pair, false to remove it.
+ * @param table The table.
+ * @param key The key.
+ * @param value The value.
+ * @return True if the change was logged, or if there is nothing to log (no change, or no snapshot yet).
+ */
+bool PersistentIndex::record(bool insert, size_t table, const std::string& key, const std::string& value) {
+    if (present(table, key, value) == insert) {
+        return true; // Already so
+    }
+    apply(insert, table, key, value);
+    ++pending_;
+    if (generation_ == 0) {
+        return true; // Being rebuilt; checkpoint() writes the first snapshot
+    }
+
+    return log_change(insert, table, key, value);
+}
+
+/**
+ * @brief Appends a single change to the log.
+ *
+ * @param insert True to add the pair, false to remove it.
+ * @param table The table.
+ * @param key The key.
+ * @param value The value.
+ * @return True if the record was written.
+ */
+bool PersistentIndex::log_change(bool insert, size_t table, const std::string& key, const std::string& value) {
+    std::vector<uint8_t> payload = {static_cast<uint8_t>(insert), static_cast<uint8_t>(table)};
+    put(payload, static_cast<uint32_t>(key.size()));
+    payload.insert(payload.end(), key.begin(), key.end());
+    payload.insert(payload.end(), value.begin(), value.end());
+    return append_record(payload);
+}
+
+/**
+ * @brief Appends a record to the log.
+ *
+ * @param payload The record after its header (the operation byte first).
+ * @return True if the record was written.
+ */
+bool PersistentIndex::append_record(const std::vector<uint8_t>& payload) {
+    if (!log_) {
+        return false;
+    }
+    std::vector<uint8_t> bytes;
+    put(bytes, crc32(payload.data(), payload.size()));
+    put(bytes, static_cast<uint32_t>(payload.size()));
+    bytes.insert(bytes.end(), payload.begin(), payload.end());
+    if (std::fwrite(bytes.data(), 1, bytes.size(), log_) != bytes.size() || std::fflush(log_) != 0) {
+        return false;
+    }
+    ++appended_;
+    return true;
+}
+
+/**
+ * @brief Applies several changes and appends them to the log as one record.
+ * @details A batch record is `crc32 | length | 2 | changes`, each change being
+ * `op | table | keyLength | valueLength | key | value`. Changes that are already so are left out.
+ *
+ * @param changes The changes, applied in order.
+ * @return True if the changes were logged, or if there is nothing to log.
+ */
+bool PersistentIndex::update(const std::vector<Change>& changes) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::vector<uint8_t> payload = {BATCH_RECORD};
+    bool changed = false;
+    for (const Change& change : changes) {
+        if (present(change.table, change.key, change.value) == change.insert) {
+            continue;
+        }
+        apply(change.insert, change.table, change.key, change.value);
+        ++pending_;
+        changed = true;
+        payload.push_back(static_cast<uint8_t>(change.insert));
+        payload.push_back(static_cast<uint8_t>(change.table));
+        put(payload, static_cast<uint32_t>(change.key.size()));
+        put(payload, static_cast<uint32_t>(change.value.size()));
+        payload.insert(payload.end(), change.key.begin(), change.key.end());
+        payload.insert(payload.end(), change.value.begin(), change.value.end());
+    }
+    return !changed || generation_ == 0 || append_record(payload);
+}
+
+/**
+ * @brief Replays the log into the overlay and opens it for appending.
+ * @details A log of the previous generation (a checkpoint crashed before resetting it) is
+ * replayed too and then rewritten for the current one; a log of any other generation is
+ * discarded. A torn or corrupt record ends the replay and the log is truncated there.
+ *
+ * @param replayed Receives the (table, key) pairs changed by the replayed records.
+ */
+void PersistentIndex::replay_log(std::set<std::pair<size_t, std::string>>& replayed) {
+    std::string file = path_ + ".wal";
+    std::ifstream in(file, std::ios::binary);
+    std::vector<uint8_t> log((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    in.close();
+
+    uint64_t generation = 0;
+    if (log.size() < sizeof(LOG_MAGIC) + sizeof(generation) || std::memcmp(log.data(), LOG_MAGIC, sizeof(LOG_MAGIC)) != 0 ||
+        (std::memcpy(&generation, log.data() + sizeof(LOG_MAGIC), sizeof(generation)),
+         generation != generation_ && generation + 1 != generation_)) {
+        reset_log();
+        return;
+    }
+
+    size_t position = sizeof(LOG_MAGIC) + sizeof(generation);
+    while (log.size() - position >= 2 * sizeof(uint32_t)) {
+        uint32_t header[2];
+        std::memcpy(header, log.data() + position, sizeof(header));
+        const uint8_t* payload = log.data() + position + sizeof(header);
+        uint32_t length = header[1];
+        if (length < 2 + sizeof(uint32_t) || length > MAX_LOG_RECORD || length > log.size() - position - sizeof(header) ||
+            crc32(payload, length) != header[0]) {
+            break;
+        }
+        std::vector<Change> changes;
+        if (payload[0] == BATCH_RECORD) {
+            const size_t fixed = 2 + 2 * sizeof(uint32_t);
+            size_t at = 1;
+            while (at + fixed <= length) {
+                uint32_t keyLength, valueLength;
+                std::memcpy(&keyLength, payload + at + 2, sizeof(keyLength));
+                std::memcpy(&valueLength, payload + at + 2 + sizeof(keyLength), sizeof(valueLength));
+                if (payload[at] > 1 || payload[at + 1] >= tables_ || keyLength > length - at - fixed ||
+                    valueLength > length - at - fixed - keyLength) {
+                    break;
+                }
+                const char* text = reinterpret_cast<const char*>(payload + at + fixed);
+                changes.push_back({payload[at] == 1, payload[at + 1], std::string(text, keyLength),
+                                   std::string(text + keyLength, valueLength)});
+                at += fixed + keyLength + valueLength;
+            }
+            if (at != length) {
+                break; // Malformed batch: none of it applies
+            }
+        } else {
+            uint32_t keyLength;
+            std::memcpy(&keyLength, payload + 2, sizeof(keyLength));
+            if (payload[0] > 1 || payload[1] >= tables_ || keyLength > length - 2 - sizeof(keyLength)) {
+                break;
+            }
+            const char* text = reinterpret_cast<const char*>(payload + 2 + sizeof(keyLength));
+            changes.push_back({payload[0] == 1, payload[1], std::string(text, keyLength),
+                               std::string(text + keyLength, length - 2 - sizeof(keyLength) - keyLength)});
+        }
+        for (const Change& change : changes) {
+            apply(change.insert, change.table, change.key, change.value);
+            replayed.insert({change.table, change.key});
+            ++pending_;
+        }
+        position += sizeof(header) + length;
+    }
+
+    std::error_code ec;
+    if (generation != generation_) {
+        rewrite_log(); // Later appends must belong to the current snapshot
+        return;
+    }
+    if (position < log.size()) {
+        std::filesystem::resize_file(file, position, ec); // Drop the torn tail
+    }
+    log_ = std::fopen(file.c_str(), "ab");
+}
+
+/**
+ * @brief Atomically replaces the log with an empty log of the current generation.
+ *
+ * @return True on success; the index then logs into the new file.
+ */
+bool PersistentIndex::reset_log() {
+    if (log_) {
+        std::fclose(log_);
+        log_ = nullptr;
+    }
+    std::string file = path_ + ".wal", temp = file + ".tmp";
+    std::FILE* out = std::fopen(temp.c_str(), "wb");
+    if (!out) {
+        return false;
+    }
+    bool written = std::fwrite(LOG_MAGIC, 1, sizeof(LOG_MAGIC), out) == sizeof(LOG_MAGIC) &&
+                   std::fwrite(&generation_, sizeof(generation_), 1, out) == 1 && sync_file(out);
+    std::fclose(out);
+    if (!written || std::rename(temp.c_str(), file.c_str()) != 0) {
+        std::remove(temp.c_str());
+        return false;
+    }
+    sync_directory(file);
+    log_ = std::fopen(file.c_str(), "ab");
+    return log_ != nullptr;
+}
+
+/**
+ * @brief Replaces the log with a log of the current generation holding the overlay, and syncs it.
+ *
+ * @return True on success; pending() then counts the overlay.
+ */
+bool PersistentIndex::rewrite_log() {
+    bool written = reset_log();
+    pending_ = 0;
+    for (size_t table = 0; table < tables_; ++table) {
+        for (const auto& change : overlay_[table]) {
+            written = log_change(change.second, table, change.first.first, change.first.second) && written;
+            ++pending_;
+        }
+    }
+    written = written && sync_file(log_);
+    if (written) {
+        synced_ = appended_;
+    }
+    return written;
+}
+
+/**
+ * @brief Adds a pair to a table.
+ *
+ * @param table The table.
+ * @param key The key.
+ * @param value The value.
+ * @return True unless the change could not be logged.
+ */
+bool PersistentIndex::insert(size_t table, const std::string& key, const std::string& value) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return record(true, table, key, value);
+}
+
+/**
+ * @brief Removes a pair from a table.
+ *
+ * @param table The table.
+ * @param key The key.
+ * @param value The value.
+ * @return True unless the change could not be logged.
+ */
+bool PersistentIndex::erase(size_t table, const std::string& key, const std::string& value) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return record(false, table, key, value);
+}
+
+/**
+ * @brief Checks whether a table holds a pair.
+ *
+ * @param table The table.
+ * @param key The key.
+ * @param value The value.
+ * @return True if present.
+ */
+bool PersistentIndex::contains(size_t table, const std::string& key, const std::string& value) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return present(table, key, value);
+}
+
+/**
+ * @brief Lists the values of a key.
+ *
+ * @param table The table.
+ * @param key The key.
+ * @return std::vector<std::string> The values in byte order.
+ */
+std::vector<std::string> PersistentIndex::values(size_t table, const std::string& key) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    const auto& overlay = overlay_[table];
+    std::set<std::string> result;
+    for (const Entry* entry = lower_bound(table, key, {}); entry != table_entries(table).second && entry_key(*entry) == key; ++entry) {
+        std::string value(entry_value(*entry));
+        auto it = overlay.find({key, value});
+        if (it == overlay.end() || it->second) {
+            result.insert(std::move(value));
+        }
+    }
+    for (auto it = overlay.lower_bound({key, std::string()}); it != overlay.end() && it->first.first == key; ++it) {
+        if (it->second) {
+            result.insert(it->first.second);
+        }
+    }
+    return std::vector<std::string>(result.begin(), result.end());
+}
+
+/**
+ * @brief Lists the distinct keys of a table.
+ *
+ * @param table The table.
+ * @return std::vector<std::string> The keys with at least one value, in byte order.
+ */
+std::vector<std::string> PersistentIndex::keys(size_t table) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    const auto& overlay = overlay_[table];
+    std::set<std::string> result;
+    auto range = table_entries(table);
+    for (const Entry* entry = range.first; entry != range.second; ++entry) {
+        std::string_view key = entry_key(*entry);
+        auto it = overlay.find({std::string(key), std::string(entry_value(*entry))});
+        if (it == overlay.end() || it->second) {
+            result.emplace(key);
+        }
+    }
+    for (const auto& change : overlay) {
+        if (change.second) {
+            result.insert(change.first.first);
+        }
+    }
+    return std::vector<std::string>(result.begin(), result.end());
+}
+
+/**
+ * @brief Returns the number of changes not yet folded into the snapshot.
+ *
+ * @return size_t The count.
+ */
+size_t PersistentIndex::pending() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return pending_;
+}
+
+/**
+ * @brief Makes every change logged so far durable.
+ * @details The log is synced through a duplicate descriptor outside `mutex_`, so changes
+ * continue while the disk works; whoever waits for `syncMutex_` meanwhile finds its records
+ * covered by that sync and returns without another one.
+ *
+ * @return True if the changes logged before the call are on disk.
+ */
+bool PersistentIndex::sync() {
+    uint64_t target;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        target = appended_;
+    }
+    std::lock_guard<std::mutex> syncLock(syncMutex_);
+    uint64_t covered;
+#ifndef _WIN32
+    int fd = -1;
+#endif
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (synced_ >= target) {
+            return true;
+        }
+        if (!log_) {
+            return false;
+        }
+        covered = appended_;
+#ifndef _WIN32
+        fd = dup(fileno(log_));
+#endif
+    }
+#ifndef _WIN32
+    bool synced = fd >= 0 && fsync(fd) == 0;
+    if (fd >= 0) {
+        close(fd);
+    }
+#else
+    bool synced = true; // Flushed with every record; Windows has no cheap fsync of a shared FILE
+#endif
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (synced) {
+        synced_ = std::max(synced_, covered);
+    }
+    return synced;
+}
+
+/**
+ * @brief Writes the current contents as a new snapshot and starts a new log.
+ * @details The overlay is copied under the lock; the snapshot and the copy are then merged
+ * table by table (both are sorted), written to a temporary file, synced and renamed over the
+ * snapshot without it (only checkpoints unmap the snapshot, and they run one at a time).
+ * Back under the lock, the new snapshot is mapped, the overlay becomes the changes made
+ * during the write, and the log is rewritten with just those. Until then, the old log is
+ * replayed on top of the new snapshot if the server crashes.
+ *
+ * @return True on success.
+ */
+bool PersistentIndex::checkpoint() {
+    std::lock_guard<std::mutex> checkpointLock(checkpointMutex_);
+    std::vector<std::map<std::pair<std::string, std::string>, bool>> copy;
+    uint64_t generation;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        copy = overlay_;
+        generation = generation_;
+    }
+
+    using Pair = std::pair<std::string_view, std::string_view>;
+    std::vector<Pair> merged;
+    std::vector<uint64_t> tableStarts = {0};
+    for (size_t table = 0; table < tables_; ++table) {
+        auto range = table_entries(table);
+        const Entry* entry = range.first;
+        auto change = copy[table].begin(), changesEnd = copy[table].end();
+        while (entry != range.second || change != changesEnd) {
+            Pair fromSnapshot = entry != range.second ? Pair(entry_key(*entry), entry_value(*entry)) : Pair();
+            Pair fromOverlay = change != changesEnd ? Pair(change->first.first, change->first.second) : Pair();
+            if (change == changesEnd || (entry != range.second && fromSnapshot < fromOverlay)) {
+                merged.push_back(fromSnapshot);
+                ++entry;
+                continue;
+            }
+            if (entry != range.second && fromSnapshot == fromOverlay) {
+                ++entry; // The overlay decides
+            }
+            if (change->second) {
+                merged.push_back(fromOverlay);
+            }
+            ++change;
+        }
+        tableStarts.push_back(merged.size());
+    }
+
+    SnapshotHeader header = {};
+    std::memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+    header.generation = generation + 1;
+    header.tables = tables_;
+    header.entries = merged.size();
+    uint64_t offset = sizeof(header) + tableStarts.size() * sizeof(uint64_t) + merged.size() * sizeof(Entry);
+    std::vector<Entry> entries;
+    entries.reserve(merged.size());
+    for (const Pair& pair : merged) {
+        entries.push_back({offset, static_cast<uint32_t>(pair.first.size()), static_cast<uint32_t>(pair.second.size())});
+        offset += pair.first.size() + pair.second.size();
+    }
+    header.size = offset;
+    header.checksum = snapshot_checksum(header, tableStarts.data());
+
+    std::string file = path_ + ".db", temp = file + ".tmp";
+    std::FILE* out = std::fopen(temp.c_str(), "wb");
+    if (!out) {
+        return false;
+    }
+    bool written = std::fwrite(&header, sizeof(header), 1, out) == 1 &&
+                   std::fwrite(tableStarts.data(), sizeof(uint64_t), tableStarts.size(), out) == tableStarts.size() &&
+                   std::fwrite(entries.data(), sizeof(Entry), entries.size(), out) == entries.size();
+    for (size_t i = 0; written && i < merged.size(); ++i) {
+        written = std::fwrite(merged[i].first.data(), 1, merged[i].first.size(), out) == merged[i].first.size() &&
+                  std::fwrite(merged[i].second.data(), 1, merged[i].second.size(), out) == merged[i].second.size();
+    }
+    written = written && sync_file(out);
+    std::fclose(out);
+    if (!written || std::rename(temp.c_str(), file.c_str()) != 0) {
+        std::remove(temp.c_str());
+        return false;
+    }
+    sync_directory(file);
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    // The state of every pair changed since the old snapshot, before that snapshot goes away.
+    std::vector<std::map<std::pair<std::string, std::string>, bool>> current(tables_);
+    for (size_t table = 0; table < tables_; ++table) {
+        for (const auto* changes : {&copy[table], &overlay_[table]}) {
+            for (const auto& change : *changes) {
+                current[table].emplace(change.first, present(table, change.first.first, change.first.second));
+            }
+        }
+    }
+    if (!map_snapshot(file)) {
+        return false;
+    }
+    for (size_t table = 0; table < tables_; ++table) {
+        overlay_[table].clear();
+        for (const auto& change : current[table]) {
+            if (change.second != snapshot_contains(table, change.first.first, change.first.second)) {
+                overlay_[table].insert(change);
+            }
+        }
+    }
+    return rewrite_log();
+}
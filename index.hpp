@@ -0,0 +1,207 @@
+/**
+ * @file index.hpp
+ * @brief Persistent server index: a memory-mapped snapshot plus a write-ahead log
+ */
+
+#ifndef INDEX_HPP
+#define INDEX_HPP
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <map>
+#include <set>
+#include <utility>
+#include <mutex>
+#include <cstdio>
+#include <cstddef>
+#include <cstdint>
+
+/// Write-ahead log records after which the log is folded into a new snapshot.
+constexpr size_t INDEX_CHECKPOINT_RECORDS = 64 * 1024;
+
+/**
+ * @class PersistentIndex
+ * @brief Sets of (key, value) string pairs, grouped in a fixed number of tables, that survive restarts.
+ * @details The bulk of the index is a snapshot file of sorted fixed-width entries that is
+ * memory-mapped and binary-searched in place: opening it costs the same whatever the size
+ * of the store, and pages are only read as lookups touch them. Changes made since the
+ * snapshot live in an in-memory overlay and are appended to a write-ahead log. A checkpoint
+ * merges both into a new snapshot (written aside, synced, and renamed over the old one)
+ * and starts an empty log.
+ *
+ * Every log record carries a CRC-32, and the log carries the generation of the snapshot
+ * it applies to. Replay stops at the first torn or corrupt record and truncates the log
+ * there. A log left behind by a crash between a checkpoint's rename and the log reset has
+ * the previous generation; it is replayed in full on top of the new snapshot, which is
+ * correct because the last change to a pair decides its state.
+ * Log records are flushed to the kernel as they are made, and synced by sync(), which
+ * callers invoke at their commit points; concurrent callers share one fsync (group commit).
+ *
+ * A checkpoint copies the overlay under the lock and writes the snapshot without it, so
+ * lookups and changes continue meanwhile; changes made during the write are carried over
+ * into the new log.
+ *
+ * All members are thread-safe.
+ */
+class PersistentIndex {
+public:
+    /**
+     * @brief Creates an empty, unopened index.
+     * @param tables The number of tables (a snapshot with another count is rejected).
+     */
+    explicit PersistentIndex(size_t tables);
+
+    ~PersistentIndex();
+
+    PersistentIndex(const PersistentIndex&) = delete;
+    PersistentIndex& operator=(const PersistentIndex&) = delete;
+
+    /**
+     * @brief Maps the snapshot `<path>.db` and replays the log `<path>.wal`.
+     * @details Without a valid snapshot the index stays empty and changes are kept in memory
+     * only, until the caller has rebuilt it and calls checkpoint().
+     * @param path The path of both files, without extension.
+     * @param replayed Receives the (table, key) pairs changed by the replayed log records.
+     * @return True if a valid snapshot was loaded.
+     */
+    bool open(const std::string& path, std::set<std::pair<size_t, std::string>>& replayed);
+
+    /**
+     * @brief Adds a pair to a table (no-op if present).
+     * @return False if the change could not be logged (it still applies until restart).
+     */
+    bool insert(size_t table, const std::string& key, const std::string& value);
+
+    /**
+     * @brief Removes a pair from a table (no-op if absent).
+     * @return False if the change could not be logged (it still applies until restart).
+     */
+    bool erase(size_t table, const std::string& key, const std::string& value);
+
+    /// One change made by update().
+    struct Change {
+        bool insert;       ///< True to add the pair, false to remove it
+        size_t table;
+        std::string key;
+        std::string value;
+    };
+
+    /**
+     * @brief Applies several changes as one log record, so that after a crash either all
+     * or none of them are replayed.
+     * @return False if the changes could not be logged (they still apply until restart).
+     */
+    bool update(const std::vector<Change>& changes);
+
+    /**
+     * @brief Checks whether a table holds a pair.
+     */
+    bool contains(size_t table, const std::string& key, const std::string& value) const;
+
+    /**
+     * @brief Lists the values of a key.
+     * @return The values in byte order.
+     */
+    std::vector<std::string> values(size_t table, const std::string& key) const;
+
+    /**
+     * @brief Lists the distinct keys of a table (walks the whole table; meant for background work).
+     * @return The keys in byte order.
+     */
+    std::vector<std::string> keys(size_t table) const;
+
+    /// @return The number of changes not yet folded into the snapshot.
+    size_t pending() const;
+
+    /**
+     * @brief Makes every change logged so far durable (fsync of the log).
+     * @details Callers that arrive while a sync is running wait for it, and skip their own
+     * if it already covered their changes.
+     * @return False if the log could not be synced.
+     */
+    bool sync();
+
+    /**
+     * @brief Writes the current contents as a new snapshot and starts a log with only the
+     * changes made while it was written.
+     * @details Only copying the overlay and switching to the new files hold the lock.
+     * @return True on success; on failure the previous snapshot and log stay in use.
+     */
+    bool checkpoint();
+
+private:
+    /// A snapshot entry: the key, immediately followed by the value, at `offset` in the file.
+    struct Entry {
+        uint64_t offset;
+        uint32_t keyLength;
+        uint32_t valueLength;
+    };
+
+    /// Maps a snapshot file, replacing the current one.
+    bool map_snapshot(const std::string& file);
+
+    /// Unmaps the current snapshot.
+    void unmap_snapshot();
+
+    /// @return The key of a snapshot entry.
+    std::string_view entry_key(const Entry& entry) const;
+
+    /// @return The value of a snapshot entry.
+    std::string_view entry_value(const Entry& entry) const;
+
+    /// @return The snapshot entries of a table, as [first, last).
+    std::pair<const Entry*, const Entry*> table_entries(size_t table) const;
+
+    /// @return The first snapshot entry of a table not ordered before (key, value).
+    const Entry* lower_bound(size_t table, std::string_view key, std::string_view value) const;
+
+    /// Checks the snapshot for a pair. Callers hold `mutex_`.
+    bool snapshot_contains(size_t table, const std::string& key, const std::string& value) const;
+
+    /// Applies a change to the overlay. Callers hold `mutex_`.
+    void apply(bool insert, size_t table, const std::string& key, const std::string& value);
+
+    /// Checks the overlay, then the snapshot, for a pair. Callers hold `mutex_`.
+    bool present(size_t table, const std::string& key, const std::string& value) const;
+
+    /// Applies a change and appends it to the log. Callers hold `mutex_`.
+    bool record(bool insert, size_t table, const std::string& key, const std::string& value);
+
+    /// Appends a single change to the log. Callers hold `mutex_`.
+    bool log_change(bool insert, size_t table, const std::string& key, const std::string& value);
+
+    /// Appends a record payload, with its CRC and length, to the log. Callers hold `mutex_`.
+    bool append_record(const std::vector<uint8_t>& payload);
+
+    /// Replays `<path>.wal` into the overlay and opens it for appending.
+    void replay_log(std::set<std::pair<size_t, std::string>>& replayed);
+
+    /// Atomically replaces `<path>.wal` with an empty log of the current generation.
+    bool reset_log();
+
+    /// Replaces `<path>.wal` with a synced log of the current generation holding the overlay. Callers hold `mutex_`.
+    bool rewrite_log();
+
+    size_t tables_;
+    std::string path_;
+    mutable std::mutex mutex_;
+    std::mutex syncMutex_;       ///< Held by the one caller running an fsync
+    std::mutex checkpointMutex_; ///< Held for a whole checkpoint (only one at a time)
+
+    const char* snapshot_ = nullptr; ///< Mapped snapshot file
+    size_t snapshotSize_ = 0;
+    std::vector<char> snapshotCopy_; ///< Holds the snapshot where mmap is unavailable
+    const uint64_t* tableStarts_ = nullptr; ///< Entry index where every table starts (tables_ + 1 values)
+    const Entry* entries_ = nullptr;
+    uint64_t generation_ = 0;
+
+    /// Changes since the snapshot per table: (key, value) -> present (false: erased from the snapshot).
+    std::vector<std::map<std::pair<std::string, std::string>, bool>> overlay_;
+    std::FILE* log_ = nullptr;
+    size_t pending_ = 0;
+    uint64_t appended_ = 0; ///< Records written to the log since open
+    uint64_t synced_ = 0;   ///< Records known to be on disk (appended_ when all are)
+};
+
+#endif // INDEX_HPP
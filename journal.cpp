@@ -0,0 +1,187 @@
+/**
+ * @file journal.cpp
+ * @brief Journal of an upload in flight, so an interrupted upload can be resumed
+ */
+
+#include "journal.hpp"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+static const char JOURNAL_MAGIC[8] = {'U', 'F', 'T', 'J', 'R', 'N', '0', '1'};
+
+/**
+ * @brief Appends a value's bytes to a buffer (host byte order: journals never leave the server).
+ *
+ * @param out The buffer.
+ * @param value The value.
+ */
+template <typename T>
+static void put(std::vector<uint8_t>& out, const T& value) {
+    const uint8_t* bytes = reinterpret_cast<const uint8_t*>(&value);
+    out.insert(out.end(), bytes, bytes + sizeof(T));
+}
+
+/**
+ * @brief Reads a value's bytes from a buffer.
+ *
+ * @param in The buffer.
+ * @param position The read position, advanced past the value.
+ * @param value Receives the value.
+ * @return True if the buffer held enough bytes.
+ */
+template <typename T>
+static bool get(const std::vector<uint8_t>& in, size_t& position, T& value) {
+    if (in.size() - position < sizeof(T)) {
+        return false;
+    }
+    std::memcpy(&value, in.data() + position, sizeof(T));
+    position += sizeof(T);
+    return true;
+}
+
+/**
+ * @brief Starts the journal of a new upload.
+ *
+ * @param name The logical file name.
+ * @param fileSize The announced size.
+ * @param digest The announced Merkle root.
+ */
+UploadJournal::UploadJournal(std::string name, uint64_t fileSize, const Hash& digest)
+    : name_(std::move(name)), fileSize_(fileSize), digest_(digest), partial_(1, 0x00) {}
+
+/**
+ * @brief Loads a saved journal.
+ * @details Layout: magic, file size, digest, name length and name, leaf count and leaves,
+ * then the CRC-32 of everything before it.
+ *
+ * @param path The journal file.
+ * @param journal Receives the journal.
+ * @return True if the file is a complete, intact journal.
+ */
+bool UploadJournal::load(const std::string& path, UploadJournal& journal) {
+    std::ifstream file(path, std::ios::binary);
+    std::vector<uint8_t> in((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    uint32_t crc = 0;
+    if (in.size() < sizeof(JOURNAL_MAGIC) + sizeof(crc) || std::memcmp(in.data(), JOURNAL_MAGIC, sizeof(JOURNAL_MAGIC)) != 0) {
+        return false;
+    }
+    std::memcpy(&crc, in.data() + in.size() - sizeof(crc), sizeof(crc));
+    in.resize(in.size() - sizeof(crc));
+    if (crc32(in.data(), in.size()) != crc) {
+        return false;
+    }
+
+    size_t position = sizeof(JOURNAL_MAGIC);
+    uint64_t fileSize = 0, leafCount = 0;
+    uint32_t nameLength = 0;
+    Hash digest;
+    if (!get(in, position, fileSize) || !get(in, position, digest) || !get(in, position, nameLength) ||
+        in.size() - position < nameLength) {
+        return false;
+    }
+    UploadJournal loaded(std::string(reinterpret_cast<const char*>(in.data() + position), nameLength), fileSize, digest);
+    position += nameLength;
+    if (!get(in, position, leafCount) || (in.size() - position) / HASH_SIZE < leafCount) {
+        return false;
+    }
+    loaded.leaves_.resize(static_cast<size_t>(leafCount));
+    for (Hash& leaf : loaded.leaves_) {
+        get(in, position, leaf);
+    }
+    journal = std::move(loaded);
+    return true;
+}
+
+/**
+ * @brief Saves the progress up to the last whole chunk.
+ *
+ * @param path The journal file.
+ * @return True on success.
+ */
+bool UploadJournal::save(const std::string& path) const {
+    std::vector<uint8_t> out(JOURNAL_MAGIC, JOURNAL_MAGIC + sizeof(JOURNAL_MAGIC));
+    put(out, fileSize_);
+    put(out, digest_);
+    put(out, static_cast<uint32_t>(name_.size()));
+    out.insert(out.end(), name_.begin(), name_.end());
+    put(out, static_cast<uint64_t>(leaves_.size()));
+    for (const Hash& leaf : leaves_) {
+        put(out, leaf);
+    }
+    put(out, crc32(out.data(), out.size()));
+
+    std::string temp = path + ".tmp";
+    std::FILE* file = std::fopen(temp.c_str(), "wb");
+    if (!file) {
+        return false;
+    }
+    bool written = std::fwrite(out.data(), 1, out.size(), file) == out.size() && std::fflush(file) == 0;
+#ifndef _WIN32
+    written = written && fsync(fileno(file)) == 0;
+#endif
+    std::fclose(file);
+    if (!written || std::rename(temp.c_str(), path.c_str()) != 0) {
+        std::remove(temp.c_str());
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Records received bytes, hashing every chunk they complete.
+ *
+ * @param data The bytes.
+ * @param length The number of bytes.
+ */
+void UploadJournal::append(const uint8_t* data, size_t length) {
+    while (length > 0) {
+        size_t take = std::min(length, MERKLE_CHUNK_SIZE + 1 - partial_.size());
+        partial_.insert(partial_.end(), data, data + take);
+        data += take;
+        length -= take;
+        if (partial_.size() == MERKLE_CHUNK_SIZE + 1) {
+            leaves_.push_back(sha256(partial_.data(), partial_.size()));
+            partial_.resize(1);
+        }
+    }
+}
+
+/**
+ * @brief Records a run of zero bytes, reusing the leaf of a whole zero chunk.
+ *
+ * @param length The number of zero bytes.
+ */
+void UploadJournal::append_zeros(uint64_t length) {
+    static const std::vector<uint8_t> zeros(MERKLE_CHUNK_SIZE, 0);
+    static const Hash zeroLeaf = [] {
+        std::vector<uint8_t> chunk(MERKLE_CHUNK_SIZE + 1, 0); // The leaf prefix is 0x00 too
+        return sha256(chunk.data(), chunk.size());
+    }();
+    if (partial_.size() > 1) { // Complete the chunk in progress first
+        size_t take = static_cast<size_t>(std::min<uint64_t>(length, MERKLE_CHUNK_SIZE + 1 - partial_.size()));
+        append(zeros.data(), take);
+        length -= take;
+    }
+    leaves_.insert(leaves_.end(), static_cast<size_t>(length / MERKLE_CHUNK_SIZE), zeroLeaf);
+    append(zeros.data(), static_cast<size_t>(length % MERKLE_CHUNK_SIZE));
+}
+
+/**
+ * @brief Hashes the final partial chunk.
+ *
+ * @return std::vector<Hash> The Merkle leaves of everything received (as compute_chunk_hashes() would give).
+ */
+std::vector<Hash> UploadJournal::finish() {
+    if (partial_.size() > 1) {
+        leaves_.push_back(sha256(partial_.data(), partial_.size()));
+        partial_.resize(1);
+    }
+    return leaves_;
+}
@@ -0,0 +1,98 @@
+/**
+ * @file journal.hpp
+ * @brief Journal of an upload in flight, so an interrupted upload can be resumed
+ */
+
+#ifndef JOURNAL_HPP
+#define JOURNAL_HPP
+
+#include "udp_file_transfer.hpp"
+#include <string>
+#include <vector>
+#include <cstdint>
+
+/**
+ * @class UploadJournal
+ * @brief Progress of one upload: what it is, how much of it is safely staged, and the
+ * Merkle leaves of that part.
+ * @details Received bytes are hashed as they arrive, one MERKLE_CHUNK_SIZE chunk at a
+ * time, so the finished upload gets its Merkle tree without being read back. DATA blocks
+ * are delivered in order, so the received part of an upload is always a prefix: the
+ * journal records its length (rounded down to whole chunks, whose leaves it holds) rather
+ * than a bitmap of chunks. A resumed upload continues from that length, and the staged
+ * file is truncated to it.
+ *
+ * The journal is a small file rewritten atomically (written aside, synced, renamed), after
+ * the staged data it describes has been synced; its CRC-32 rejects torn or foreign files.
+ */
+class UploadJournal {
+public:
+    /**
+     * @brief Starts the journal of a new upload (nothing is written until save()).
+     * @param name The logical file name.
+     * @param fileSize The announced size.
+     * @param digest The announced Merkle root.
+     */
+    UploadJournal(std::string name, uint64_t fileSize, const Hash& digest);
+
+    /**
+     * @brief Loads a saved journal.
+     * @param path The journal file.
+     * @param journal Receives the journal (unchanged on failure).
+     * @return False if the file is missing, torn or corrupt.
+     */
+    static bool load(const std::string& path, UploadJournal& journal);
+
+    /**
+     * @brief Saves the progress up to the last whole chunk.
+     * @details Callers flush and sync the staged data first.
+     * @param path The journal file.
+     * @return True on success.
+     */
+    bool save(const std::string& path) const;
+
+    /**
+     * @brief Records received bytes, hashing every chunk they complete.
+     * @param data The bytes.
+     * @param length The number of bytes.
+     */
+    void append(const uint8_t* data, size_t length);
+
+    /**
+     * @brief Records a run of zero bytes, as append() would.
+     * @details Whole zero chunks all have the same leaf, which is hashed once, so a hole of
+     * any size costs about as much as two chunks.
+     * @param length The number of zero bytes.
+     */
+    void append_zeros(uint64_t length);
+
+    /**
+     * @brief Hashes the final partial chunk.
+     * @return The Merkle leaves of everything received.
+     */
+    std::vector<Hash> finish();
+
+    /// @return Bytes covered by whole, hashed chunks: where an interrupted upload resumes.
+    uint64_t committed() const { return static_cast<uint64_t>(leaves_.size()) * MERKLE_CHUNK_SIZE; }
+
+    /// @return Bytes received so far.
+    uint64_t received() const { return committed() + partial_.size() - 1; }
+
+    /// @return The logical file name.
+    const std::string& name() const { return name_; }
+
+    /// @return The announced size.
+    uint64_t file_size() const { return fileSize_; }
+
+    /// @return The announced Merkle root.
+    const Hash& digest() const { return digest_; }
+
+private:
+    std::string name_;
+    uint64_t fileSize_;
+    Hash digest_;
+    std::vector<Hash> leaves_;     ///< Leaves of the whole chunks received
+    std::vector<uint8_t> partial_; ///< Leaf domain separator followed by the bytes of the current chunk
+};
+
+#endif // JOURNAL_HPP
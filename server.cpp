@@ -4,6 +4,9 @@
  */
 
 #include "udp_file_transfer.hpp"
+#include "storage.hpp"
+#include "index.hpp"
+#include "journal.hpp"
 #include <iostream>
 #include <fstream>
 #include <thread>
@@ -13,132 +16,3326 @@
 #include <sstream>
 #include <iomanip>
 #include <chrono>
+#include <cerrno>
+#include <set>
+#include <map>
+#include <shared_mutex>
+#include <condition_variable>
+#include <memory>
+#include <atomic>
+#include <algorithm>
+#include <charconv>
 #include <openssl/rand.h>
+#define ZSTD_STATIC_LINKING_ONLY // ZSTD_FRAMEHEADERSIZE_MAX is in the static-only part of the API
+#include <zstd.h>
 
 #ifdef _WIN32
 #include <BaseTsd.h>
 typedef SSIZE_T ssize_t; // Use MinGW-provided type
+#else
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
 #endif
+#include <sys/stat.h>
+#ifdef __linux__
+#include <linux/fs.h>
+#include <sys/inotify.h>
+#endif
+
+// Storage directories, inside every storage root.
+const std::string SERVER_STORAGE_DIR = "server_files/";
+const std::string METADATA_DIR = "server_meta/"; ///< Per-version Merkle tree sidecars
+const std::string DELTA_STORAGE_DIR = "server_deltas/"; ///< Older versions stored as reverse deltas
+const std::string COLD_STORAGE_DIR = "server_cold/"; ///< zstd-compressed versions nobody has touched in a while
+
+const std::string BACKUP_STORAGE_DIR = "./backup_files/";
+const std::string VERSION_CACHE_DIR = "./server_cache/"; ///< Reconstructed delta and cold versions
+const std::string INDEX_FILE = "server_index"; ///< In the first storage root: `.db` snapshot and `.wal` log
+const std::string UPLOAD_STAGING_DIR = "server_uploads/"; ///< In the first storage root: uploads in flight and their journals
+const std::string RENAME_JOURNAL = "server_rename.journal"; ///< In the first storage root: the RENAME being applied
+const std::string APPEND_JOURNAL_SUFFIX = ".append"; ///< Next to a staged append: the version it extends in place
+
+/// Storage roots (one per drive; the working directory unless `--root` is given).
+StorageRoots storage_roots;
+
+/// Sharded layouts of the storage directories (see StorageLayout).
+const StorageLayout file_store(storage_roots, SERVER_STORAGE_DIR);
+const StorageLayout metadata_store(storage_roots, METADATA_DIR, ".merkle");
+const StorageLayout delta_store(storage_roots, DELTA_STORAGE_DIR, ".rdelta");
+const StorageLayout cold_store(storage_roots, COLD_STORAGE_DIR, ".zst");
+
+/// Longest chain of deltas that may have to be applied to read an old version.
+constexpr size_t MAX_DELTA_CHAIN = 8;
+
+/// Versions larger than this are kept as plain files (the encoder holds two versions in memory).
+constexpr uint64_t MAX_DELTA_FILE_SIZE = 64ull * 1024 * 1024;
+
+/// Reconstructed versions unused for this long are evicted from `VERSION_CACHE_DIR`.
+constexpr std::chrono::minutes VERSION_CACHE_TTL(5);
+
+/// Old versions neither read nor written for this long move to `COLD_STORAGE_DIR`.
+constexpr std::chrono::hours COLD_AFTER(24 * 30);
+
+/// How often the tiering thread looks for cold versions.
+constexpr std::chrono::hours COLD_SCAN_INTERVAL(1);
+
+/// zstd level used for cold versions (favours ratio; they are rarely read back).
+constexpr int COLD_COMPRESSION_LEVEL = 9;
+
+/// Disk bandwidth (read plus write, bytes per second) that cold migration may use on each storage root.
+constexpr uint64_t COLD_IO_BUDGET = 16 * 1024 * 1024;
+
+/// How often an upload in flight syncs its staged data and saves its journal.
+constexpr std::chrono::seconds UPLOAD_JOURNAL_INTERVAL(1);
+
+/// Interrupted uploads not resumed within this time are discarded.
+constexpr std::chrono::hours UPLOAD_RESUME_TTL(24);
+
+/// Mapped uploads start write-back every this many bytes and wait for the previous interval.
+constexpr uint64_t MAPPED_WRITEBACK_INTERVAL = 8 * 1024 * 1024;
+
+/// How long the answer to a finished request is kept for retransmissions of the request.
+constexpr std::chrono::milliseconds REQUEST_MEMORY(2 * MAX_RETRIES * ACK_TIMEOUT);
+
+/// Receive uploads of known size into a memory map of the staged file (`--buffered-uploads` turns it off).
+bool mapped_uploads = true;
+
+std::mutex client_mutex; // Mutex to manage client threads
+
+/// How long announced keys wait for the client's first request.
+constexpr std::chrono::milliseconds KEY_ANNOUNCEMENT_MEMORY = REQUEST_MEMORY;
+
+/// How long a client's keys are kept after its last request (an interactive client may idle).
+constexpr std::chrono::hours CLIENT_KEY_MEMORY(1);
+
+/**
+ * @class ClientKeys
+ * @brief The AES key and IV a client announced (or that were generated for it).
+ */
+struct ClientKeys {
+    std::string key;
+    std::string iv;
+    std::chrono::steady_clock::time_point expires; ///< Forgotten after this unless a request renews it
+};
+
+/// Keys of each client ("ip:port"), guarded by `client_mutex`. Only key announcements and
+/// well-formed requests create entries, and expired ones are swept, so datagrams from
+/// ever-new ports cannot grow it without bound.
+std::unordered_map<std::string, ClientKeys> client_keys;
+
+/// Tables of `store_index`.
+enum IndexTable : size_t {
+    VERSION_TABLE, ///< Logical file name -> version suffix
+    CONTENT_TABLE, ///< Merkle root (hex) -> stored name holding that content
+    DIGEST_TABLE,  ///< Stored name -> Merkle root (hex)
+    INDEX_TABLES
+};
+
+/// Versions and content of the store, kept across restarts (see PersistentIndex).
+PersistentIndex store_index(INDEX_TABLES);
+
+std::mutex content_mutex; // Serialises updates of CONTENT_TABLE and DIGEST_TABLE
+
+/**
+ * @brief Orders version suffixes ("YYYYMMDDHHMMSS" with an optional "-N" counter) oldest first.
+ */
+struct VersionOrder {
+    bool operator()(const std::string& a, const std::string& b) const {
+        int timestamp = a.compare(0, 14, b, 0, 14);
+        if (timestamp != 0) {
+            return timestamp < 0;
+        }
+        // A missing or malformed counter (a name adopted from outside) counts as the first.
+        auto counter = [](const std::string& v) {
+            unsigned long value = 1;
+            if (v.size() > 15 && std::from_chars(v.data() + 15, v.data() + v.size(), value).ec != std::errc()) {
+                value = 1;
+            }
+            return value;
+        };
+        return counter(a) < counter(b);
+    }
+};
+
+std::mutex version_mutex; // Serialises updates of VERSION_TABLE
+
+/// Stored names handed out by next_version_path whose files are not in place yet (guarded by `version_mutex`).
+std::set<std::string> reserved_versions;
+
+/// Readers of stored versions hold this shared; replacing a plain version with a delta
+/// (or deleting and renaming versions) holds it exclusively.
+std::shared_mutex storage_mutex;
+
+std::mutex background_mutex; // Guards delta_pending and cold_scans_pending
+/// Logical names queued for delta encoding (so repeated uploads queue one job).
+std::set<std::string> delta_pending;
+/// Storage roots with a cold-tier scan queued or running.
+std::set<size_t> cold_scans_pending;
+
+std::mutex upload_mutex; // Guards uploads_in_progress
+/// Staging paths of the uploads being received.
+std::set<std::string> uploads_in_progress;
+
+std::mutex append_mutex; // Guards appends_in_progress
+std::condition_variable append_finished;
+/// Logical names with an APPEND or RENAME being applied; they take turns (see NameTurn).
+std::set<std::string> appends_in_progress;
+
+/**
+ * @class RecentRequest
+ * @brief A request being served, or recently answered, as found again by its retransmissions.
+ */
+struct RecentRequest {
+    int sessionfd = -1;         ///< Session socket serving the request, -1 once the session ended
+    std::vector<uint8_t> reply; ///< The session's answer to the request, once sent
+    bool final = false;         ///< The answer completes the request (no DATA phase follows)
+    std::chrono::steady_clock::time_point finished; ///< When the session ended
+};
+
+std::mutex request_mutex; // Guards recent_requests and request_of_session
+/// Requests by client address and port and request bytes (see request_key()).
+std::map<std::string, RecentRequest> recent_requests;
+/// Session socket -> its key in recent_requests.
+std::unordered_map<int, std::string> request_of_session;
+
+std::mutex cache_mutex; // Guards cache_last_used
+/// Last use of every reconstructed version in `VERSION_CACHE_DIR`.
+std::unordered_map<std::string, std::chrono::steady_clock::time_point> cache_last_used;
+
+/**
+ * @brief Validates the existence of directories for storing files.
+ * @details Creates `SERVER_STORAGE_DIR`, `METADATA_DIR`, `DELTA_STORAGE_DIR` and
+ * `COLD_STORAGE_DIR` with their shard subdirectories, `UPLOAD_STAGING_DIR` and
+ * `BACKUP_STORAGE_DIR`, if they do not exist, and empties `VERSION_CACHE_DIR`.
+ */
+void validate_directories() {
+    for (const StorageLayout* store : {&file_store, &metadata_store, &delta_store, &cold_store}) {
+        store->create();
+    }
+    std::error_code ec;
+    std::filesystem::create_directories(storage_roots.list().front() + UPLOAD_STAGING_DIR, ec);
+    std::filesystem::remove_all(VERSION_CACHE_DIR, ec);
+    std::filesystem::create_directories(VERSION_CACHE_DIR);
+    if (!std::filesystem::exists(BACKUP_STORAGE_DIR)) {
+        std::filesystem::create_directories(BACKUP_STORAGE_DIR);
+    }
+}
+
+/**
+ * @brief Logs errors to a file with a timestamp.
+ * @param message The error message to log.
+ * @param clientAddr The client address structure.
+ */
+void log_error(const std::string& message, const sockaddr_in& clientAddr) {
+    auto now = std::chrono::system_clock::now();
+    auto time = std::chrono::system_clock::to_time_t(now);
+
+    std::ofstream log("server_error.log", std::ios::app);
+    if (log.is_open()) {
+        log << "[" << std::put_time(std::localtime(&time), "%Y-%m-%d %H:%M:%S") << "] ";
+        log << "Client IP: " << inet_ntoa(clientAddr.sin_addr)
+            << ", Port: " << ntohs(clientAddr.sin_port) << " - " << message << std::endl;
+    }
+}
+
+/**
+ * @brief Opens a per-session socket bound to an ephemeral port.
+ * @details Like TFTP transfer IDs, every request is served from its own port so that
+ * DATA and ACK packets of a session never reach the listening socket.
+ * @return The socket file descriptor, or -1 on failure.
+ */
+int open_session_socket() {
+    int sessionfd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sessionfd < 0) {
+        return -1;
+    }
+
+    sockaddr_in sessionAddr = {};
+    sessionAddr.sin_family = AF_INET;
+    sessionAddr.sin_port = 0;
+    sessionAddr.sin_addr.s_addr = INADDR_ANY;
+    if (bind(sessionfd, (struct sockaddr*)&sessionAddr, sizeof(sessionAddr)) < 0) {
+        CLOSE_SOCKET(sessionfd);
+        return -1;
+    }
+    enable_drop_monitoring(sessionfd);
+    enable_timestamping(sessionfd, true);
+    return sessionfd;
+}
+
+/**
+ * @brief Identifies a request by who sent it and what it says.
+ * @details A client retransmits a request byte for byte from the same port, so a
+ * retransmission has the key of the original.
+ * @param clientAddr The client address structure.
+ * @param request The request datagram.
+ * @param length Its length.
+ * @return The key in recent_requests.
+ */
+std::string request_key(const sockaddr_in& clientAddr, const void* request, size_t length) {
+    return std::to_string(clientAddr.sin_addr.s_addr) + ":" + std::to_string(clientAddr.sin_port) + ":" +
+           to_hex(sha256(static_cast<const uint8_t*>(request), length));
+}
+
+/**
+ * @brief Registers a request unless it is a retransmission of one being served or just answered.
+ * @details A retransmission is not served again: a COPY, RESTORE or instant upload would
+ * create another version, a RENAME or DEL would fail on its own result, and a transfer
+ * would start a second session. If the original has been answered, the answer is sent
+ * again (from the session socket while it is open, so the client learns the session's
+ * port); otherwise the session answers in due course and the retransmission is dropped.
+ * @param key The request_key().
+ * @param listenfd The listening socket, used once the session has ended.
+ * @param clientAddr The client address structure.
+ * @return True if the request is new and is to be served.
+ */
+bool begin_request(const std::string& key, int listenfd, const sockaddr_in& clientAddr) {
+    std::lock_guard<std::mutex> lock(request_mutex);
+    auto now = std::chrono::steady_clock::now();
+    for (auto it = recent_requests.begin(); it != recent_requests.end();) {
+        bool expired = it->second.sessionfd < 0 && now - it->second.finished >= REQUEST_MEMORY;
+        it = expired ? recent_requests.erase(it) : std::next(it);
+    }
+
+    auto [request, inserted] = recent_requests.try_emplace(key);
+    if (!inserted && !request->second.reply.empty()) {
+        int sockfd = request->second.sessionfd >= 0 ? request->second.sessionfd : listenfd;
+        sendto(sockfd, (const char*)request->second.reply.data(), request->second.reply.size(), 0,
+               (const struct sockaddr*)&clientAddr, sizeof(clientAddr));
+    }
+    return inserted;
+}
+
+/**
+ * @brief Records the session socket serving a request registered by begin_request().
+ * @param key The request_key().
+ * @param sessionfd The session socket.
+ */
+void attach_session(const std::string& key, int sessionfd) {
+    std::lock_guard<std::mutex> lock(request_mutex);
+    recent_requests[key].sessionfd = sessionfd;
+    request_of_session[sessionfd] = key;
+}
+
+/**
+ * @brief Ends the session of a request, before its socket is closed.
+ * @details A request whose answer completed it is remembered for REQUEST_MEMORY, so a
+ * retransmission sent because the answer was lost gets it again. A failed request or a
+ * transfer is forgotten: the client's retry is a new attempt.
+ * @param sessionfd The session socket.
+ */
+void end_session(int sessionfd) {
+    std::lock_guard<std::mutex> lock(request_mutex);
+    auto session = request_of_session.find(sessionfd);
+    if (session == request_of_session.end()) {
+        return;
+    }
+    auto request = recent_requests.find(session->second);
+    if (request != recent_requests.end()) {
+        if (request->second.final && !request->second.reply.empty()) {
+            request->second.sessionfd = -1;
+            request->second.finished = std::chrono::steady_clock::now();
+        } else {
+            recent_requests.erase(request);
+        }
+    }
+    request_of_session.erase(session);
+}
+
+/**
+ * @brief Sends a session's answer to its request and keeps it for retransmissions of the request.
+ * @param sockfd The session socket file descriptor.
+ * @param clientAddr The client address structure.
+ * @param reply The answer.
+ * @param final True if the answer completes the request, false if a transfer follows.
+ */
+void send_reply(int sockfd, const sockaddr_in& clientAddr, const Packet& reply, bool final) {
+    uint8_t wire[WIRE_PACKET_SIZE];
+    encode_packet(reply, wire);
+    sendto(sockfd, (const char*)wire, sizeof(wire), 0, (const struct sockaddr*)&clientAddr, sizeof(clientAddr));
+
+    std::lock_guard<std::mutex> lock(request_mutex);
+    auto session = request_of_session.find(sockfd);
+    if (session != request_of_session.end()) {
+        RecentRequest& request = recent_requests[session->second];
+        request.reply.assign(wire, wire + sizeof(wire));
+        request.final = final;
+    }
+}
+
+/**
+ * @brief Acknowledges a RRQ/WRQ, with an OACK if the client proposed options.
+ * @details Clients that send no options get a plain ACK and the default parameters.
+ * The session socket buffers are sized for the agreed window before answering.
+ * @param sockfd The session socket file descriptor.
+ * @param clientAddr The client address structure.
+ * @param request The request packet.
+ * @param requestRxUs Kernel RX timestamp of the request, used to report server processing time.
+ * @param fileSize The total file size to announce, if any.
+ * @param digest The Merkle root of the file to announce, if any.
+ * @param flags PacketFlags for the reply.
+ * @param resumeOffset WRQ: where the DATA of a resumed upload starts (announced only to clients that can resume).
+ * @return The options the session will use.
+ */
+TransferOptions acknowledge_request(int sockfd, const sockaddr_in& clientAddr, const Packet& request,
+                                    int64_t requestRxUs, uint64_t fileSize = 0, const Hash* digest = nullptr,
+                                    uint32_t flags = 0, uint64_t resumeOffset = 0) {
+    TransferOptions accepted;
+    Packet reply = {ACK, {}, {}, 0, 0, 0, flags, fileSize};
+    if (request.optionsLength != 0) {
+        size_t length = std::min<size_t>(request.optionsLength, sizeof(request.options));
+        accepted = negotiate_options(decode_options(request.options, length));
+        if (accepted.resume) {
+            accepted.rangeOffset = resumeOffset;
+            accepted.rangeLength = 0;
+        }
+        reply.operationID = OACK;
+        reply.optionsLength = static_cast<uint16_t>(encode_options(accepted, reply.options, sizeof(reply.options)));
+    }
+    if (digest) {
+        std::memcpy(reply.digest, digest->data(), HASH_SIZE);
+    }
+    size_t wanted = socket_buffer_size(accepted);
+    size_t granted = size_socket_buffers(sockfd, wanted);
+    static std::atomic<bool> capReported(false);
+    if (granted < wanted && !capReported.exchange(true)) { // Once: every session of that size is capped alike
+        log_error("Session socket buffers capped at " + std::to_string(granted) + " of " + std::to_string(wanted) +
+                  " bytes; raise net.core.rmem_max and wmem_max (or grant CAP_NET_ADMIN).", clientAddr);
+    }
+
+    reply.processingUs = static_cast<uint32_t>(std::max<int64_t>(0, now_us() - requestRxUs));
+    send_reply(sockfd, clientAddr, reply, (flags & FLAG_CONTENT_EXISTS) != 0);
+    return accepted;
+}
+
+/**
+ * @brief Returns the path of the Merkle tree sidecar of a stored file.
+ * @param filePath The stored file.
+ * @return The sidecar path in `METADATA_DIR`.
+ */
+std::string merkle_sidecar_path(const std::string& filePath) {
+    return metadata_store.path(std::filesystem::path(filePath).filename().string());
+}
+
+/**
+ * @brief Saves the Merkle leaves of a stored file in its sidecar.
+ * @param filePath The stored file.
+ * @param leaves The chunk hashes.
+ */
+void save_merkle_sidecar(const std::string& filePath, const std::vector<Hash>& leaves) {
+    // Write to a temporary file and rename, so readers never see a partial sidecar.
+    std::string sidecar = merkle_sidecar_path(filePath);
+    std::string temp = sidecar + ".tmp" + std::to_string(std::hash<std::thread::id>()(std::this_thread::get_id()));
+    {
+        std::ofstream out(temp, std::ios::binary | std::ios::trunc);
+        for (const Hash& leaf : leaves) {
+            out.write(reinterpret_cast<const char*>(leaf.data()), HASH_SIZE);
+        }
+    }
+    std::error_code ec;
+    std::filesystem::rename(temp, sidecar, ec);
+}
+
+/**
+ * @brief Computes the Merkle leaves of a stored file and saves them in its sidecar.
+ * @param filePath The stored file.
+ * @param leaves Receives the chunk hashes.
+ * @return True on success.
+ */
+bool build_merkle_tree(const std::string& filePath, std::vector<Hash>& leaves) {
+    if (!compute_chunk_hashes(filePath, leaves)) {
+        return false;
+    }
+    save_merkle_sidecar(filePath, leaves);
+    return true;
+}
+
+/**
+ * @brief Reads the Merkle leaves of a stored version from its sidecar without checking freshness.
+ * @param filePath The stored version (which may only exist in a delta or cold form).
+ * @param fileSize The size of the version's content.
+ * @param leaves Receives the chunk hashes.
+ * @return True if the sidecar exists and matches the size.
+ */
+bool read_merkle_sidecar(const std::string& filePath, uint64_t fileSize, std::vector<Hash>& leaves) {
+    std::string sidecar = merkle_sidecar_path(filePath);
+    size_t chunks = static_cast<size_t>((fileSize + MERKLE_CHUNK_SIZE - 1) / MERKLE_CHUNK_SIZE);
+    std::error_code ec;
+    if (std::filesystem::file_size(sidecar, ec) != chunks * HASH_SIZE || ec) {
+        return false;
+    }
+
+    leaves.assign(chunks, Hash{});
+    std::ifstream in(sidecar, std::ios::binary);
+    for (Hash& leaf : leaves) {
+        in.read(reinterpret_cast<char*>(leaf.data()), HASH_SIZE);
+    }
+    return static_cast<bool>(in) || chunks == 0;
+}
+
+/**
+ * @brief Loads the Merkle leaves of a stored file, rebuilding the sidecar if it is stale.
+ * @param filePath The stored file.
+ * @param leaves Receives the chunk hashes.
+ * @return True on success.
+ */
+bool load_merkle_tree(const std::string& filePath, std::vector<Hash>& leaves) {
+    std::string sidecar = merkle_sidecar_path(filePath);
+    std::error_code ec;
+    uint64_t fileSize = std::filesystem::file_size(filePath, ec);
+    if (ec) {
+        return false;
+    }
+
+    bool fresh = std::filesystem::exists(sidecar, ec) &&
+                 std::filesystem::last_write_time(sidecar, ec) >= std::filesystem::last_write_time(filePath, ec);
+    if (!fresh || !read_merkle_sidecar(filePath, fileSize, leaves)) {
+        return build_merkle_tree(filePath, leaves);
+    }
+    return true;
+}
+
+/**
+ * @brief Returns the path of the persistent index files, without extension.
+ * @return The path in the first storage root.
+ */
+std::string index_path() {
+    return storage_roots.list().front() + INDEX_FILE;
+}
+
+/**
+ * @brief Logs, once, that changes to the index can no longer be written to its log.
+ * @details The index keeps working in memory; the lost changes come back with `--reindex`.
+ * @param logged The result of the index update.
+ */
+void check_index_logged(bool logged) {
+    static std::atomic<bool> reported(false);
+    if (!logged && !reported.exchange(true)) {
+        log_error("Could not append to the index log " + index_path() + ".wal; restart with --reindex to rescan the store.");
+    }
+}
+
+/**
+ * @brief Records that a stored file holds the content with the given Merkle root.
+ * @param filePath The stored file.
+ * @param root Its Merkle root.
+ */
+void index_content(const std::string& filePath, const Hash& root) {
+    std::lock_guard<std::mutex> lock(content_mutex);
+    std::string storedName = std::filesystem::path(filePath).filename().string();
+    std::string digest = to_hex(root);
+    bool logged = true;
+    for (const std::string& previous : store_index.values(DIGEST_TABLE, storedName)) {
+        if (previous != digest) {
+            logged = store_index.erase(CONTENT_TABLE, previous, storedName) && logged;
+            logged = store_index.erase(DIGEST_TABLE, storedName, previous) && logged;
+        }
+    }
+    logged = store_index.insert(CONTENT_TABLE, digest, storedName) && logged;
+    check_index_logged(store_index.insert(DIGEST_TABLE, storedName, digest) && logged);
+}
+
+/**
+ * @brief Removes a stored file from the content index.
+ * @param filePath The stored file.
+ */
+void forget_content(const std::string& filePath) {
+    std::lock_guard<std::mutex> lock(content_mutex);
+    std::string storedName = std::filesystem::path(filePath).filename().string();
+    bool logged = true;
+    for (const std::string& digest : store_index.values(DIGEST_TABLE, storedName)) {
+        logged = store_index.erase(CONTENT_TABLE, digest, storedName) && logged;
+        logged = store_index.erase(DIGEST_TABLE, storedName, digest) && logged;
+    }
+    check_index_logged(logged);
+}
+
+/**
+ * @brief Looks up a stored file holding the content with the given Merkle root.
+ * @param root The Merkle root.
+ * @return The stored path, or an empty string if the content is unknown.
+ */
+std::string find_content(const Hash& root) {
+    std::vector<std::string> storedNames = store_index.values(CONTENT_TABLE, to_hex(root));
+    return storedNames.empty() ? std::string() : file_store.path(storedNames.front());
+}
+
+/**
+ * @brief Splits a stored file name into its logical name and version suffix.
+ * @param storedName A file name in `SERVER_STORAGE_DIR` (e.g. "report.txt_v20241119124624").
+ * @param name Receives the logical name ("report.txt").
+ * @param version Receives the version suffix ("20241119124624", optionally "-N").
+ * @return True if the name carries a version suffix.
+ */
+bool split_versioned_name(const std::string& storedName, std::string& name, std::string& version) {
+    size_t pos = storedName.rfind("_v");
+    if (pos == std::string::npos || storedName.size() < pos + 16) {
+        return false;
+    }
+    std::string suffix = storedName.substr(pos + 2);
+    size_t digits = suffix.find_first_not_of("0123456789");
+    bool valid = digits == std::string::npos ? suffix.size() == 14
+                                             : digits == 14 && suffix[14] == '-' && suffix.size() > 15 &&
+                                               suffix.find_first_not_of("0123456789", 15) == std::string::npos;
+    if (!valid) {
+        return false;
+    }
+    name = storedName.substr(0, pos);
+    version = suffix;
+    return true;
+}
+
+/**
+ * @brief Adds a stored file to the version index.
+ * @param filePath The stored file.
+ */
+void add_version(const std::string& filePath) {
+    std::string name, version;
+    if (split_versioned_name(std::filesystem::path(filePath).filename().string(), name, version)) {
+        std::lock_guard<std::mutex> lock(version_mutex);
+        check_index_logged(store_index.insert(VERSION_TABLE, name, version));
+    }
+}
+
+/**
+ * @brief Removes a stored file from the version index.
+ * @param filePath The stored file.
+ */
+void remove_version(const std::string& filePath) {
+    std::string name, version;
+    if (split_versioned_name(std::filesystem::path(filePath).filename().string(), name, version)) {
+        std::lock_guard<std::mutex> lock(version_mutex);
+        check_index_logged(store_index.erase(VERSION_TABLE, name, version));
+    }
+}
+
+/**
+ * @brief Lists the stored versions of a logical file name, oldest first.
+ * @param name The logical file name.
+ * @return The stored paths.
+ */
+std::vector<std::string> list_versions(const std::string& name) {
+    std::vector<std::string> versions = store_index.values(VERSION_TABLE, name);
+    std::sort(versions.begin(), versions.end(), VersionOrder());
+    std::vector<std::string> paths;
+    for (const std::string& version : versions) {
+        paths.push_back(file_store.path(name + "_v" + version));
+    }
+    return paths;
+}
+
+/**
+ * @brief Returns the path of the reverse delta of a stored version.
+ * @param filePath The stored version.
+ * @return The delta path in `DELTA_STORAGE_DIR`.
+ */
+std::string delta_path(const std::string& filePath) {
+    return delta_store.path(std::filesystem::path(filePath).filename().string());
+}
+
+/**
+ * @brief Returns the path of the compressed cold copy of a stored version.
+ * @param filePath The stored version.
+ * @return The cold path in `COLD_STORAGE_DIR`.
+ */
+std::string cold_path(const std::string& filePath) {
+    return cold_store.path(std::filesystem::path(filePath).filename().string());
+}
+
+/**
+ * @brief Checks whether a stored version exists, as a plain file, a delta or a cold copy.
+ * @param filePath The stored version.
+ * @return True if it exists.
+ */
+bool stored_version_exists(const std::string& filePath) {
+    std::error_code ec;
+    return std::filesystem::exists(filePath, ec) || std::filesystem::exists(delta_path(filePath), ec) ||
+           std::filesystem::exists(cold_path(filePath), ec);
+}
+
+/**
+ * @brief Streams the content of a cold (zstd-compressed) version.
+ */
+class ColdFileReader {
+public:
+    /**
+     * @brief Opens a cold file and reads its content size from the zstd frame header.
+     * @param path The `.zst` file.
+     */
+    explicit ColdFileReader(const std::string& path)
+        : in(path, std::ios::binary), dctx(ZSTD_createDCtx()), input(ZSTD_DStreamInSize()) {
+        in.read(input.data(), ZSTD_FRAMEHEADERSIZE_MAX);
+        buffer = {input.data(), static_cast<size_t>(in.gcount()), 0};
+        unsigned long long size = ZSTD_getFrameContentSize(input.data(), buffer.size);
+        valid = dctx && size != ZSTD_CONTENTSIZE_UNKNOWN && size != ZSTD_CONTENTSIZE_ERROR;
+        contentSize = valid ? size : 0;
+    }
+
+    ~ColdFileReader() { ZSTD_freeDCtx(dctx); }
+
+    ColdFileReader(const ColdFileReader&) = delete;
+    ColdFileReader& operator=(const ColdFileReader&) = delete;
+
+    /// @return True if the file is a zstd frame with a known content size.
+    bool is_open() const { return valid; }
+
+    /// @return The decompressed size.
+    uint64_t size() const { return contentSize; }
+
+    /**
+     * @brief Decompresses up to `capacity` bytes.
+     * @param out Destination buffer.
+     * @param capacity Bytes wanted.
+     * @return Bytes produced (less than `capacity` only at the end or on corruption).
+     */
+    size_t read(uint8_t* out, size_t capacity) {
+        ZSTD_outBuffer output = {out, capacity, 0};
+        while (valid && output.pos < output.size) {
+            if (buffer.pos == buffer.size) {
+                in.read(input.data(), static_cast<std::streamsize>(input.size()));
+                buffer = {input.data(), static_cast<size_t>(in.gcount()), 0};
+                if (buffer.size == 0) {
+                    break;
+                }
+            }
+            size_t result = ZSTD_decompressStream(dctx, &output, &buffer);
+            if (ZSTD_isError(result)) {
+                valid = false;
+            }
+        }
+        return output.pos;
+    }
+
+    /**
+     * @brief Decompresses and discards bytes (cold files are not seekable).
+     * @param bytes Bytes to skip.
+     * @return True if that many bytes were skipped.
+     */
+    bool skip(uint64_t bytes) {
+        std::vector<uint8_t> scratch(ZSTD_DStreamOutSize());
+        while (bytes > 0) {
+            size_t got = read(scratch.data(), static_cast<size_t>(std::min<uint64_t>(bytes, scratch.size())));
+            if (got == 0) {
+                return false;
+            }
+            bytes -= got;
+        }
+        return true;
+    }
+
+private:
+    std::ifstream in;
+    ZSTD_DCtx* dctx;
+    std::vector<char> input;
+    ZSTD_inBuffer buffer = {nullptr, 0, 0};
+    uint64_t contentSize = 0;
+    bool valid = false;
+};
+
+/**
+ * @brief Token bucket that paces background I/O to a byte rate.
+ */
+class IoBudget {
+public:
+    /// @param bytesPerSecond The sustained rate allowed.
+    explicit IoBudget(uint64_t bytesPerSecond) : rate(bytesPerSecond), start(std::chrono::steady_clock::now()) {}
+
+    /**
+     * @brief Accounts for I/O just done and sleeps while ahead of the budget.
+     * @param bytes Bytes read or written.
+     */
+    void consume(uint64_t bytes) {
+        auto now = std::chrono::steady_clock::now();
+        if (now - due() > std::chrono::seconds(1)) {
+            start = now; // Idle time does not bank a burst
+            used = 0;
+        }
+        used += bytes;
+        std::this_thread::sleep_until(due());
+    }
+
+private:
+    std::chrono::steady_clock::time_point due() const {
+        return start + std::chrono::microseconds(used * 1000000 / rate);
+    }
+
+    uint64_t rate;
+    std::chrono::steady_clock::time_point start;
+    uint64_t used = 0;
+};
+
+/**
+ * @brief Restores a file's access time once background work is done reading it.
+ * @details Cold tiering goes by access time, so delta encoding must not count as a use.
+ */
+class AccessTimeGuard {
+public:
+    /// @param path The file about to be read.
+    explicit AccessTimeGuard(const std::string& path) : path(path), saved(stat(path.c_str(), &info) == 0) {}
+
+    ~AccessTimeGuard() {
+#ifndef _WIN32
+        if (saved) {
+            struct timespec times[2] = {info.st_atim, {0, UTIME_OMIT}};
+            utimensat(AT_FDCWD, path.c_str(), times, 0);
+        }
+#endif
+    }
+
+    AccessTimeGuard(const AccessTimeGuard&) = delete;
+    AccessTimeGuard& operator=(const AccessTimeGuard&) = delete;
+
+private:
+    std::string path;
+    struct stat info;
+    bool saved;
+};
+
+/**
+ * @brief Decompresses a cold version into a plain file.
+ * @param coldFile The `.zst` file.
+ * @param outPath The file to write.
+ * @return True if the full content was written.
+ */
+bool decompress_cold_version(const std::string& coldFile, const std::string& outPath) {
+    ColdFileReader reader(coldFile);
+    std::ofstream out(outPath, std::ios::binary | std::ios::trunc);
+    std::vector<uint8_t> chunk(ZSTD_DStreamOutSize());
+    uint64_t written = 0;
+    size_t got;
+    while (reader.is_open() && out && (got = reader.read(chunk.data(), chunk.size())) > 0) {
+        out.write(reinterpret_cast<const char*>(chunk.data()), static_cast<std::streamsize>(got));
+        written += got;
+    }
+    out.close();
+    return reader.is_open() && static_cast<bool>(out) && written == reader.size();
+}
+
+/**
+ * @brief Compresses a plain file with zstd, pacing reads and writes to an I/O budget.
+ * @param filePath The plain file.
+ * @param outPath The `.zst` file to write.
+ * @param budget The I/O budget to charge.
+ * @return True on success.
+ */
+bool compress_cold_version(const std::string& filePath, const std::string& outPath, IoBudget& budget) {
+    std::error_code ec;
+    uint64_t size = std::filesystem::file_size(filePath, ec);
+    std::ifstream in(filePath, std::ios::binary);
+    std::ofstream out(outPath, std::ios::binary | std::ios::trunc);
+    ZSTD_CCtx* cctx = ZSTD_createCCtx();
+    if (ec || !in || !out || !cctx) {
+        ZSTD_freeCCtx(cctx);
+        return false;
+    }
+    ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel, COLD_COMPRESSION_LEVEL);
+    ZSTD_CCtx_setPledgedSrcSize(cctx, size); // Puts the content size in the frame header
+
+    std::vector<char> input(MERKLE_CHUNK_SIZE), output(ZSTD_CStreamOutSize());
+    bool ok = true;
+    uint64_t consumed = 0;
+    while (ok) {
+        in.read(input.data(), static_cast<std::streamsize>(input.size()));
+        size_t got = static_cast<size_t>(in.gcount());
+        consumed += got;
+        ZSTD_EndDirective mode = consumed >= size || got == 0 ? ZSTD_e_end : ZSTD_e_continue;
+        ZSTD_inBuffer src = {input.data(), got, 0};
+        size_t remaining;
+        do {
+            ZSTD_outBuffer dst = {output.data(), output.size(), 0};
+            remaining = ZSTD_compressStream2(cctx, &dst, &src, mode);
+            ok = !ZSTD_isError(remaining) && out.write(output.data(), static_cast<std::streamsize>(dst.pos));
+            budget.consume(dst.pos);
+        } while (ok && (mode == ZSTD_e_end ? remaining != 0 : src.pos < src.size));
+        budget.consume(got);
+        if (mode == ZSTD_e_end) {
+            break;
+        }
+    }
+    ZSTD_freeCCtx(cctx);
+    out.close();
+    return ok && static_cast<bool>(out) && consumed == size;
+}
+
+/**
+ * @brief Copies a stored file without moving its data through user space.
+ * @details Tries a reflink (FICLONE, constant time on copy-on-write filesystems), then
+ * copy_file_range, then a plain copy. Like a rename, the copy keeps the modification time,
+ * so a Merkle sidecar written for the source stays fresh for it, even when the watcher
+ * looks at it as soon as it is closed.
+ * @param source The existing file.
+ * @param target The new file (must not exist).
+ * @param reflinked If given, set to whether the copy shares the source's data through a reflink.
+ * @return True on success; errno describes a failure.
+ */
+bool clone_file(const std::string& source, const std::string& target, bool* reflinked = nullptr) {
+    if (reflinked) {
+        *reflinked = false;
+    }
+#ifdef __linux__
+    int in = open(source.c_str(), O_RDONLY);
+    if (in < 0) {
+        return false;
+    }
+    struct stat info;
+    fstat(in, &info);
+    int out = open(target.c_str(), O_WRONLY | O_CREAT | O_EXCL, info.st_mode & 0777);
+    if (out < 0) {
+        close(in);
+        return false;
+    }
+
+    bool done = ioctl(out, FICLONE, in) == 0;
+    if (reflinked) {
+        *reflinked = done;
+    }
+    off_t remaining = info.st_size;
+    while (!done && remaining > 0) {
+        // At most 1 GiB per call, so a 32-bit size_t cannot truncate the count of a large file.
+        ssize_t copied = copy_file_range(in, nullptr, out, nullptr, static_cast<size_t>(std::min<off_t>(remaining, 1 << 30)), 0);
+        if (copied <= 0) {
+            break;
+        }
+        remaining -= copied;
+    }
+    done = done || remaining == 0;
+    struct timespec times[2] = {info.st_atim, info.st_mtim};
+    futimens(out, times);
+    close(in);
+    close(out);
+    if (done) {
+        return true;
+    }
+    std::remove(target.c_str()); // Fall back to a plain copy below
+#endif
+    std::error_code ec;
+    bool copied = std::filesystem::copy_file(source, target, ec);
+    if (ec) errno = ec.value();
+    if (copied) {
+        std::filesystem::last_write_time(target, std::filesystem::last_write_time(source, ec), ec);
+    }
+    return copied;
+}
+
+/**
+ * @brief Appends the content of one file to another and syncs the result.
+ * @details Uses copy_file_range (which shares extents where the filesystem can), then a
+ * plain copy for whatever it could not move.
+ * @param source The file to append.
+ * @param target The file to extend.
+ * @return True once the target holds the whole source and is synced; errno describes a failure.
+ */
+bool append_file(const std::string& source, const std::string& target) {
+#ifdef __linux__
+    int in = open(source.c_str(), O_RDONLY);
+    int out = in < 0 ? -1 : open(target.c_str(), O_WRONLY);
+    struct stat info;
+    off_t at = out < 0 || fstat(in, &info) != 0 ? -1 : lseek(out, 0, SEEK_END);
+    off_t remaining = at < 0 ? 0 : info.st_size;
+    std::vector<char> buffer;
+    while (remaining > 0) {
+        ssize_t copied = copy_file_range(in, nullptr, out, &at, static_cast<size_t>(std::min<off_t>(remaining, 1 << 30)), 0);
+        if (copied <= 0) { // Not supported here: copy the rest through a buffer
+            buffer.resize(MERKLE_CHUNK_SIZE);
+            ssize_t got = read(in, buffer.data(), static_cast<size_t>(std::min<off_t>(remaining, buffer.size())));
+            copied = got > 0 ? pwrite(out, buffer.data(), static_cast<size_t>(got), at) : -1;
+            if (copied <= 0 || copied != got) {
+                break;
+            }
+            at += copied;
+        }
+        remaining -= copied;
+    }
+    bool done = at >= 0 && remaining == 0 && fsync(out) == 0;
+    int err = errno;
+    if (in >= 0) close(in);
+    if (out >= 0) close(out);
+    errno = err;
+    return done;
+#else
+    std::error_code ec;
+    if (std::filesystem::file_size(source, ec) == 0 && !ec) {
+        return true;
+    }
+    std::ifstream in(source, std::ios::binary);
+    std::ofstream out(target, std::ios::binary | std::ios::app);
+    out << in.rdbuf();
+    out.flush();
+    return in && out;
+#endif
+}
+
+/**
+ * @brief Returns a plain file holding a stored version.
+ * @details Plain versions are returned as they are. A cold version is decompressed, and a
+ * delta version is reconstructed by applying the delta to its (recursively readable) newer
+ * base; the result is kept in `VERSION_CACHE_DIR` for a while. Callers hold `storage_mutex`.
+ * @param filePath The stored version.
+ * @return A readable path (`filePath` itself, which may not exist, if it cannot be reconstructed).
+ */
+std::string readable_version_path(const std::string& filePath) {
+    std::error_code ec;
+    if (std::filesystem::exists(filePath, ec)) {
+        return filePath;
+    }
+
+    std::string storedName = std::filesystem::path(filePath).filename().string();
+    std::string cached = VERSION_CACHE_DIR + storedName;
+    {
+        std::lock_guard<std::mutex> lock(cache_mutex);
+        cache_last_used[cached] = std::chrono::steady_clock::now();
+    }
+    if (std::filesystem::exists(cached, ec)) {
+        return cached;
+    }
+
+    std::string temp = cached + ".tmp" + std::to_string(std::hash<std::thread::id>()(std::this_thread::get_id()));
+    if (std::filesystem::exists(cold_path(filePath), ec)) {
+        if (!decompress_cold_version(cold_path(filePath), temp)) {
+            std::filesystem::remove(temp, ec);
+            log_error("Could not decompress cold version " + cold_path(filePath));
+            return filePath;
+        }
+    } else {
+        std::string name, version, baseVersion;
+        uint64_t size = 0;
+        if (!split_versioned_name(storedName, name, version) || !read_delta_header(delta_path(filePath), baseVersion, size)) {
+            return filePath;
+        }
+        std::string base = readable_version_path(file_store.path(name + "_v" + baseVersion));
+        if (!apply_delta(base, delta_path(filePath), temp)) {
+            std::filesystem::remove(temp, ec);
+            log_error("Could not reconstruct " + filePath + " from its delta.");
+            return filePath;
+        }
+    }
+
+    // The reconstruction has exactly the content the Merkle sidecar was built from.
+    auto sidecarTime = std::filesystem::last_write_time(merkle_sidecar_path(filePath), ec);
+    if (!ec) {
+        std::filesystem::last_write_time(temp, sidecarTime, ec);
+    }
+    std::filesystem::rename(temp, cached, ec);
+    return cached;
+}
+
+/**
+ * @brief Turns a delta version back into a plain file in `SERVER_STORAGE_DIR`.
+ * @details Used before the base of a delta goes away, and to keep the latest version plain.
+ * Callers hold `storage_mutex` exclusively.
+ * @param filePath The stored version.
+ * @return True if the version is now plain.
+ */
+bool make_version_plain(const std::string& filePath) {
+    std::string readable = readable_version_path(filePath);
+    if (readable == filePath) {
+        return std::filesystem::exists(filePath);
+    }
+
+    // A copy, not a link: the cache entry may be evicted or rebuilt, and must not share the version's inode.
+    std::error_code ec;
+    if (!clone_file(readable, filePath)) {
+        return false;
+    }
+    std::filesystem::remove(delta_path(filePath), ec);
+    std::filesystem::remove(cold_path(filePath), ec);
+    std::vector<Hash> leaves;
+    if (load_merkle_tree(filePath, leaves)) {
+        index_content(filePath, merkle_root(leaves));
+    }
+    return true;
+}
+
+/**
+ * @brief Deletes a stored version, whatever its form (plain, delta or cold).
+ * @details An older version encoded against this one is made plain first, and if the
+ * latest version is deleted, its predecessor is made plain, so RRQ of a logical name
+ * never has to apply deltas. Callers hold `storage_mutex` exclusively.
+ * @param filePath The stored version.
+ * @return True on success; errno describes a failure.
+ */
+bool remove_stored_version(const std::string& filePath) {
+    std::string name, version;
+    std::vector<std::string> versions;
+    size_t index = 0;
+    if (split_versioned_name(std::filesystem::path(filePath).filename().string(), name, version)) {
+        versions = list_versions(name);
+        index = static_cast<size_t>(std::find(versions.begin(), versions.end(), filePath) - versions.begin());
+    }
+
+    std::string baseVersion;
+    uint64_t size = 0;
+    if (index > 0 && index < versions.size() && read_delta_header(delta_path(versions[index - 1]), baseVersion, size) &&
+        baseVersion == version && !make_version_plain(versions[index - 1])) {
+        return false;
+    }
+
+    if (std::remove(filePath.c_str()) != 0 && std::remove(delta_path(filePath).c_str()) != 0 &&
+        std::remove(cold_path(filePath).c_str()) != 0) {
+        return false;
+    }
+    std::error_code ec;
+    std::filesystem::remove(VERSION_CACHE_DIR + std::filesystem::path(filePath).filename().string(), ec);
+    if (index > 0 && index + 1 == versions.size()) {
+        make_version_plain(versions[index - 1]);
+    }
+    return true;
+}
+
+/**
+ * @brief Resolves a requested name to a stored version, whatever its form.
+ * @details An exact stored name wins; otherwise the latest version of the logical name is used.
+ * @param filename The requested name.
+ * @return The stored path in `file_store` (it may exist only as a delta or cold copy, or not at all).
+ */
+std::string stored_version_for(const std::string& filename) {
+    std::string literal = file_store.path(filename);
+    if (stored_version_exists(literal)) {
+        return literal;
+    }
+    std::vector<std::string> versions = list_versions(filename);
+    for (auto it = versions.rbegin(); it != versions.rend(); ++it) {
+        if (stored_version_exists(*it)) {
+            return *it;
+        }
+    }
+    return versions.empty() ? literal : versions.back(); // Listed but missing (removed behind our back)
+}
+
+/**
+ * @brief Resolves a requested name to a readable stored file.
+ * @details An exact stored name wins; otherwise the latest version of the logical name is
+ * used. Delta versions are reconstructed. Callers hold `storage_mutex`.
+ * @param filename The requested name.
+ * @return The readable path (which may not exist if nothing matches).
+ */
+std::string resolve_stored_path(const std::string& filename) {
+    return readable_version_path(stored_version_for(filename));
+}
+
+/**
+ * @brief Reserves the path of a new, latest version of a logical file name.
+ * @details Versions created within the same second get a "-N" counter, so a new version
+ * never overwrites an existing one. The name is reserved in memory only: the version index
+ * records it once publish_version() finds the file in place, so a crash in between leaves
+ * no version without a file. Callers end the reservation with publish_version() or release_version().
+ * @param name The logical file name.
+ * @return The new stored path.
+ */
+std::string next_version_path(const std::string& name) {
+    std::string storedName, version;
+    split_versioned_name(generate_versioned_filename(name), storedName, version);
+
+    std::lock_guard<std::mutex> lock(version_mutex);
+    std::string candidate = version;
+    for (int counter = 2; store_index.contains(VERSION_TABLE, name, candidate) || reserved_versions.count(name + "_v" + candidate) ||
+                          stored_version_exists(file_store.path(name + "_v" + candidate)); ++counter) {
+        candidate = version + "-" + std::to_string(counter);
+    }
+    reserved_versions.insert(name + "_v" + candidate);
+    return file_store.path(name + "_v" + candidate);
+}
+
+/**
+ * @brief Ends the reservation of a version name that was not (or is now) published.
+ * @param filePath The stored path returned by next_version_path().
+ */
+void release_version(const std::string& filePath) {
+    std::lock_guard<std::mutex> lock(version_mutex);
+    reserved_versions.erase(std::filesystem::path(filePath).filename().string());
+}
+
+/**
+ * @brief Records a new version, now in place, in the version index and makes the index
+ * durable, before the client is told.
+ * @param filePath The stored path returned by next_version_path().
+ */
+void publish_version(const std::string& filePath) {
+    add_version(filePath);
+    release_version(filePath);
+    check_index_logged(store_index.sync());
+}
+
+/**
+ * @brief Indexes every stored file by version and by content (uses the Merkle sidecars when fresh).
+ */
+void build_indexes() {
+    file_store.for_each([](const std::string& storedName) {
+        std::vector<Hash> leaves;
+        std::string filePath = file_store.path(storedName);
+        add_version(filePath);
+        if (load_merkle_tree(filePath, leaves)) {
+            index_content(filePath, merkle_root(leaves));
+        }
+    });
+    for (const StorageLayout* store : {&delta_store, &cold_store}) {
+        store->for_each([](const std::string& storedName) { add_version(file_store.path(storedName)); });
+    }
+
+    size_t flat = 0;
+    for (const StorageLayout* store : {&file_store, &metadata_store, &delta_store, &cold_store}) {
+        flat += store->count_flat();
+    }
+    if (flat > 0) {
+        std::cerr << flat << " files are still in the flat (pre-sharding) layout and are not served; "
+                  << "stop the server and run it once with --migrate." << std::endl;
+    }
+}
+
+/**
+ * @brief Lists the shard directories of the stores that hold versions (plain, delta and cold).
+ * @return The directories, with the store each belongs to.
+ */
+std::vector<std::pair<const StorageLayout*, std::string>> version_shards() {
+    std::vector<std::pair<const StorageLayout*, std::string>> shards;
+    for (const StorageLayout* store : {&file_store, &delta_store, &cold_store}) {
+        for (const std::string& directory : store->shard_directories()) {
+            shards.push_back({store, directory});
+        }
+    }
+    return shards;
+}
+
+/**
+ * @brief Opens the persistent index, or rebuilds it by scanning the store.
+ * @details With a valid snapshot, startup maps it and replays the write-ahead log, which
+ * holds at most the changes since the last checkpoint; the time taken does not depend on
+ * the size of the store. The names touched by replayed records are the ones that may have
+ * been in flight when the server stopped: their versions and content entries are checked
+ * against the files, and entries whose files are gone are dropped. Without a snapshot (or
+ * with `reindex`), every stored file is scanned and a first snapshot is written.
+ *
+ * Shards whose directory changed after the index was last written were changed behind the
+ * server's back while it was down; they are returned for watch_store() to rescan.
+ * @param reindex Rebuild even if a snapshot exists.
+ * @param stale Receives the shards to rescan.
+ * @return The logical names whose versions may still need delta encoding.
+ */
+std::vector<std::string> load_indexes(bool reindex, std::vector<std::pair<const StorageLayout*, std::string>>& stale) {
+    std::error_code ec;
+    if (reindex) {
+        std::filesystem::remove(index_path() + ".db", ec);
+    }
+    auto indexTime = std::filesystem::last_write_time(index_path() + ".wal", ec);
+    if (ec) {
+        indexTime = std::filesystem::last_write_time(index_path() + ".db", ec);
+    }
+
+    std::set<std::pair<size_t, std::string>> replayed;
+    if (store_index.open(index_path(), replayed)) {
+        for (const auto& shard : version_shards()) {
+            if (std::filesystem::last_write_time(shard.second, ec) > indexTime && !ec) {
+                stale.push_back(shard);
+            }
+        }
+        std::vector<std::string> names;
+        for (const auto& change : replayed) {
+            if (change.first == VERSION_TABLE) {
+                for (const std::string& filePath : list_versions(change.second)) {
+                    if (!stored_version_exists(filePath)) {
+                        remove_version(filePath);
+                    }
+                }
+                names.push_back(change.second);
+            } else if (change.first == DIGEST_TABLE && !std::filesystem::exists(file_store.path(change.second), ec)) {
+                forget_content(file_store.path(change.second));
+            }
+        }
+        return names;
+    }
+
+    std::cout << "Indexing the store..." << std::endl;
+    build_indexes();
+    if (!store_index.checkpoint()) {
+        std::cerr << "Could not write the index snapshot " << index_path() << ".db; the store will be rescanned at the next start." << std::endl;
+    }
+    return store_index.keys(VERSION_TABLE);
+}
+
+/**
+ * @brief Moves a flat store (every file directly in its directory) into the sharded layout.
+ * @return Process exit status: 0 if every file was moved.
+ */
+int migrate_flat_store() {
+    bool complete = true;
+    for (const StorageLayout* store : {&file_store, &metadata_store, &delta_store, &cold_store}) {
+        size_t moved = 0;
+        complete = store->migrate_flat(moved) && complete;
+        std::cout << store->directory() << ": moved " << moved << " files" << std::endl;
+    }
+    std::error_code ec;
+    std::filesystem::remove(index_path() + ".db", ec); // Moved files were never indexed: rescan at the next start
+    if (!complete) {
+        std::cerr << "Some files could not be moved; see above and run --migrate again." << std::endl;
+    }
+    return complete ? 0 : 1;
+}
+
+/**
+ * @brief Moves a file, copying it when source and target are on different storage roots.
+ * @param source The existing file.
+ * @param target The new path (must not exist).
+ * @return True on success; errno describes a failure.
+ */
+bool move_file(const std::string& source, const std::string& target) {
+    if (std::rename(source.c_str(), target.c_str()) == 0) {
+        return true;
+    }
+    if (errno != EXDEV || !clone_file(source, target)) {
+        return false;
+    }
+    std::remove(source.c_str());
+    return true;
+}
+
+/**
+ * @brief Creates a stored file with the content of another, Merkle sidecar first, and indexes its content.
+ * @details The sidecar is copied before the file appears, and the file keeps the source's
+ * modification time, so the watcher finds the sidecar fresh instead of hashing the file again.
+ * @param source The existing stored file (or its reconstruction).
+ * @param target The new stored file (must not exist).
+ * @param link Hard-link the source when possible; only for files that are never modified or removed by the server's caches.
+ * @return True on success; errno describes a failure.
+ */
+bool share_stored_data(const std::string& source, const std::string& target, bool link) {
+    std::error_code ec;
+    std::filesystem::copy_file(merkle_sidecar_path(source), merkle_sidecar_path(target),
+                               std::filesystem::copy_options::overwrite_existing, ec);
+    ec.clear();
+    if (link) {
+        std::filesystem::create_hard_link(source, target, ec);
+    }
+    if ((!link || ec) && !clone_file(source, target)) {
+        int error = errno;
+        std::remove(merkle_sidecar_path(target).c_str());
+        errno = error;
+        return false;
+    }
+    std::vector<Hash> leaves;
+    if (load_merkle_tree(target, leaves)) {
+        index_content(target, merkle_root(leaves));
+    }
+    return true;
+}
+
+/**
+ * @brief Checks that a client-supplied name stays inside the storage directory.
+ * @param name The name to check.
+ * @return True if the name is non-empty and has no path separators or parent references.
+ */
+bool is_safe_name(const std::string& name) {
+    return !name.empty() && name.find('/') == std::string::npos && name.find('\\') == std::string::npos && name != "." && name != "..";
+}
+
+/**
+ * @brief Moves every form of a stored version (plain, delta or cold, and its Merkle sidecar) to another stored name.
+ * @details Moving a version that is already at the target succeeds, so an interrupted
+ * rename can be finished by moving everything again.
+ * @param source The stored name to move.
+ * @param target The new stored name.
+ * @return True if the version's data is at the target; errno describes a failure.
+ */
+bool move_stored_version(const std::string& source, const std::string& target) {
+    std::string from = file_store.path(source), to = file_store.path(target);
+    std::error_code ec;
+    // Deltas name their base by version suffix only, so chains survive the rename.
+    // The new name may hash to another storage root, where move_file copies.
+    bool moved;
+    if (std::filesystem::exists(from, ec)) {
+        moved = move_file(from, to);
+    } else if (std::filesystem::exists(cold_path(from), ec)) {
+        moved = move_file(cold_path(from), cold_path(to));
+    } else if (std::filesystem::exists(delta_path(from), ec)) {
+        moved = move_file(delta_path(from), delta_path(to));
+    } else {
+        moved = stored_version_exists(to);
+    }
+    if (moved && std::filesystem::exists(merkle_sidecar_path(from), ec)) {
+        move_file(merkle_sidecar_path(from), merkle_sidecar_path(to));
+    }
+    std::filesystem::remove(VERSION_CACHE_DIR + source, ec);
+    return moved;
+}
+
+/**
+ * @brief Moves renamed versions in the version and content indexes, as one log record.
+ * @param moves Pairs of (old, new) stored names.
+ */
+void index_renamed_versions(const std::vector<std::pair<std::string, std::string>>& moves) {
+    std::scoped_lock lock(version_mutex, content_mutex);
+    std::vector<PersistentIndex::Change> changes;
+    for (const auto& move : moves) {
+        std::string name, version;
+        if (split_versioned_name(move.first, name, version)) {
+            changes.push_back({false, VERSION_TABLE, name, version});
+        }
+        if (split_versioned_name(move.second, name, version)) {
+            changes.push_back({true, VERSION_TABLE, name, version});
+        }
+        std::vector<std::string> digests = store_index.values(DIGEST_TABLE, move.first);
+        std::vector<Hash> leaves;
+        if (digests.empty() && load_merkle_tree(file_store.path(move.second), leaves)) {
+            digests.push_back(to_hex(merkle_root(leaves)));
+        }
+        for (const std::string& digest : digests) {
+            changes.push_back({false, CONTENT_TABLE, digest, move.first});
+            changes.push_back({false, DIGEST_TABLE, move.first, digest});
+            changes.push_back({true, CONTENT_TABLE, digest, move.second});
+            changes.push_back({true, DIGEST_TABLE, move.second, digest});
+        }
+    }
+    check_index_logged(store_index.update(changes));
+}
+
+/**
+ * @brief Writes a journal of NUL-terminated fields (names may hold any other byte).
+ * @details The journal is written to a temporary file, synced and renamed into place, so
+ * after a crash it is either complete or absent.
+ * @param journal The journal path.
+ * @param fields The fields to record.
+ * @return True once the journal is durable.
+ */
+bool save_journal(const std::string& journal, const std::vector<std::string>& fields) {
+    std::string temp = journal + ".tmp";
+    std::FILE* file = std::fopen(temp.c_str(), "wb");
+    if (!file) {
+        return false;
+    }
+    bool written = true;
+    for (const std::string& field : fields) {
+        written = written && std::fwrite(field.c_str(), 1, field.size() + 1, file) == field.size() + 1;
+    }
+    written = written && std::fflush(file) == 0;
+#ifndef _WIN32
+    written = written && fsync(fileno(file)) == 0;
+#endif
+    std::fclose(file);
+    if (!written || std::rename(temp.c_str(), journal.c_str()) != 0) {
+        std::remove(temp.c_str());
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Reads the fields of a journal written by save_journal().
+ * @param journal The journal path.
+ * @param fields Receives the fields.
+ * @return False if there is no journal.
+ */
+bool load_journal(const std::string& journal, std::vector<std::string>& fields) {
+    std::ifstream in(journal, std::ios::binary);
+    if (!in) {
+        return false;
+    }
+    fields.clear();
+    for (std::string field; std::getline(in, field, '\0');) {
+        fields.push_back(field);
+    }
+    return true;
+}
+
+/**
+ * @brief Saves the plan of a RENAME before any file moves, so a crash midway is finished on restart.
+ * @param moves Pairs of (old, new) stored names.
+ * @return True once the journal is durable.
+ */
+bool save_rename_journal(const std::vector<std::pair<std::string, std::string>>& moves) {
+    std::vector<std::string> fields;
+    for (const auto& move : moves) {
+        fields.push_back(move.first);
+        fields.push_back(move.second);
+    }
+    return save_journal(storage_roots.list().front() + RENAME_JOURNAL, fields);
+}
+
+/**
+ * @brief Finishes a RENAME that a crash interrupted, from its journal.
+ * @details Rolls forward: every version still under its old name is moved, and the
+ * index is updated for all of them, so no name keeps part of the versions.
+ */
+void finish_interrupted_rename() {
+    std::string journal = storage_roots.list().front() + RENAME_JOURNAL;
+    std::vector<std::string> fields;
+    if (!load_journal(journal, fields)) {
+        return;
+    }
+    std::vector<std::pair<std::string, std::string>> moves;
+    for (size_t i = 0; i + 1 < fields.size(); i += 2) {
+        if (is_safe_name(fields[i]) && is_safe_name(fields[i + 1])) {
+            moves.emplace_back(fields[i], fields[i + 1]);
+        }
+    }
+    for (const auto& move : moves) {
+        if (!move_stored_version(move.first, move.second)) {
+            log_error("Could not finish renaming " + move.first + " to " + move.second + ": " + std::strerror(errno));
+        }
+    }
+    index_renamed_versions(moves);
+    check_index_logged(store_index.sync());
+    std::remove(journal.c_str());
+    std::cout << "Finished an interrupted rename of " << moves.size() << " versions." << std::endl;
+}
+
+/**
+ * @brief Acknowledges a server-side operation with the stored name it produced.
+ * @param sockfd The session socket file descriptor.
+ * @param clientAddr The client address structure.
+ * @param filePath The stored file that was created or renamed.
+ * @param requestRxUs Kernel RX timestamp of the request.
+ */
+void acknowledge_with_name(int sockfd, const sockaddr_in& clientAddr, const std::string& filePath, int64_t requestRxUs) {
+    std::string storedName = std::filesystem::path(filePath).filename().string();
+    Packet reply = {ACK, {}, {}, 0, 0};
+    reply.dataSize = static_cast<uint32_t>(std::min(storedName.size(), sizeof(reply.data) - 1));
+    std::memcpy(reply.data, storedName.data(), reply.dataSize);
+    reply.processingUs = static_cast<uint32_t>(std::max<int64_t>(0, now_us() - requestRxUs));
+    send_reply(sockfd, clientAddr, reply, true);
+}
+
+/**
+ * @brief Creates a new version that shares the data of an existing stored file.
+ * @details Hard-links the existing file when possible (versions are never modified in
+ * place), otherwise copies it, and gives the new version its own Merkle sidecar.
+ * @param existing A stored file with the wanted content.
+ * @param filePath The new versioned path.
+ * @param root The expected Merkle root; the existing file must still match it.
+ * @return True if the new version was created.
+ */
+bool link_existing_content(const std::string& existing, const std::string& filePath, const Hash& root) {
+    std::vector<Hash> leaves;
+    if (!load_merkle_tree(existing, leaves) || merkle_root(leaves) != root) {
+        forget_content(existing); // Changed or deleted behind our back
+        return false;
+    }
+
+    std::error_code ec;
+    if (std::filesystem::equivalent(existing, filePath, ec)) {
+        return true; // Same version requested again
+    }
+    save_merkle_sidecar(filePath, leaves); // Before the version appears, so the watcher finds it fresh
+    std::filesystem::create_hard_link(existing, filePath, ec);
+    if (ec && !clone_file(existing, filePath)) {
+        std::remove(merkle_sidecar_path(filePath).c_str());
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Returns where an upload is staged until it is complete.
+ * @details An upload with an announced Merkle root always maps to the same path, so a
+ * client sending the same file again finds the journal of its interrupted attempt. Uploads
+ * without one cannot be resumed and get a path of their own.
+ * @param name The logical file name.
+ * @param fileSize The announced size.
+ * @param digest The announced Merkle root (all zero if unknown).
+ * @return The staging path in `UPLOAD_STAGING_DIR`; the journal is this path plus ".journal".
+ */
+std::string staging_path(const std::string& name, uint64_t fileSize, const Hash& digest) {
+    std::string key = name + '\0' + std::to_string(fileSize) + '\0' + to_hex(digest);
+    if (digest == Hash{}) {
+        key += '\0' + std::to_string(std::hash<std::thread::id>()(std::this_thread::get_id())) + '\0' + std::to_string(now_us());
+    }
+    return storage_roots.list().front() + UPLOAD_STAGING_DIR + to_hex(sha256(reinterpret_cast<const uint8_t*>(key.data()), key.size()));
+}
+
+/**
+ * @brief Checks whether a file in `UPLOAD_STAGING_DIR` is the journal of an in-place append.
+ * @param fileName The file name.
+ * @return True if it ends in APPEND_JOURNAL_SUFFIX.
+ */
+bool is_append_journal(const std::string& fileName) {
+    return fileName.size() > APPEND_JOURNAL_SUFFIX.size() &&
+           fileName.compare(fileName.size() - APPEND_JOURNAL_SUFFIX.size(), APPEND_JOURNAL_SUFFIX.size(), APPEND_JOURNAL_SUFFIX) == 0;
+}
+
+/**
+ * @brief Marks a staged upload as being received, so a duplicate request cannot write into it.
+ * @param staging The staging path.
+ * @return False if it is already being received.
+ */
+bool claim_upload(const std::string& staging) {
+    std::lock_guard<std::mutex> lock(upload_mutex);
+    return uploads_in_progress.insert(staging).second;
+}
+
+/**
+ * @brief Ends a claim_upload().
+ * @param staging The staging path.
+ */
+void release_upload(const std::string& staging) {
+    std::lock_guard<std::mutex> lock(upload_mutex);
+    uploads_in_progress.erase(staging);
+}
+
+/**
+ * @brief Makes the staged part of an upload durable, then records it in the journal.
+ * @param file The staged file being written.
+ * @param staging The staging path.
+ * @param journal The upload's journal.
+ * @return True on success.
+ */
+bool save_upload_progress(std::ofstream& file, const std::string& staging, const UploadJournal& journal) {
+    if (!file.flush()) {
+        return false;
+    }
+#ifndef _WIN32
+    int fd = open(staging.c_str(), O_RDONLY);
+    bool synced = fd >= 0 && fsync(fd) == 0;
+    if (fd >= 0) {
+        close(fd);
+    }
+    if (!synced) {
+        return false;
+    }
+#endif
+    return journal.save(staging + ".journal");
+}
+
+/**
+ * @brief The staged file of an upload of known size, mapped for writing and allocated as blocks arrive.
+ * @details Blocks are decrypted straight into the map. The file is only extended (sparse)
+ * up front; each MAPPED_WRITEBACK_INTERVAL the blocks land in is allocated before the first
+ * block is placed there, so a full disk fails that block rather than as SIGBUS on a page
+ * fault, and the holes of a sparse upload never take space. Write-back is started for every
+ * MAPPED_WRITEBACK_INTERVAL received in order and the interval before it is waited for, so
+ * dirty pages stay bounded instead of being flushed in one storm.
+ */
+class MappedStaging {
+public:
+    /**
+     * @brief Extends and maps a staged file.
+     * @details Only the first interval is allocated here, to check that the filesystem can
+     * allocate without writing zeros; otherwise the map stays closed and the caller falls back
+     * to buffered writes.
+     * @param path The staged file (its existing bytes are kept).
+     * @param size The size of the complete upload.
+     * @param offset Where this session's data starts (a resumed upload).
+     */
+    MappedStaging(const std::string& path, uint64_t size, uint64_t offset)
+        : total(size), start(std::min(offset, size)), flushed(offset - offset % MAPPED_WRITEBACK_INTERVAL) {
+#ifndef _WIN32
+        if (size == 0 || size > SIZE_MAX) {
+            return;
+        }
+        fd = open(path.c_str(), O_RDWR);
+        allocated.assign(static_cast<size_t>((size + MAPPED_WRITEBACK_INTERVAL - 1) / MAPPED_WRITEBACK_INTERVAL), false);
+        if (fd < 0 || ftruncate(fd, static_cast<off_t>(size)) != 0 || !allocate(start, 1)) {
+            return;
+        }
+        void* mapped = mmap(nullptr, static_cast<size_t>(size), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (mapped != MAP_FAILED) {
+            madvise(mapped, static_cast<size_t>(size), MADV_SEQUENTIAL);
+            base = static_cast<uint8_t*>(mapped);
+        }
+#else
+        (void)path;
+#endif
+    }
+
+    ~MappedStaging() { finish(total); }
+
+    MappedStaging(const MappedStaging&) = delete;
+    MappedStaging& operator=(const MappedStaging&) = delete;
+
+    /// @return True if the file is mapped.
+    bool is_open() const { return base != nullptr; }
+
+    /// @return The mapped bytes.
+    const uint8_t* data() const { return base; }
+
+    /// @return The size of the complete upload.
+    uint64_t size() const { return total; }
+
+    /**
+     * @brief Checks that a range of this session's data fits in the announced size.
+     * @details Compared by subtraction, so an offset near 2^64 from a hostile peer cannot wrap.
+     * @param at Offset of the range from where this session's data starts.
+     * @param length Length of the range.
+     * @return True if it fits.
+     */
+    bool fits(uint64_t at, uint64_t length) const {
+        return at <= total - start && length <= total - start - at;
+    }
+
+    /**
+     * @brief Returns where a block goes, if it fits in the announced size.
+     * @param at Offset of the block from where this session's data starts.
+     * @param length Most bytes the block can take.
+     * @return The address in the map, or nullptr.
+     */
+    uint8_t* place(uint64_t at, size_t length) {
+        return fits(at, length) && allocate(start + at, length) ? base + start + at : nullptr;
+    }
+
+    /**
+     * @brief Copies a block into the map.
+     * @param at Offset of the block from where this session's data starts.
+     * @param block The plaintext.
+     * @return False if it does not fit in the announced size.
+     */
+    bool write(uint64_t at, const std::vector<uint8_t>& block) {
+        if (!fits(at, block.size())) {
+            errno = EFBIG;
+            return false;
+        }
+        uint8_t* target = place(at, block.size());
+        if (!target) {
+            return false;
+        }
+        std::memcpy(target, block.data(), block.size());
+        return true;
+    }
+
+    /**
+     * @brief Frees the preallocated space of a zero run inside the file.
+     * @param at Offset of the run from where this session's data starts (checked with fits()).
+     * @param length Length of the run.
+     */
+    void punch(uint64_t at, uint64_t length) {
+#ifdef FALLOC_FL_PUNCH_HOLE
+        fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, static_cast<off_t>(start + at), static_cast<off_t>(length));
+#else
+        (void)at;
+        (void)length; // The preallocated range already reads as zeros
+#endif
+    }
+
+    /**
+     * @brief Paces write-back as the data received in order grows.
+     * @param end How far the file has been received in order.
+     */
+    void received_up_to(uint64_t end) {
+        while (end > flushed && end - flushed >= MAPPED_WRITEBACK_INTERVAL) {
+#ifdef SYNC_FILE_RANGE_WRITE
+            sync_file_range(fd, static_cast<off_t>(flushed), MAPPED_WRITEBACK_INTERVAL, SYNC_FILE_RANGE_WRITE);
+            if (flushed >= MAPPED_WRITEBACK_INTERVAL) {
+                sync_file_range(fd, static_cast<off_t>(flushed - MAPPED_WRITEBACK_INTERVAL), MAPPED_WRITEBACK_INTERVAL,
+                                SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+            }
+#elif !defined(_WIN32)
+            msync(base + flushed, MAPPED_WRITEBACK_INTERVAL, MS_ASYNC);
+#endif
+            flushed += MAPPED_WRITEBACK_INTERVAL;
+        }
+    }
+
+    /**
+     * @brief Makes the start of the file durable.
+     * @param length Bytes to sync.
+     * @return True on success.
+     */
+    bool sync(uint64_t length) {
+#ifndef _WIN32
+        return length == 0 || msync(base, static_cast<size_t>(std::min(length, total)), MS_SYNC) == 0;
+#else
+        return false;
+#endif
+    }
+
+    /**
+     * @brief Unmaps and closes the file, cutting it to the bytes actually received.
+     * @param length The final size.
+     * @return True if the file was closed at that size.
+     */
+    bool finish(uint64_t length) {
+        bool ok = true;
+#ifndef _WIN32
+        if (base) {
+            munmap(base, static_cast<size_t>(total));
+            base = nullptr;
+        }
+        if (fd >= 0) {
+            ok = (length >= total || ftruncate(fd, static_cast<off_t>(length)) == 0) && close(fd) == 0;
+            fd = -1;
+        }
+#else
+        (void)length;
+#endif
+        return ok;
+    }
+
+private:
+    /**
+     * @brief Allocates the intervals a range of the file falls in, if they are not yet.
+     * @details fallocate() fails where the filesystem cannot allocate without writing zeros,
+     * instead of emulating it like posix_fallocate() does.
+     * @param offset Offset of the range in the file.
+     * @param length Length of the range (within the file).
+     * @return False if the space could not be allocated (errno says why).
+     */
+    bool allocate(uint64_t offset, uint64_t length) {
+#ifndef _WIN32
+        size_t first = static_cast<size_t>(offset / MAPPED_WRITEBACK_INTERVAL);
+        size_t last = static_cast<size_t>((offset + std::max<uint64_t>(length, 1) - 1) / MAPPED_WRITEBACK_INTERVAL);
+        for (size_t interval = first; interval <= last && interval < allocated.size(); ++interval) {
+            if (allocated[interval]) {
+                continue;
+            }
+            uint64_t from = interval * MAPPED_WRITEBACK_INTERVAL;
+            off_t span = static_cast<off_t>(std::min(MAPPED_WRITEBACK_INTERVAL, total - from));
+#ifdef __linux__
+            if (fallocate(fd, 0, static_cast<off_t>(from), span) != 0) {
+                return false;
+            }
+#else
+            int error = posix_fallocate(fd, static_cast<off_t>(from), span);
+            if (error != 0) {
+                errno = error;
+                return false;
+            }
+#endif
+            allocated[interval] = true;
+        }
+#else
+        (void)offset;
+        (void)length;
+#endif
+        return true;
+    }
+
+    uint8_t* base = nullptr;
+    int fd = -1;
+    uint64_t total;   ///< Size of the complete upload
+    uint64_t start;   ///< Where this session's data starts in the file
+    std::vector<bool> allocated; ///< Intervals of MAPPED_WRITEBACK_INTERVAL allocated on disk
+    uint64_t flushed; ///< Write-back has been started up to here
+};
+
+/**
+ * @brief Receives the DATA blocks of an upload into its staged file, hashing them as they arrive.
+ * @details The writes, hashing and journal saves run in order on the root's I/O pool, so
+ * the session thread keeps acknowledging while the disk is busy. A write that fails is
+ * reported on the next block, or before the final ACK at the latest. A zero run is seeked
+ * over and only its last byte written: the staged file keeps its size, and everything
+ * before that byte is left as a hole.
+ * @param sessionfd The session socket file descriptor.
+ * @param clientAddr The client address structure.
+ * @param options The negotiated transfer options.
+ * @param key The AES encryption key.
+ * @param iv The AES initialization vector.
+ * @param pool The I/O pool of the root holding the staged file.
+ * @param file The staged file, positioned where the blocks go.
+ * @param length The number of bytes announced for the blocks, or UNKNOWN_SIZE.
+ * @param journal Hashes what is received.
+ * @param progress Called on the pool after every block and zero run.
+ * @param written Receives the number of bytes received.
+ * @param error Receives why the upload failed.
+ * @param stats Statistics for the transfer.
+ * @param commit Optional check and publication of the complete upload, run before the final ACK.
+ * @return True once the last block has been received and written (and committed).
+ */
+bool receive_upload(int sessionfd, const sockaddr_in& clientAddr, const TransferOptions& options, const std::string& key,
+                    const std::string& iv, IoPool& pool, std::ofstream& file, uint64_t length, UploadJournal& journal,
+                    const std::function<void()>& progress, uint64_t& written, std::string& error, TransferStats& stats,
+                    const WriteBarrier& commit = nullptr) {
+    IoStrand io(pool);
+    std::atomic<int> failure(0); // errno of the first failed write
+    auto failed = [&failure]() {
+        int err = failure.load();
+        if (err != 0) {
+            errno = err;
+        }
+        return err != 0;
+    };
+    bool complete = receive_data_blocks(sessionfd, clientAddr, options, key, iv, length,
+        [&](const std::vector<uint8_t>& block) {
+            io.submit([&, block]() {
+                if (failure.load() != 0) {
+                    return;
+                }
+                if (!file.write(reinterpret_cast<const char*>(block.data()), block.size())) {
+                    failure = errno != 0 ? errno : EIO;
+                    return;
+                }
+                journal.append(block.data(), block.size());
+                progress();
+            });
+            return !failed();
+        }, written, error, &stats,
+        [&](uint64_t length) {
+            if (length == 0) {
+                return true;
+            }
+            io.submit([&, length]() {
+                if (failure.load() != 0) {
+                    return;
+                }
+                if (!file.seekp(static_cast<std::streamoff>(length - 1), std::ios::cur) || !file.put('\0')) {
+                    failure = errno != 0 ? errno : EIO;
+                    return;
+                }
+                journal.append_zeros(length);
+                progress();
+            });
+            return !failed();
+        },
+        [&](std::string& reason) {
+            io.wait();
+            return !failed() && (!commit || commit(reason));
+        });
+    io.wait();
+    return complete;
+}
+
+/**
+ * @brief Receives the DATA blocks of an upload of known size into its mapped staged file.
+ * @details Blocks are decrypted in place as they arrive, in any order. What has been
+ * received in order is hashed from the map (zero runs by their length alone, so holes are
+ * not faulted in) and its write-back paced; that work and the punching of holes run on
+ * the root's I/O pool, so waiting for write-back never holds up an ACK.
+ * @param sessionfd The session socket file descriptor.
+ * @param clientAddr The client address structure.
+ * @param options The negotiated transfer options.
+ * @param key The AES encryption key.
+ * @param iv The AES initialization vector.
+ * @param pool The I/O pool of the root holding the staged file.
+ * @param staged The mapped staged file.
+ * @param offset Where the blocks start (a resumed upload).
+ * @param journal Hashes what is received.
+ * @param progress Called on the pool as the data received in order grows.
+ * @param written Receives the number of bytes received.
+ * @param error Receives why the upload failed.
+ * @param stats Statistics for the transfer.
+ * @param commit Optional check and publication of the complete upload, run before the final ACK.
+ * @return True once the last block has been received (and committed).
+ */
+bool receive_upload_mapped(int sessionfd, const sockaddr_in& clientAddr, const TransferOptions& options, const std::string& key,
+                           const std::string& iv, IoPool& pool, MappedStaging& staged, uint64_t offset, UploadJournal& journal,
+                           const std::function<void()>& progress, uint64_t& written, std::string& error, TransferStats& stats,
+                           const WriteBarrier& commit = nullptr) {
+    IoStrand io(pool);
+    std::map<uint64_t, uint64_t> runs; // Zero runs not hashed yet: offset -> length (used on the pool only)
+    uint64_t hashed = 0;               // Pool only
+    uint64_t submitted = 0;            // Received bytes handed to the pool for hashing
+    auto hash_received = [&]() {
+        if (submitted == written) {
+            return;
+        }
+        submitted = written;
+        io.submit([&, upTo = written]() {
+            while (hashed < upTo) {
+                auto run = runs.lower_bound(hashed);
+                if (run != runs.end() && run->first == hashed) {
+                    journal.append_zeros(run->second);
+                    hashed += run->second;
+                    runs.erase(run);
+                    continue;
+                }
+                uint64_t end = run != runs.end() ? std::min(upTo, run->first) : upTo;
+                journal.append(staged.data() + offset + hashed, static_cast<size_t>(end - hashed));
+                hashed = end;
+            }
+            staged.received_up_to(offset + hashed);
+            progress();
+        });
+    };
+    bool complete = receive_data_blocks_at(sessionfd, clientAddr, options, key, iv, staged.size() - offset,
+        [&](uint64_t at, const std::vector<uint8_t>& block) {
+            hash_received();
+            return staged.write(at, block);
+        }, written, error, &stats,
+        [&](uint64_t at, uint64_t length) {
+            hash_received();
+            if (!staged.fits(at, length)) {
+                errno = EFBIG;
+                return false;
+            }
+            if (length != 0) {
+                io.submit([&, at, length]() {
+                    runs[at] = length;
+                    staged.punch(at, length);
+                });
+            }
+            return true;
+        },
+        [&](uint64_t at, size_t length) {
+            hash_received();
+            return staged.place(at, length);
+        },
+        [&](std::string& reason) {
+            hash_received();
+            io.wait();
+            return !commit || commit(reason);
+        });
+    hash_received(); // An interrupted upload journals what it has
+    io.wait();
+    return complete;
+}
+
+/**
+ * @brief Rebuilds the set of resumable uploads from their journals and drops the rest.
+ * @details A staged upload is kept if its journal is intact, the staged file holds at least
+ * the journaled chunks (anything past them is truncated: it was never synced), and it was
+ * written to within UPLOAD_RESUME_TTL. Staged files without a journal, stray journals and
+ * temporary files are removed. Uploads being received, and the journals of appends (see
+ * finish_interrupted_appends()), are left alone.
+ * @return The number of uploads that can be resumed.
+ */
+size_t sweep_staged_uploads() {
+    std::string directory = storage_roots.list().front() + UPLOAD_STAGING_DIR;
+    std::vector<std::string> names;
+    std::error_code ec;
+    for (const auto& entry : std::filesystem::directory_iterator(directory, ec)) {
+        names.push_back(entry.path().filename().string());
+    }
+
+    size_t resumable = 0;
+    auto now = std::filesystem::file_time_type::clock::now();
+    for (const std::string& name : names) {
+        std::string path = directory + name;
+        if (is_append_journal(name)) {
+            continue; // Settled by its session, or by finish_interrupted_appends() on restart
+        }
+        if (name.find('.') != std::string::npos) {
+            std::string staging = path.substr(0, directory.size() + name.find('.'));
+            if (!std::filesystem::exists(staging, ec) && now - std::filesystem::last_write_time(path, ec) > UPLOAD_JOURNAL_INTERVAL) {
+                std::filesystem::remove(path, ec); // Journal or temporary file of a finished or dropped upload
+            }
+            continue;
+        }
+
+        std::lock_guard<std::mutex> lock(upload_mutex);
+        if (uploads_in_progress.count(path)) {
+            continue;
+        }
+        UploadJournal journal("", 0, Hash{});
+        uint64_t size = std::filesystem::file_size(path, ec);
+        if (!ec && UploadJournal::load(path + ".journal", journal) && size >= journal.committed() &&
+            now - std::filesystem::last_write_time(path, ec) < UPLOAD_RESUME_TTL) {
+            std::filesystem::resize_file(path, journal.committed(), ec);
+            ++resumable;
+        } else {
+            std::filesystem::remove(path, ec);
+            std::filesystem::remove(path + ".journal", ec);
+        }
+    }
+    return resumable;
+}
+
+void encode_old_versions(const std::string& name);
+
+/**
+ * @brief Queues a logical name for background delta encoding of its older versions.
+ * @details The job runs on the I/O queue of the root holding the latest version.
+ * @param name The logical file name that got a new version.
+ */
+void schedule_delta_encoding(const std::string& name) {
+    {
+        std::lock_guard<std::mutex> lock(background_mutex);
+        if (!delta_pending.insert(name).second) {
+            return; // Already queued
+        }
+    }
+    std::vector<std::string> versions = list_versions(name);
+    size_t root = storage_roots.root_of(versions.empty() ? file_store.path(name) : versions.back());
+    storage_roots.submit(root, [name] {
+        {
+            std::lock_guard<std::mutex> lock(background_mutex);
+            delta_pending.erase(name);
+        }
+        encode_old_versions(name);
+    });
+}
+
+/**
+ * @brief Reads a whole file into memory.
+ * @param filePath The file to read.
+ * @param contents Receives the bytes.
+ * @return True on success; false if the file is missing or larger than MAX_DELTA_FILE_SIZE.
+ */
+bool read_whole_file(const std::string& filePath, std::vector<uint8_t>& contents) {
+    std::error_code ec;
+    uint64_t size = std::filesystem::file_size(filePath, ec);
+    if (ec || size > MAX_DELTA_FILE_SIZE) {
+        return false;
+    }
+    std::ifstream in(filePath, std::ios::binary);
+    contents.resize(static_cast<size_t>(size));
+    in.read(reinterpret_cast<char*>(contents.data()), static_cast<std::streamsize>(size));
+    return static_cast<bool>(in) || size == 0;
+}
+
+/**
+ * @brief Replaces a plain version with a reverse delta against its newer neighbour.
+ * @param filePath The plain version to encode.
+ * @param basePath The next newer version.
+ * @return True if the version is now stored as a delta; false if it was kept plain.
+ */
+bool encode_version(const std::string& filePath, const std::string& basePath) {
+    std::vector<uint8_t> target, base, delta;
+    {
+        std::shared_lock<std::shared_mutex> lock(storage_mutex);
+        std::string readableBase = readable_version_path(basePath);
+        AccessTimeGuard targetAccess(filePath), baseAccess(readableBase);
+        if (!read_whole_file(filePath, target) || !read_whole_file(readableBase, base)) {
+            return false;
+        }
+    }
+    std::string name, baseVersion;
+    split_versioned_name(std::filesystem::path(basePath).filename().string(), name, baseVersion);
+    encode_delta(base, target, baseVersion, delta);
+    if (delta.size() > target.size() / 4 * 3) {
+        return false; // Too different to be worth a chain link
+    }
+
+    std::string temp = delta_path(filePath) + ".tmp";
+    {
+        std::ofstream out(temp, std::ios::binary | std::ios::trunc);
+        out.write(reinterpret_cast<const char*>(delta.data()), static_cast<std::streamsize>(delta.size()));
+        if (!out) {
+            std::remove(temp.c_str());
+            return false;
+        }
+    }
+
+    // The version or its base may have been deleted or renamed while we were encoding.
+    std::unique_lock<std::shared_mutex> lock(storage_mutex);
+    std::error_code ec;
+    if (!std::filesystem::exists(filePath, ec) || !stored_version_exists(basePath)) {
+        std::remove(temp.c_str());
+        return false;
+    }
+    std::filesystem::rename(temp, delta_path(filePath), ec);
+    if (ec) {
+        std::remove(temp.c_str());
+        return false;
+    }
+    forget_content(filePath);
+    std::remove(filePath.c_str()); // The Merkle sidecar stays; it still describes the content
+    return true;
+}
+
+/**
+ * @brief Delta-encodes the older versions of a logical name where that keeps chains bounded.
+ * @details Walks from the latest (always plain) version to the oldest. A plain version is
+ * encoded against its newer neighbour only if the longest chain through it, including the
+ * deltas already hanging off it, stays within MAX_DELTA_CHAIN; otherwise it is kept as a
+ * plain keyframe.
+ * @param name The logical file name.
+ */
+void encode_old_versions(const std::string& name) {
+    std::vector<std::string> versions = list_versions(name);
+    if (versions.size() < 2) {
+        return;
+    }
+
+    std::vector<bool> plain(versions.size()), delta(versions.size());
+    for (size_t i = 0; i < versions.size(); ++i) {
+        std::error_code ec;
+        plain[i] = std::filesystem::exists(versions[i], ec);
+        delta[i] = std::filesystem::exists(delta_path(versions[i]), ec);
+    }
+
+    // Deltas to apply to read each version; cold versions are keyframes like plain ones.
+    std::vector<size_t> depth(versions.size(), 0);
+    for (size_t i = versions.size() - 1; i-- > 0;) {
+        if (!plain[i]) {
+            depth[i] = delta[i] ? depth[i + 1] + 1 : 0;
+            continue;
+        }
+        size_t behind = 0;
+        for (size_t j = i; j-- > 0 && delta[j];) {
+            ++behind;
+        }
+        if (depth[i + 1] + 1 + behind <= MAX_DELTA_CHAIN && encode_version(versions[i], versions[i + 1])) {
+            delta[i] = true;
+            depth[i] = depth[i + 1] + 1;
+        }
+    }
+}
+
+/**
+ * @brief Removes reconstructed versions that have not been used for VERSION_CACHE_TTL.
+ */
+void evict_version_cache() {
+    auto now = std::chrono::steady_clock::now();
+    std::unique_lock<std::shared_mutex> storageLock(storage_mutex); // Not while a reader holds a cached path
+    std::lock_guard<std::mutex> lock(cache_mutex);
+    for (auto it = cache_last_used.begin(); it != cache_last_used.end();) {
+        if (now - it->second > VERSION_CACHE_TTL) {
+            std::error_code ec;
+            std::filesystem::remove(it->first, ec);
+            it = cache_last_used.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+/**
+ * @brief Moves a plain version to the cold tier if nobody has touched it for COLD_AFTER.
+ * @details The latest version of a name, and versions that share their data with another
+ * version through a hard link (nothing would be freed), stay where they are.
+ * @param filePath The plain version.
+ * @param latest True if it is the latest version of its name.
+ * @param budget The I/O budget of the migration.
+ */
+void migrate_to_cold(const std::string& filePath, bool latest, IoBudget& budget) {
+    struct stat info;
+    if (latest || stat(filePath.c_str(), &info) != 0 || info.st_nlink > 1) {
+        return;
+    }
+    auto untouchedSince = std::chrono::system_clock::from_time_t(std::max(info.st_atime, info.st_mtime));
+    if (std::chrono::system_clock::now() - untouchedSince < COLD_AFTER) {
+        return;
+    }
+
+    std::string temp = cold_path(filePath) + ".tmp";
+    if (!compress_cold_version(filePath, temp, budget)) {
+        std::remove(temp.c_str());
+        log_error("Could not compress " + filePath + " for the cold tier.");
+        return;
+    }
+
+    // Only swap if the version is still there and unchanged.
+    std::unique_lock<std::shared_mutex> lock(storage_mutex);
+    struct stat now;
+    std::error_code ec;
+    if (stat(filePath.c_str(), &now) != 0 || now.st_size != info.st_size || now.st_mtime != info.st_mtime) {
+        std::remove(temp.c_str());
+        return;
+    }
+    std::filesystem::rename(temp, cold_path(filePath), ec);
+    if (ec) {
+        std::remove(temp.c_str());
+        return;
+    }
+    forget_content(filePath);
+    std::remove(filePath.c_str()); // The Merkle sidecar stays; it still describes the content
+}
+
+/**
+ * @brief Moves the cold versions held by one storage root to its `COLD_STORAGE_DIR`.
+ * @details Runs on the root's I/O queue with its own COLD_IO_BUDGET, so every drive
+ * migrates at its own pace.
+ * @param root The storage root index.
+ */
+void scan_cold_versions(size_t root) {
+    IoBudget budget(COLD_IO_BUDGET);
+    for (const std::string& name : store_index.keys(VERSION_TABLE)) {
+        std::vector<std::string> versions = list_versions(name);
+        for (size_t i = 0; i < versions.size(); ++i) {
+            if (storage_roots.root_of(versions[i]) == root) {
+                migrate_to_cold(versions[i], i + 1 == versions.size(), budget);
+            }
+        }
+    }
+    std::lock_guard<std::mutex> lock(background_mutex);
+    cold_scans_pending.erase(root);
+}
+
+/**
+ * @brief Background thread: queues a cold-tier scan on every root each COLD_SCAN_INTERVAL,
+ * and every minute evicts stale reconstructions, drops expired interrupted uploads and
+ * checkpoints the index once its log holds INDEX_CHECKPOINT_RECORDS changes.
+ */
+void run_maintenance() {
+    auto nextColdScan = std::chrono::steady_clock::now();
+    while (true) {
+        if (std::chrono::steady_clock::now() >= nextColdScan) {
+            for (size_t root = 0; root < storage_roots.list().size(); ++root) {
+                std::lock_guard<std::mutex> lock(background_mutex);
+                if (cold_scans_pending.insert(root).second) { // Skip a root still busy with the last scan
+                    storage_roots.submit(root, [root] { scan_cold_versions(root); });
+                }
+            }
+            nextColdScan += COLD_SCAN_INTERVAL;
+        }
+        evict_version_cache();
+        sweep_staged_uploads();
+        if (store_index.pending() >= INDEX_CHECKPOINT_RECORDS && !store_index.checkpoint()) {
+            log_error("Could not write the index snapshot " + index_path() + ".db.");
+        }
+        std::this_thread::sleep_for(std::chrono::minutes(1));
+    }
+}
 
-const std::string SERVER_STORAGE_DIR = "./server_files/";
-const std::string BACKUP_STORAGE_DIR = "./backup_files/";
+/**
+ * @brief Removes the reconstructions of every version of a logical name from `VERSION_CACHE_DIR`.
+ * @details Needed when a version is rewritten in place: older versions are reconstructed through it.
+ * @param storedName Any stored version of the name.
+ */
+void evict_reconstructions(const std::string& storedName) {
+    std::string name, version;
+    if (!split_versioned_name(storedName, name, version)) {
+        return;
+    }
+    std::unique_lock<std::shared_mutex> storageLock(storage_mutex);
+    std::lock_guard<std::mutex> lock(cache_mutex);
+    for (const std::string& filePath : list_versions(name)) {
+        std::string cached = VERSION_CACHE_DIR + std::filesystem::path(filePath).filename().string();
+        std::error_code ec;
+        std::filesystem::remove(cached, ec);
+        cache_last_used.erase(cached);
+    }
+}
 
-std::mutex client_mutex; // Mutex to manage client threads
+/**
+ * @brief Brings the index in line with what is on disk for one stored name.
+ * @details Looks at the files as they are now rather than at what an event said happened,
+ * so repeated, reordered or stale events are harmless. When the plain file was written,
+ * its content entry is rebuilt on the root's I/O queue (from the Merkle sidecar if it is
+ * fresh); if the content differs from what was indexed, the file was rewritten in place
+ * and reconstructions through it are evicted. Names reserved by next_version_path() are
+ * skipped: an append may still be writing to the file, and its session indexes it.
+ * @param storedName The stored name.
+ * @param written True if the plain file was (re)written.
+ */
+void refresh_stored_name(const std::string& storedName, bool written) {
+    {
+        std::lock_guard<std::mutex> lock(version_mutex);
+        if (reserved_versions.count(storedName)) {
+            return; // Still being written; its session indexes it once it is complete
+        }
+    }
+    for (const StorageLayout* store : {&file_store, &metadata_store, &delta_store, &cold_store}) {
+        store->forget(storedName); // It may have appeared on, or left, another root
+    }
+    std::string filePath = file_store.path(storedName);
+    if (stored_version_exists(filePath)) {
+        add_version(filePath);
+    } else {
+        remove_version(filePath);
+    }
+
+    std::error_code ec;
+    if (!std::filesystem::exists(filePath, ec)) {
+        forget_content(filePath);
+    } else if (written) {
+        storage_roots.submit(storage_roots.root_of(filePath), [filePath, storedName] {
+            std::vector<Hash> leaves;
+            if (!load_merkle_tree(filePath, leaves)) {
+                return;
+            }
+            std::vector<std::string> previous = store_index.values(DIGEST_TABLE, storedName);
+            index_content(filePath, merkle_root(leaves));
+            if (!previous.empty() && previous.front() != to_hex(merkle_root(leaves))) {
+                evict_reconstructions(storedName);
+            }
+        });
+    }
+}
 
 /**
- * @brief Validates the existence of directories for storing files.
- * @details Creates `SERVER_STORAGE_DIR` and `BACKUP_STORAGE_DIR` if they do not exist.
+ * @brief Moves a file dropped directly into `SERVER_STORAGE_DIR`, or into the wrong shard,
+ * into its shard, where it is served.
+ * @param directory The directory holding it, with a trailing slash.
+ * @param fileName The dropped file.
  */
-void validate_directories() {
-    if (!std::filesystem::exists(SERVER_STORAGE_DIR)) {
-        std::filesystem::create_directories(SERVER_STORAGE_DIR);
+void adopt_dropped_file(const std::string& directory, const std::string& fileName) {
+    std::string source = directory + fileName;
+    std::string target = file_store.path(fileName);
+    std::string storedName;
+    std::error_code ec;
+    if (!file_store.stored_name(fileName, storedName) || !std::filesystem::is_regular_file(source, ec)) {
+        return; // Temporary and foreign files stay where they were dropped
     }
-    if (!std::filesystem::exists(BACKUP_STORAGE_DIR)) {
-        std::filesystem::create_directories(BACKUP_STORAGE_DIR);
+    if (stored_version_exists(target)) {
+        log_error("Not adopting " + source + ": " + fileName + " is already stored.");
+        return;
+    }
+    if (!move_file(source, target)) {
+        log_error("Could not move " + source + " to " + target + ": " + std::strerror(errno));
     }
 }
 
 /**
- * @brief Logs errors to a file with a timestamp.
- * @param message The error message to log.
+ * @brief Rescans storage shards and brings the index in line with them.
+ * @details Visits every entry in the shards, then every indexed version or content entry
+ * that should live in one of them.
+ * @param shards The shard directories, with the store each belongs to.
+ */
+void rescan_shards(const std::vector<std::pair<const StorageLayout*, std::string>>& shards) {
+    std::set<std::string> directories;
+    for (const auto& shard : shards) {
+        directories.insert(shard.second);
+        std::error_code ec;
+        for (const auto& entry : std::filesystem::directory_iterator(shard.second, ec)) {
+            std::string storedName;
+            if (!entry.is_regular_file(ec) || !shard.first->stored_name(entry.path().filename().string(), storedName)) {
+                continue;
+            }
+            if (shard.first == &file_store && entry.path().string() != file_store.path(storedName)) {
+                adopt_dropped_file(shard.second + "/", storedName);
+            } else {
+                refresh_stored_name(storedName, shard.first == &file_store && store_index.values(DIGEST_TABLE, storedName).empty());
+            }
+        }
+    }
+
+    auto inShards = [&directories](const std::string& path) {
+        return directories.count(std::filesystem::path(path).parent_path().string()) > 0;
+    };
+    for (const std::string& name : store_index.keys(VERSION_TABLE)) {
+        for (const std::string& filePath : list_versions(name)) {
+            if (inShards(filePath) || inShards(delta_path(filePath)) || inShards(cold_path(filePath))) {
+                refresh_stored_name(std::filesystem::path(filePath).filename().string(), false);
+            }
+        }
+    }
+    for (const std::string& storedName : store_index.keys(DIGEST_TABLE)) {
+        if (inShards(file_store.path(storedName))) {
+            refresh_stored_name(storedName, false);
+        }
+    }
+}
+
+/**
+ * @brief Background thread: keeps the index in line with files added, replaced or removed
+ * behind the server's back (by hand, or by restoring a backup).
+ * @details On Linux, inotify watches every shard of the plain, delta and cold stores, plus
+ * `SERVER_STORAGE_DIR` itself, where dropped files are moved into their shard. Each event
+ * refreshes one stored name, so no periodic rescans are needed. If the kernel's event queue
+ * overflows, everything is rescanned once. Shards changed while the server was down are
+ * rescanned first, after the watches are in place so nothing falls in between.
+ * @param stale Shards changed since the index was last written.
+ */
+void watch_store(std::vector<std::pair<const StorageLayout*, std::string>> stale) {
+#ifdef __linux__
+    int fd = inotify_init1(IN_CLOEXEC);
+    if (fd < 0) {
+        log_error(std::string("inotify unavailable, changes made behind the server's back are not seen: ") + std::strerror(errno));
+    }
+    std::unordered_map<int, std::pair<const StorageLayout*, std::string>> watches; // Watch descriptor -> shard (no store: a drop directory)
+    for (const auto& shard : version_shards()) {
+        int wd = fd < 0 ? -1 : inotify_add_watch(fd, shard.second.c_str(),
+                                                 IN_CREATE | IN_CLOSE_WRITE | IN_MOVED_TO | IN_DELETE | IN_MOVED_FROM | IN_ONLYDIR);
+        if (wd >= 0) {
+            watches[wd] = shard;
+        } else if (fd >= 0) {
+            log_error("Cannot watch " + shard.second + " (" + std::strerror(errno) + "); raise fs.inotify.max_user_watches.");
+            break;
+        }
+    }
+    for (const std::string& root : storage_roots.list()) {
+        int wd = fd < 0 ? -1 : inotify_add_watch(fd, (root + SERVER_STORAGE_DIR).c_str(), IN_CLOSE_WRITE | IN_MOVED_TO | IN_ONLYDIR);
+        if (wd >= 0) {
+            watches[wd] = {nullptr, root + SERVER_STORAGE_DIR};
+        }
+    }
+#endif
+
+    rescan_shards(stale);
+
+#ifdef __linux__
+    alignas(inotify_event) char buffer[64 * 1024];
+    while (fd >= 0) {
+        ssize_t length = read(fd, buffer, sizeof(buffer));
+        if (length <= 0) {
+            if (length < 0 && errno == EINTR) {
+                continue;
+            }
+            log_error(std::string("inotify read failed, no longer watching the store: ") + std::strerror(errno));
+            break;
+        }
+        for (char* next = buffer; next < buffer + length;) {
+            const inotify_event* event = reinterpret_cast<const inotify_event*>(next);
+            next += sizeof(inotify_event) + event->len;
+            if (event->mask & IN_Q_OVERFLOW) {
+                log_error("inotify queue overflowed; rescanning the store.");
+                rescan_shards(version_shards());
+                continue;
+            }
+            auto watch = watches.find(event->wd);
+            if (watch == watches.end() || event->len == 0) {
+                continue;
+            }
+            const StorageLayout* store = watch->second.first;
+            std::string storedName;
+            if (!store) {
+                adopt_dropped_file(watch->second.second, event->name);
+            } else if (store->stored_name(event->name, storedName)) {
+                bool written = store == &file_store && (event->mask & (IN_CLOSE_WRITE | IN_MOVED_TO));
+                if (written && watch->second.second + "/" + storedName != file_store.path(storedName)) {
+                    adopt_dropped_file(watch->second.second + "/", storedName); // Dropped into the wrong shard
+                } else {
+                    refresh_stored_name(storedName, written);
+                }
+            }
+        }
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+#endif
+}
+
+/**
+ * @brief Logs the loss counters of a finished transfer if it saw any loss.
+ * @details Kernel drops point at undersized socket buffers or a slow receiver;
+ * retransmissions without kernel drops point at loss on the path.
+ * @param filePath The file that was transferred.
+ * @param stats The transfer statistics.
  * @param clientAddr The client address structure.
  */
-void log_error(const std::string& message, const sockaddr_in& clientAddr) {
-    auto now = std::chrono::system_clock::now();
-    auto time = std::chrono::system_clock::to_time_t(now);
+void log_transfer_stats(const std::string& filePath, const TransferStats& stats, const sockaddr_in& clientAddr) {
+    if (stats.retransmissions > 0 || stats.kernelDrops > 0) {
+        log_error("Transfer of " + filePath + ": " + format_transfer_stats(stats), clientAddr);
+    }
+}
 
-    std::ofstream log("server_error.log", std::ios::app);
-    if (log.is_open()) {
-        log << "[" << std::put_time(std::localtime(&time), "%Y-%m-%d %H:%M:%S") << "] ";
-        log << "Client IP: " << inet_ntoa(clientAddr.sin_addr)
-            << ", Port: " << ntohs(clientAddr.sin_port) << " - " << message << std::endl;
+/**
+ * @class NameTurn
+ * @brief Holds the turn of a logical name among its APPENDs and RENAMEs until destroyed.
+ * @details Each append builds on the version the previous one made, and a RENAME must not
+ * fall between the steps of an append that extends the latest version in place.
+ */
+class NameTurn {
+public:
+    /// @param name The logical name; waits until no other APPEND or RENAME holds it.
+    explicit NameTurn(const std::string& name) : name(name) {
+        std::unique_lock<std::mutex> lock(append_mutex);
+        append_finished.wait(lock, [&name] { return appends_in_progress.count(name) == 0; });
+        appends_in_progress.insert(name);
+    }
+
+    ~NameTurn() {
+        {
+            std::lock_guard<std::mutex> lock(append_mutex);
+            appends_in_progress.erase(name);
+        }
+        append_finished.notify_all();
+    }
+
+    NameTurn(const NameTurn&) = delete;
+    NameTurn& operator=(const NameTurn&) = delete;
+
+private:
+    std::string name;
+};
+
+/**
+ * @brief Undoes an in-place extension: the new version's file becomes the version it extended again.
+ * @details The file is cut back to the old size and renamed back, the prefix delta that
+ * stood in for the old version is dropped, and the old version's content is indexed again.
+ * Its Merkle sidecar still describes the restored bytes, so it is kept fresh instead of
+ * hashing the whole file again.
+ * @param base The version that was extended.
+ * @param filePath The new version it had become.
+ * @param baseSize The size of the version before the extension.
+ */
+void undo_extension(const std::string& base, const std::string& filePath, uint64_t baseSize) {
+    std::unique_lock<std::shared_mutex> storageLock(storage_mutex);
+    std::error_code ec;
+    if (!std::filesystem::exists(base, ec) && std::filesystem::exists(filePath, ec)) {
+        std::filesystem::resize_file(filePath, baseSize, ec);
+        if (!ec) {
+            std::filesystem::rename(filePath, base, ec);
+        }
+        if (ec) {
+            log_error("Could not undo the extension of " + base + ": " + ec.message());
+            return;
+        }
+        std::filesystem::last_write_time(merkle_sidecar_path(base), std::filesystem::last_write_time(base, ec), ec);
+    }
+    forget_content(filePath);
+
+    std::string name, version, baseVersion;
+    uint64_t size;
+    split_versioned_name(std::filesystem::path(filePath).filename().string(), name, version);
+    if (std::filesystem::exists(base, ec) && read_delta_header(delta_path(base), baseVersion, size) && baseVersion == version) {
+        std::filesystem::remove(delta_path(base), ec);
+    }
+    std::filesystem::remove(delta_path(base) + APPEND_JOURNAL_SUFFIX, ec);
+    std::vector<Hash> leaves;
+    if (load_merkle_tree(base, leaves)) {
+        index_content(base, merkle_root(leaves));
+    }
+}
+
+/**
+ * @brief Extends the latest version of a name in place into the next version, where that is safe.
+ * @details Only a plain latest version whose file nothing else shares (a single link, and
+ * room in its delta chain for one more link) is extended. It is replaced by a reverse delta
+ * that copies the first `baseSize` bytes of the new version, and its file is renamed to the
+ * new version before the tail is appended, so neither version is ever read half-written.
+ * The steps are journaled, and finish_interrupted_appends() undoes one a crash interrupted.
+ * Callers hold the name's NameTurn and no storage lock.
+ * @param base The latest version, as it was when the append started.
+ * @param baseSize Its size then.
+ * @param filePath The new version, reserved with next_version_path().
+ * @param tail The staged bytes to append.
+ * @param journal The journal path.
+ * @param extended Set if the version was extended; false if the caller has to copy it instead.
+ * @return False if the extension failed and was undone; errno describes the failure.
+ */
+bool extend_in_place(const std::string& base, uint64_t baseSize, const std::string& filePath, const std::string& tail,
+                     const std::string& journal, bool& extended) {
+    extended = false;
+    std::string storedName = std::filesystem::path(filePath).filename().string();
+    std::string name, version;
+    split_versioned_name(storedName, name, version);
+    std::vector<uint8_t> delta;
+    encode_prefix_delta(baseSize, version, delta);
+    std::string temp = delta_path(base) + APPEND_JOURNAL_SUFFIX;
+    {
+        std::ofstream out(temp, std::ios::binary | std::ios::trunc);
+        out.write(reinterpret_cast<const char*>(delta.data()), static_cast<std::streamsize>(delta.size()));
+        if (!out || !save_journal(journal, {std::filesystem::path(base).filename().string(), storedName, std::to_string(baseSize)})) {
+            out.close();
+            std::remove(temp.c_str());
+            return true;
+        }
+    }
+
+    {
+        // Checked again under the lock: a newer version, a hard link or a delta may have appeared meanwhile.
+        std::unique_lock<std::shared_mutex> storageLock(storage_mutex);
+        std::vector<std::string> versions = list_versions(name);
+        std::error_code ec;
+        size_t behind = 0;
+        for (size_t i = versions.size() - 1; i-- > 0 && std::filesystem::exists(delta_path(versions[i]), ec);) {
+            ++behind;
+        }
+        struct stat info;
+        bool safe = !versions.empty() && versions.back() == base && stat(base.c_str(), &info) == 0 && info.st_nlink == 1 &&
+                    static_cast<uint64_t>(info.st_size) == baseSize && behind + 1 <= MAX_DELTA_CHAIN &&
+                    storage_roots.root_of(base) == storage_roots.root_of(filePath);
+        if (safe && std::rename(temp.c_str(), delta_path(base).c_str()) == 0) {
+            extended = std::rename(base.c_str(), filePath.c_str()) == 0;
+            if (extended) {
+                forget_content(base);
+            } else {
+                std::remove(delta_path(base).c_str());
+            }
+        }
+    }
+    if (!extended) {
+        std::remove(temp.c_str());
+        std::remove(journal.c_str());
+        return true;
+    }
+    if (!append_file(tail, filePath)) {
+        int err = errno;
+        undo_extension(base, filePath, baseSize);
+        std::remove(journal.c_str());
+        errno = err;
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Applies an APPEND: the latest version plus the received tail becomes a new version.
+ * @details Only the tail is staged. Once it is complete, the latest version's file is
+ * extended in place where nothing else shares it (see extend_in_place()), and the old
+ * version becomes a delta of a few bytes; otherwise the latest version is copied (a reflink
+ * where the filesystem has them) and the tail appended to the copy, and a full copy of a
+ * large version is logged, since it stays plain. Only the base's last partial Merkle chunk
+ * is hashed again. The new version appears only once it is complete, and an interrupted
+ * append leaves nothing behind. Without a stored version the tail becomes the first one.
+ * Callers hold the name's NameTurn.
+ * @param sessionfd The session socket file descriptor.
+ * @param clientAddr The client address structure.
+ * @param packet The APPEND request.
+ * @param key The AES encryption key.
+ * @param iv The AES initialization vector.
+ * @param requestRxUs Kernel RX timestamp of the request.
+ */
+void receive_append(int sessionfd, const sockaddr_in& clientAddr, const Packet& packet, const std::string& key,
+                    const std::string& iv, int64_t requestRxUs) {
+    const std::string name = packet.filename;
+    std::string staging = staging_path(name, UNKNOWN_SIZE, Hash{});
+    claim_upload(staging); // The periodic sweep leaves the tail alone
+    std::string base;
+    std::vector<Hash> leaves;
+    uint64_t baseSize = 0;
+    std::vector<uint8_t> lastChunk;
+    std::error_code ec;
+    {
+        std::shared_lock<std::shared_mutex> storageLock(storage_mutex);
+        std::vector<std::string> versions = list_versions(name);
+        auto latest = std::find_if(versions.rbegin(), versions.rend(), stored_version_exists);
+        if (latest != versions.rend()) {
+            base = *latest;
+            std::string readable = readable_version_path(base);
+            baseSize = std::filesystem::file_size(readable, ec);
+            // The base's last partial chunk is hashed again together with the appended bytes.
+            lastChunk.resize(ec ? 0 : static_cast<size_t>(baseSize % MERKLE_CHUNK_SIZE));
+            std::ifstream in(readable, std::ios::binary);
+            in.seekg(static_cast<std::streamoff>(baseSize - lastChunk.size()));
+            in.read(reinterpret_cast<char*>(lastChunk.data()), static_cast<std::streamsize>(lastChunk.size()));
+            if (ec || !in || !load_merkle_tree(readable, leaves)) {
+                send_error_packet(sessionfd, clientAddr, error_code_from_errno(errno), "Could not read the latest version.");
+                log_error("Could not read " + readable + " for an append", clientAddr);
+                release_upload(staging);
+                return;
+            }
+        }
+    }
+
+    UploadJournal journal(name, UNKNOWN_SIZE, Hash{});
+    journal.append(lastChunk.data(), lastChunk.size());
+    uint64_t wholeChunks = baseSize / MERKLE_CHUNK_SIZE;
+    leaves.resize(static_cast<size_t>(std::min<uint64_t>(leaves.size(), wholeChunks)));
+
+    std::ofstream file(staging, std::ios::binary | std::ios::trunc);
+    if (!file || leaves.size() != wholeChunks) {
+        send_error_packet(sessionfd, clientAddr, error_code_from_errno(errno), "Could not create file.");
+        log_error("Could not create file: " + staging, clientAddr);
+        std::filesystem::remove(staging, ec);
+        release_upload(staging);
+        return;
+    }
+
+    TransferOptions options = acknowledge_request(sessionfd, clientAddr, packet, requestRxUs, baseSize);
+    uint64_t written = 0;
+    std::string error;
+    TransferStats stats;
+    // Published before the final ACK, so the client learns of a failure instead of a success.
+    auto commit = [&](std::string& reason) {
+        file.close();
+        if (!file) {
+            reason = "Could not store the file.";
+            return false;
+        }
+        std::vector<Hash> tail = journal.finish();
+        leaves.insert(leaves.end(), tail.begin(), tail.end());
+
+        std::string filePath;
+        {
+            std::shared_lock<std::shared_mutex> storageLock(storage_mutex);
+            filePath = next_version_path(name);
+        }
+        bool extended = false;
+        bool stored = base.empty() ? move_file(staging, filePath)
+                                   : extend_in_place(base, baseSize, filePath, staging, staging + APPEND_JOURNAL_SUFFIX, extended);
+        if (stored && !base.empty() && !extended) {
+            std::string copy = staging + ".copy";
+            bool reflinked = false;
+            {
+                std::shared_lock<std::shared_mutex> storageLock(storage_mutex);
+                stored = clone_file(readable_version_path(base), copy, &reflinked);
+            }
+            stored = stored && append_file(staging, copy) && move_file(copy, filePath);
+            int err = errno;
+            std::remove(copy.c_str());
+            errno = err;
+            if (stored && !reflinked && baseSize >= MAX_DELTA_FILE_SIZE) {
+                log_error("Append to " + name + " copied the whole latest version (" + std::to_string(baseSize) +
+                              " bytes): it is shared or at the end of its delta chain.",
+                          clientAddr);
+            }
+        }
+        if (!stored) {
+            int err = errno;
+            reason = "Could not store the file.";
+            log_error("Could not store append " + staging + " as " + filePath + ": " + std::strerror(err), clientAddr);
+            release_version(filePath);
+            errno = err;
+            return false;
+        }
+
+        save_merkle_sidecar(filePath, leaves); // After the data, so it is fresh; also marks the append complete
+        std::shared_lock<std::shared_mutex> storageLock(storage_mutex);
+        index_content(filePath, merkle_root(leaves));
+        publish_version(filePath);
+        std::remove((staging + APPEND_JOURNAL_SUFFIX).c_str());
+        return true;
+    };
+    bool complete = receive_upload(sessionfd, clientAddr, options, key, iv, storage_roots.io_pool(staging), file, UNKNOWN_SIZE, journal, [] {},
+                                   written, error, stats, commit);
+    log_transfer_stats(name, stats, clientAddr);
+    file.close();
+    std::filesystem::remove(staging, ec);
+    release_upload(staging);
+    if (!complete) {
+        log_error("Append incomplete (" + error + "), discarded: " + name, clientAddr);
+        return;
+    }
+    schedule_delta_encoding(name); // A copied base usually shrinks to a delta of a few bytes
+}
+
+/**
+ * @brief Settles the in-place appends a crash interrupted, from their journals.
+ * @details An append whose new version has its Merkle sidecar was complete (the sidecar is
+ * written once the data is synced) and is published; any other is undone, so the version it
+ * extended is back as it was.
+ */
+void finish_interrupted_appends() {
+    std::string directory = storage_roots.list().front() + UPLOAD_STAGING_DIR;
+    std::vector<std::string> journals;
+    std::error_code ec;
+    for (const auto& entry : std::filesystem::directory_iterator(directory, ec)) {
+        if (is_append_journal(entry.path().filename().string())) {
+            journals.push_back(entry.path().string());
+        }
+    }
+
+    for (const std::string& journal : journals) {
+        std::vector<std::string> fields;
+        uint64_t baseSize = 0;
+        if (load_journal(journal, fields) && fields.size() == 3 && is_safe_name(fields[0]) && is_safe_name(fields[1]) &&
+            std::from_chars(fields[2].data(), fields[2].data() + fields[2].size(), baseSize).ec == std::errc()) {
+            std::string base = file_store.path(fields[0]);
+            std::string filePath = file_store.path(fields[1]);
+            std::vector<Hash> leaves;
+            if (std::filesystem::exists(merkle_sidecar_path(filePath), ec) && load_merkle_tree(filePath, leaves)) {
+                add_version(filePath);
+                index_content(filePath, merkle_root(leaves));
+                std::cout << "Finished an interrupted append to " << fields[1] << "." << std::endl;
+            } else {
+                std::filesystem::remove(merkle_sidecar_path(filePath), ec);
+                undo_extension(base, filePath, baseSize);
+                remove_version(filePath);
+                std::cout << "Undid an interrupted append to " << fields[0] << "." << std::endl;
+            }
+        }
+        check_index_logged(store_index.sync());
+        std::filesystem::remove(journal, ec);
+    }
+}
+
+/**
+ * @brief Checks whether a file starts with the bytes a followed file has been read up to.
+ * @details Whole Merkle chunks are compared by their leaves, the rest byte by byte.
+ * @param followed The stored version being followed (its sidecar describes its chunks).
+ * @param file The followed file.
+ * @param size The followed file's size.
+ * @param position How far the followed file has been read.
+ * @param candidate The file that may go on with it.
+ * @return True if the candidate holds the same bytes up to the position.
+ */
+bool continues_followed(const std::string& followed, std::FILE* file, uint64_t size, uint64_t position, const std::string& candidate) {
+#ifndef _WIN32
+    std::error_code ec;
+    size_t chunks = static_cast<size_t>(position / MERKLE_CHUNK_SIZE);
+    std::vector<Hash> before, after;
+    if (std::filesystem::file_size(candidate, ec) < position || ec || !read_merkle_sidecar(followed, size, before) ||
+        !load_merkle_tree(candidate, after) || before.size() < chunks || after.size() < chunks ||
+        !std::equal(before.begin(), before.begin() + static_cast<std::ptrdiff_t>(chunks), after.begin())) {
+        return false;
     }
+    std::vector<uint8_t> ours(static_cast<size_t>(position % MERKLE_CHUNK_SIZE)), theirs(ours.size());
+    std::ifstream in(candidate, std::ios::binary);
+    in.seekg(static_cast<std::streamoff>(chunks * MERKLE_CHUNK_SIZE));
+    in.read(reinterpret_cast<char*>(theirs.data()), static_cast<std::streamsize>(theirs.size()));
+    ssize_t got = pread(fileno(file), ours.data(), ours.size(), static_cast<off_t>(chunks * MERKLE_CHUNK_SIZE));
+    return (static_cast<bool>(in) || theirs.empty()) && got == static_cast<ssize_t>(ours.size()) && ours == theirs;
+#else
+    (void)followed, (void)file, (void)size, (void)position, (void)candidate;
+    return false;
+#endif
+}
+
+/**
+ * @brief Makes a follow go on into the versions that APPENDs to the name make.
+ * @details An append that extends the latest version in place renames its file to the new
+ * version, so the follow keeps the same file once that version is published, and while an
+ * append or RENAME holds the name's turn. An append that copied the version publishes a new
+ * file, which the follow switches to if it holds the same bytes up to the position reached.
+ * Otherwise the follow goes on while the followed file is still in place, and ends once it
+ * is deleted or moved away.
+ * @param name The requested name.
+ * @param followed The stored version being followed.
+ * @param opened The file opened for it (a reconstruction for a delta version).
+ * @return The successor for ReadAhead.
+ */
+FollowSuccessor follow_appends(const std::string& name, std::string followed, std::string opened) {
+    std::string rejected; // Latest version already found not to go on with the followed one
+    return [name, followed, opened, rejected](std::FILE* file, uint64_t position) mutable -> std::FILE* {
+        struct stat current;
+        if (fstat(fileno(file), &current) != 0) {
+            return nullptr;
+        }
+        auto same = [&current](const std::string& path) {
+            struct stat info;
+            return stat(path.c_str(), &info) == 0 && info.st_dev == current.st_dev && info.st_ino == current.st_ino;
+        };
+
+        std::shared_lock<std::shared_mutex> storageLock(storage_mutex);
+        std::string latest = stored_version_for(name);
+        if (same(latest)) {
+            followed = opened = latest; // Extended in place into the latest version
+            return file;
+        }
+        if (latest != followed && latest != rejected && stored_version_exists(latest)) {
+            std::string path = readable_version_path(latest);
+            std::FILE* next = continues_followed(followed, file, static_cast<uint64_t>(current.st_size), position, path)
+                                  ? std::fopen(path.c_str(), "rb")
+                                  : nullptr;
+            if (next) {
+                followed = latest;
+                opened = path;
+                return next;
+            }
+            rejected = latest;
+        }
+        if (current.st_nlink > 0 && same(opened)) {
+            return file;
+        }
+        std::lock_guard<std::mutex> lock(append_mutex);
+        return current.st_nlink > 0 && appends_in_progress.count(name) ? file : nullptr; // Mid-append: not published yet
+    };
 }
 
 /**
  * @brief Handles a single client request.
- * @param sockfd The server socket file descriptor.
+ * @details The request is answered from a dedicated session socket. RRQ/WRQ options are
+ * negotiated in the first response (OACK); DATA blocks are then acknowledged cumulatively,
+ * and the block flagged with FLAG_LAST_BLOCK ends the session once it has been acknowledged.
  * @param clientAddr The client address structure.
  * @param packet The packet received from the client.
  * @param key The AES encryption key.
  * @param iv The AES initialization vector.
+ * @param requestRxUs Kernel RX timestamp of the request.
+ * @param requestKey The request's key in recent_requests.
  */
-void handle_client(int sockfd, sockaddr_in clientAddr, Packet packet, const std::string& key, const std::string& iv) {
-    socklen_t clientLen = sizeof(clientAddr);
+void handle_client(sockaddr_in clientAddr, Packet packet, const std::string& key, const std::string& iv, int64_t requestRxUs,
+                   const std::string& requestKey) {
+    packet.filename[sizeof(packet.filename) - 1] = '\0';
+
+    int sessionfd = open_session_socket();
+    if (sessionfd < 0) {
+        log_error("Could not open session socket.", clientAddr);
+        std::lock_guard<std::mutex> lock(request_mutex);
+        recent_requests.erase(requestKey);
+        return;
+    }
+    attach_session(requestKey, sessionfd);
 
     switch (packet.operationID) {
         case RRQ: { // Read Request
-            std::string filePath = SERVER_STORAGE_DIR + packet.filename;
-            std::ifstream file(filePath, std::ios::binary);
-            if (!file) {
-                const char* error = "Error: File not found.";
-                sendto(sockfd, error, strlen(error), 0, (struct sockaddr*)&clientAddr, clientLen);
+            // Hold the storage lock until the file is open, so it cannot be encoded or moved under us.
+            std::shared_lock<std::shared_mutex> storageLock(storage_mutex);
+            std::string storedPath = stored_version_for(packet.filename);
+            std::string filePath = storedPath;
+            std::error_code ec;
+            std::FILE* file = nullptr;
+            std::unique_ptr<ColdFileReader> cold;
+            if (!std::filesystem::exists(filePath, ec) && std::filesystem::exists(cold_path(filePath), ec)) {
+                cold = std::make_unique<ColdFileReader>(cold_path(filePath)); // Streamed, never decompressed to disk
+            } else {
+                filePath = readable_version_path(filePath);
+                file = std::fopen(filePath.c_str(), "rb");
+            }
+            if (cold ? !cold->is_open() : !file) {
+                int code = error_code_from_errno(errno);
+                send_error_packet(sessionfd, clientAddr, code, code == ERR_ACCESS_VIOLATION ? "Permission denied." : "File not found.");
                 log_error("File not found: " + filePath, clientAddr);
-                return;
+                break;
+            }
+
+            // Announce the file size so the client can preallocate and knows when it is done,
+            // and the Merkle root so it can verify what it received.
+            uint64_t fileSize = cold ? cold->size() : std::filesystem::file_size(filePath, ec);
+            std::vector<Hash> leaves;
+            Hash root = {};
+            if (cold ? read_merkle_sidecar(filePath, fileSize, leaves) : load_merkle_tree(filePath, leaves)) {
+                root = merkle_root(leaves);
             }
+            storageLock.unlock();
+            TransferOptions options = acknowledge_request(sessionfd, clientAddr, packet, requestRxUs, fileSize, &root);
 
-            char buffer[PACKET_SIZE];
-            while (file.read(buffer, PACKET_SIZE) || file.gcount() > 0) {
-                std::vector<uint8_t> encrypted = aes_encrypt(
-                    std::vector<uint8_t>(buffer, buffer + file.gcount()), key, iv);
-                Packet response = {ACK, {}, {}, 0, static_cast<size_t>(file.gcount())};
-                std::memcpy(response.data, encrypted.data(), encrypted.size());
-                response.checksum = calculate_checksum(encrypted);
-                sendto(sockfd, (char*)&response, sizeof(Packet), 0, (struct sockaddr*)&clientAddr, clientLen);
+            // A ranged read (used for targeted repair) sends only [rangeOffset, rangeOffset + rangeLength).
+            uint64_t offset = std::min(options.rangeOffset, fileSize);
+            uint64_t remaining = fileSize - offset;
+            if (options.rangeLength != 0) {
+                remaining = std::min(remaining, options.rangeLength);
             }
-            file.close();
+            std::string error;
+            TransferStats stats;
+            if (options.follow && !cold) {
+                // Follow mode: stream the file from the offset on, then whatever is appended to it,
+                // on into the versions APPENDs make. The handle opened under the lock is followed,
+                // so a RENAME, DEL, delta encoding or cache eviction since then cannot make the follow fail.
+                ReadAhead source(file, offset, options, key, iv, follow_appends(packet.filename, storedPath, filePath));
+                if (!send_data_blocks(sessionfd, clientAddr, options, UNKNOWN_SIZE, source, error, &stats)) {
+                    log_error("Follow ended, " + error + ": " + filePath, clientAddr);
+                }
+                log_transfer_stats(filePath, stats, clientAddr);
+                break;
+            }
+            bool sent;
+            // Disk reads run on the drive's I/O pool, so a slow disk stalls reads, not this session's ACKs.
+            // A cold version is decompressed there too, including the bytes skipped to reach the offset.
+            IoPool& pool = storage_roots.io_pool(cold ? cold_path(filePath) : filePath);
+            IoExecutor io = [&pool](const std::function<void()>& job) { pool.run(job); };
+            bool skipped = offset == 0;
+            std::unique_ptr<ReadAhead> source =
+                cold ? std::make_unique<ReadAhead>(
+                           [&cold, &skipped, offset](uint8_t* buffer, size_t capacity) -> size_t {
+                               if (!skipped) {
+                                   skipped = true;
+                                   if (!cold->skip(offset)) {
+                                       return 0;
+                                   }
+                               }
+                               return cold->read(buffer, capacity);
+                           },
+                           remaining, options, key, iv, io)
+                     : std::make_unique<ReadAhead>(file, offset, remaining, options, key, iv, io);
+            sent = send_data_blocks(sessionfd, clientAddr, options, remaining, *source, error, &stats);
+            if (source->failed()) {
+                log_error("Read failed: " + filePath, clientAddr);
+            }
+            if (!sent) {
+                log_error("Transfer aborted, " + error + ": " + filePath, clientAddr);
+            }
+            log_transfer_stats(filePath, stats, clientAddr);
             break;
         }
         case WRQ: { // Write Request
-            std::string filePath = generate_versioned_filename(SERVER_STORAGE_DIR + packet.filename);
-            std::ofstream file(filePath, std::ios::binary);
+            // Instant upload: if the content is already stored, link a new version to it and skip the DATA phase.
+            Hash digest;
+            std::memcpy(digest.data(), packet.digest, HASH_SIZE);
+            if (digest != Hash{}) {
+                std::shared_lock<std::shared_mutex> storageLock(storage_mutex);
+                std::string existing = find_content(digest);
+                if (!existing.empty()) {
+                    std::string filePath = next_version_path(packet.filename);
+                    if (link_existing_content(existing, filePath, digest)) {
+                        index_content(filePath, digest);
+                        publish_version(filePath);
+                        acknowledge_request(sessionfd, clientAddr, packet, requestRxUs, packet.fileSize, &digest, FLAG_CONTENT_EXISTS);
+                        schedule_delta_encoding(packet.filename);
+                        break;
+                    }
+                    release_version(filePath);
+                }
+            }
+
+            // The upload is staged until complete. With an announced Merkle root and a client
+            // that can resume, its progress is journaled and a later attempt continues from it.
+            std::string staging = staging_path(packet.filename, packet.fileSize, digest);
+            if (!claim_upload(staging)) {
+                send_error_packet(sessionfd, clientAddr, ERR_FILE_EXISTS, "The same upload is already in progress.");
+                break;
+            }
+            size_t optionsLength = std::min<size_t>(packet.optionsLength, sizeof(packet.options));
+            bool resumable = digest != Hash{} && packet.optionsLength != 0 && decode_options(packet.options, optionsLength).resume;
+            UploadJournal journal(packet.filename, packet.fileSize, digest);
+            std::error_code ec;
+            uint64_t offset = 0;
+            if (resumable && UploadJournal::load(staging + ".journal", journal) && journal.name() == packet.filename &&
+                journal.file_size() == packet.fileSize && journal.digest() == digest &&
+                std::filesystem::file_size(staging, ec) >= journal.committed() && !ec) {
+                offset = journal.committed();
+                std::filesystem::resize_file(staging, offset, ec); // Drop what was received after the last journaled chunk
+            } else {
+                journal = UploadJournal(packet.filename, packet.fileSize, digest);
+            }
+
+            std::ofstream file(staging, offset > 0 ? std::ios::binary | std::ios::in | std::ios::out : std::ios::binary | std::ios::trunc);
             if (!file) {
-                const char* error = "Error: Could not create file.";
-                sendto(sockfd, error, strlen(error), 0, (struct sockaddr*)&clientAddr, clientLen);
-                log_error("Could not create file: " + filePath, clientAddr);
-                return;
+                send_error_packet(sessionfd, clientAddr, error_code_from_errno(errno), "Could not create file.");
+                log_error("Could not create file: " + staging, clientAddr);
+                release_upload(staging);
+                break;
             }
+            file.seekp(static_cast<std::streamoff>(offset));
 
-            ssize_t received;
-            char buffer[PACKET_SIZE];
-            while ((received = recvfrom(sockfd, buffer, PACKET_SIZE, 0, (struct sockaddr*)&clientAddr, &clientLen)) > 0) {
-                std::vector<uint8_t> decrypted = aes_decrypt(std::vector<uint8_t>(buffer, buffer + received), key, iv);
-                if (!verify_checksum(decrypted, packet.checksum)) {
-                    log_error("Checksum mismatch for file: " + std::string(packet.filename), clientAddr);
-                    continue;
+            // An upload of known size is decrypted straight into a map of its preallocated staged file.
+            std::unique_ptr<MappedStaging> mapped;
+            if (mapped_uploads && packet.fileSize != UNKNOWN_SIZE && packet.fileSize > offset) {
+                file.close();
+                mapped = std::make_unique<MappedStaging>(staging, packet.fileSize, offset);
+                if (!mapped->is_open()) {
+                    mapped.reset(); // Fall back to buffered writes
+                    file.open(staging, std::ios::binary | std::ios::in | std::ios::out);
+                    file.seekp(static_cast<std::streamoff>(offset));
+                }
+            }
+
+            TransferOptions options = acknowledge_request(sessionfd, clientAddr, packet, requestRxUs, 0, nullptr, 0, offset);
+
+            uint64_t written = 0;
+            std::string error;
+            TransferStats stats;
+            auto save_progress = [&]() {
+                return mapped ? mapped->sync(journal.committed()) && journal.save(staging + ".journal")
+                              : save_upload_progress(file, staging, journal);
+            };
+            auto lastSave = std::chrono::steady_clock::now();
+            auto journal_progress = [&]() {
+                if (resumable && std::chrono::steady_clock::now() - lastSave >= UPLOAD_JOURNAL_INTERVAL) {
+                    save_progress();
+                    lastSave = std::chrono::steady_clock::now();
+                }
+            };
+            // The upload is checked against what the client announced and published before the
+            // final ACK, so the client learns of a mismatch or a failed move instead of a success.
+            bool rejected = false;
+            auto commit = [&](std::string& reason) {
+                file.close();
+                rejected = true;
+                if (mapped && !mapped->finish(offset + written)) {
+                    reason = "Could not store the file.";
+                    log_error("Could not finish staged upload " + staging + ": " + std::strerror(errno), clientAddr);
+                    return false;
+                }
+                if (packet.fileSize != UNKNOWN_SIZE && offset + written != packet.fileSize) {
+                    errno = EINVAL;
+                    reason = "Size mismatch.";
+                    log_error("Upload size mismatch for " + std::string(packet.filename) + ": expected " + std::to_string(packet.fileSize) +
+                              " bytes, received " + std::to_string(offset + written), clientAddr);
+                    return false;
+                }
+                std::vector<Hash> leaves = journal.finish();
+                if (digest != Hash{} && merkle_root(leaves) != digest) {
+                    errno = EINVAL;
+                    reason = "Content does not match its Merkle root.";
+                    log_error("Upload of " + std::string(packet.filename) + " does not match the Merkle root the client announced.", clientAddr);
+                    return false;
+                }
+
+                std::shared_lock<std::shared_mutex> storageLock(storage_mutex); // Not while a RENAME moves the versions
+                // The sidecar goes first: the watcher sees the version appear and must find it fresh.
+                std::string filePath = next_version_path(packet.filename);
+                save_merkle_sidecar(filePath, leaves);
+                if (!move_file(staging, filePath)) {
+                    int err = errno;
+                    reason = "Could not store the file.";
+                    log_error("Could not store upload " + staging + " as " + filePath + ": " + std::strerror(err), clientAddr);
+                    std::remove(merkle_sidecar_path(filePath).c_str());
+                    release_version(filePath);
+                    errno = err;
+                    return false;
+                }
+                index_content(filePath, merkle_root(leaves));
+                publish_version(filePath);
+                rejected = false;
+                return true;
+            };
+            IoPool& pool = storage_roots.io_pool(staging);
+            bool complete = mapped ? receive_upload_mapped(sessionfd, clientAddr, options, key, iv, pool, *mapped, offset, journal,
+                                                           journal_progress, written, error, stats, commit)
+                                   : receive_upload(sessionfd, clientAddr, options, key, iv, pool, file,
+                                                    packet.fileSize == UNKNOWN_SIZE ? UNKNOWN_SIZE : packet.fileSize - std::min(offset, packet.fileSize),
+                                                    journal, journal_progress,
+                                                    written, error, stats, commit);
+            log_transfer_stats(packet.filename, stats, clientAddr);
+
+            if (!complete) {
+                if (!rejected && resumable && save_progress()) {
+                    log_error("Upload incomplete (" + error + "), resumable from byte " + std::to_string(journal.committed()) +
+                              ": " + packet.filename, clientAddr);
+                } else {
+                    file.close();
+                    mapped.reset();
+                    std::filesystem::remove(staging, ec);
+                    std::filesystem::remove(staging + ".journal", ec);
+                    log_error("Upload " + std::string(rejected ? "rejected" : "incomplete") + " (" + error + "), discarded: " +
+                              packet.filename, clientAddr);
+                }
+                release_upload(staging);
+                break;
+            }
+            schedule_delta_encoding(packet.filename);
+            std::filesystem::remove(staging + ".journal", ec);
+            release_upload(staging);
+            break;
+        }
+        case APPEND: { // Append Request
+            NameTurn turn(packet.filename); // Applied one at a time, each on top of the version the previous one made
+            receive_append(sessionfd, clientAddr, packet, key, iv, requestRxUs);
+            break;
+        }
+        case HASHQ: { // Hash Query: Merkle leaves starting at chunk packet.blockNumber
+            std::shared_lock<std::shared_mutex> storageLock(storage_mutex);
+            std::string filePath = resolve_stored_path(packet.filename);
+            std::vector<Hash> leaves;
+            if (!load_merkle_tree(filePath, leaves)) {
+                send_error_packet(sessionfd, clientAddr, ERR_FILE_NOT_FOUND, "File not found.");
+                log_error("Hash query for missing file: " + filePath, clientAddr);
+                break;
+            }
+
+            size_t first = static_cast<size_t>(std::min<uint64_t>(packet.blockNumber, leaves.size()));
+            size_t count = std::min(leaves.size() - first, sizeof(packet.data) / HASH_SIZE);
+            Packet reply = {ACK, {}, {}, 0, static_cast<uint32_t>(count * HASH_SIZE), packet.blockNumber, 0, leaves.size()};
+            for (size_t i = 0; i < count; ++i) {
+                std::memcpy(reply.data + i * HASH_SIZE, leaves[first + i].data(), HASH_SIZE);
+            }
+            reply.processingUs = static_cast<uint32_t>(std::max<int64_t>(0, now_us() - requestRxUs));
+            send_reply(sessionfd, clientAddr, reply, true);
+            break;
+        }
+        case COPY: { // Copy Request: data holds the destination name
+            std::shared_lock<std::shared_mutex> storageLock(storage_mutex);
+            std::string source = resolve_stored_path(packet.filename);
+            std::string destination(reinterpret_cast<const char*>(packet.data), std::min<size_t>(packet.dataSize, sizeof(packet.data)));
+            destination = destination.c_str();
+            std::error_code ec;
+            if (!is_safe_name(destination)) {
+                send_error_packet(sessionfd, clientAddr, ERR_ACCESS_VIOLATION, "Invalid destination name.");
+                log_error("Copy to invalid name rejected: " + destination, clientAddr);
+                break;
+            }
+            if (!std::filesystem::is_regular_file(source, ec)) {
+                send_error_packet(sessionfd, clientAddr, ERR_FILE_NOT_FOUND, "File not found.");
+                log_error("Copy of missing file: " + source, clientAddr);
+                break;
+            }
+
+            std::string target = next_version_path(destination);
+            if (!share_stored_data(source, target, false)) {
+                send_error_packet(sessionfd, clientAddr, error_code_from_errno(errno), "Failed to copy file.");
+                log_error("Failed to copy " + source + " to " + target, clientAddr);
+                release_version(target);
+                break;
+            }
+            publish_version(target);
+            acknowledge_with_name(sessionfd, clientAddr, target, requestRxUs);
+            schedule_delta_encoding(destination);
+            break;
+        }
+        case RENAME: { // Rename Request: data holds the new name
+            std::string destination(reinterpret_cast<const char*>(packet.data), std::min<size_t>(packet.dataSize, sizeof(packet.data)));
+            destination = destination.c_str();
+            if (!is_safe_name(destination)) {
+                send_error_packet(sessionfd, clientAddr, ERR_ACCESS_VIOLATION, "Invalid destination name.");
+                log_error("Rename to invalid name rejected: " + destination, clientAddr);
+                break;
+            }
+
+            // A logical name renames all of its versions; an exact stored name renames just that file.
+            std::string logical, version;
+            if (!split_versioned_name(packet.filename, logical, version)) {
+                logical = packet.filename;
+            }
+            NameTurn turn(logical); // Not between the steps of an APPEND
+            std::unique_lock<std::shared_mutex> storageLock(storage_mutex);
+            std::vector<std::string> sources = list_versions(packet.filename);
+            std::string literal = file_store.path(packet.filename);
+            std::error_code ec;
+            if (stored_version_exists(literal)) {
+                sources = {literal};
+            }
+            if (sources.empty()) {
+                send_error_packet(sessionfd, clientAddr, ERR_FILE_NOT_FOUND, "File not found.");
+                log_error("Rename of missing file: " + literal, clientAddr);
+                break;
+            }
+            if (!list_versions(destination).empty() || stored_version_exists(file_store.path(destination))) {
+                send_error_packet(sessionfd, clientAddr, ERR_FILE_EXISTS, "Destination already exists.");
+                log_error("Rename onto existing name rejected: " + destination, clientAddr);
+                break;
+            }
+
+            // The plan is journaled first and the index changes as one record last, so a crash
+            // midway is rolled forward on restart and no name is left with part of the versions.
+            std::vector<std::pair<std::string, std::string>> moves;
+            for (const std::string& source : sources) {
+                std::string name, version;
+                std::string storedName = std::filesystem::path(source).filename().string();
+                std::string renamedName = destination;
+                if (sources.size() > 1 || split_versioned_name(storedName, name, version)) {
+                    renamedName += storedName.substr(storedName.rfind("_v"));
                 }
-                file.write(reinterpret_cast<const char*>(decrypted.data()), decrypted.size());
+                moves.emplace_back(storedName, renamedName);
             }
-            file.close();
+            if (!save_rename_journal(moves)) {
+                send_error_packet(sessionfd, clientAddr, error_code_from_errno(errno), "Failed to rename file.");
+                log_error("Could not journal the rename of " + std::string(packet.filename) + ": " + std::strerror(errno), clientAddr);
+                break;
+            }
+            size_t moved = 0;
+            while (moved < moves.size() && move_stored_version(moves[moved].first, moves[moved].second)) {
+                ++moved;
+            }
+            if (moved < moves.size()) {
+                int code = error_code_from_errno(errno);
+                while (moved > 0) { // Roll back: the versions stay together under the old name
+                    --moved;
+                    move_stored_version(moves[moved].second, moves[moved].first);
+                }
+                std::remove((storage_roots.list().front() + RENAME_JOURNAL).c_str());
+                send_error_packet(sessionfd, clientAddr, code, "Failed to rename file.");
+                log_error("Failed to rename " + std::string(packet.filename) + " to " + destination, clientAddr);
+                break;
+            }
+            index_renamed_versions(moves);
+            check_index_logged(store_index.sync());
+            std::remove((storage_roots.list().front() + RENAME_JOURNAL).c_str());
+            std::string renamed = file_store.path(moves.back().second);
+            acknowledge_with_name(sessionfd, clientAddr, renamed, requestRxUs);
+            break;
+        }
+        case RESTORE: { // Restore Request: data holds the version suffix to restore
+            std::string version(reinterpret_cast<const char*>(packet.data), std::min<size_t>(packet.dataSize, sizeof(packet.data)));
+            version = version.c_str();
+            std::shared_lock<std::shared_mutex> storageLock(storage_mutex);
+            std::string source = file_store.path(std::string(packet.filename) + "_v" + version);
+            std::error_code ec;
+            if (is_safe_name(version)) {
+                source = readable_version_path(source);
+            }
+            if (!is_safe_name(version) || !std::filesystem::is_regular_file(source, ec)) {
+                send_error_packet(sessionfd, clientAddr, ERR_FILE_NOT_FOUND, "Version not found.");
+                log_error("Restore of missing version: " + source, clientAddr);
+                break;
+            }
+
+            // Versions are immutable, so the restored version can share a plain version's data.
+            // A reconstruction in VERSION_CACHE_DIR is copied instead: the cache may evict or rebuild it.
+            std::string target = next_version_path(packet.filename);
+            bool cached = source.compare(0, VERSION_CACHE_DIR.size(), VERSION_CACHE_DIR) == 0;
+            if (!share_stored_data(source, target, !cached)) {
+                send_error_packet(sessionfd, clientAddr, error_code_from_errno(errno), "Failed to restore version.");
+                log_error("Failed to restore " + source, clientAddr);
+                release_version(target);
+                break;
+            }
+            publish_version(target);
+            acknowledge_with_name(sessionfd, clientAddr, target, requestRxUs);
+            schedule_delta_encoding(packet.filename);
             break;
         }
         case DEL: { // Delete Request
-            std::string filePath = SERVER_STORAGE_DIR + packet.filename;
-            if (remove(filePath.c_str()) != 0) {
-                const char* error = "Error: Failed to delete file.";
-                sendto(sockfd, error, strlen(error), 0, (struct sockaddr*)&clientAddr, clientLen);
+            std::unique_lock<std::shared_mutex> storageLock(storage_mutex);
+            std::string filePath = file_store.path(packet.filename);
+            if (!remove_stored_version(filePath)) {
+                send_error_packet(sessionfd, clientAddr, error_code_from_errno(errno), "Failed to delete file.");
                 log_error("Failed to delete file: " + filePath, clientAddr);
             } else {
-                const char* success = "Success: File deleted.";
-                sendto(sockfd, success, strlen(success), 0, (struct sockaddr*)&clientAddr, clientLen);
+                forget_content(filePath);
+                remove_version(filePath);
+                check_index_logged(store_index.sync());
+                std::remove(merkle_sidecar_path(filePath).c_str());
+                std::string name, version;
+                if (split_versioned_name(packet.filename, name, version)) {
+                    schedule_delta_encoding(name); // Versions made plain for the deletion may be re-encoded
+                }
+                Packet reply = {ACK, {}, {}, 0, 0};
+                reply.processingUs = static_cast<uint32_t>(std::max<int64_t>(0, now_us() - requestRxUs));
+                send_reply(sessionfd, clientAddr, reply, true);
             }
             break;
         }
         default: {
-            const char* error = "Error: Unknown operation.";
-            sendto(sockfd, error, strlen(error), 0, (struct sockaddr*)&clientAddr, clientLen);
+            send_error_packet(sessionfd, clientAddr, ERR_ILLEGAL_OPERATION, "Unknown operation.");
             log_error("Unknown operation ID: " + std::to_string(packet.operationID), clientAddr);
             break;
         }
     }
+
+    end_session(sessionfd);
+    CLOSE_SOCKET(sessionfd);
 }
 
 /**
  * @brief Starts the UDP server to listen for client requests.
  * @param port The port number to listen on.
+ * @param reindex Rebuild the persistent index by scanning the store.
  */
-void start_server(int port) {
+void start_server(int port, bool reindex) {
     validate_directories();
+    size_t resumable = sweep_staged_uploads();
+    if (resumable > 0) {
+        std::cout << resumable << " interrupted uploads can be resumed." << std::endl;
+    }
+    std::vector<std::pair<const StorageLayout*, std::string>> stale;
+    for (const std::string& name : load_indexes(reindex, stale)) {
+        schedule_delta_encoding(name); // Versions an earlier run may have left plain
+    }
+    finish_interrupted_rename();
+    finish_interrupted_appends();
+    std::thread(run_maintenance).detach();
+    std::thread(watch_store, stale).detach();
 
 #ifdef _WIN32
     WSADATA wsaData;
@@ -165,23 +3362,73 @@ void start_server(int port) {
         return;
     }
 
+    size_t listenBuffer = size_socket_buffers(sockfd, LISTEN_SOCKET_BUFFER);
+    if (listenBuffer < LISTEN_SOCKET_BUFFER) {
+        log_error("Listening socket buffers capped at " + std::to_string(listenBuffer) + " of " +
+                  std::to_string(LISTEN_SOCKET_BUFFER) + " bytes; bursts of requests may be dropped.");
+    }
+    enable_drop_monitoring(sockfd);
+    enable_timestamping(sockfd, false);
+    TransferStats listenStats;
+    uint32_t reportedDrops = 0;
+    auto nextKeySweep = std::chrono::steady_clock::now(); // client_keys is swept at most this often
+
     std::cout << "Server listening on port " << port << std::endl;
 
     while (true) {
-        Packet packet;
+        uint8_t wire[WIRE_PACKET_SIZE];
         sockaddr_in clientAddr;
-        socklen_t clientLen = sizeof(clientAddr);
 
-        // Generate AES key and IV
-        std::string key(32, '\0'), iv(16, '\0');
-        RAND_bytes(reinterpret_cast<uint8_t*>(&key[0]), key.size());
-        RAND_bytes(reinterpret_cast<uint8_t*>(&iv[0]), iv.size());
+        int64_t receivedUs = 0;
+        ssize_t received = receive_datagram(sockfd, wire, sizeof(wire), &clientAddr, &listenStats, &receivedUs);
+        if (received <= 0) {
+            continue;
+        }
+        if (listenStats.kernelDrops != reportedDrops) {
+            log_error("Listening socket dropped " + std::to_string(listenStats.kernelDrops - reportedDrops) +
+                      " requests (receive buffer full).", clientAddr);
+            reportedDrops = listenStats.kernelDrops;
+        }
+
+        std::string clientId = std::string(inet_ntoa(clientAddr.sin_addr)) + ":" + std::to_string(ntohs(clientAddr.sin_port));
+        auto now = std::chrono::steady_clock::now();
+        std::lock_guard<std::mutex> lock(client_mutex);
+        if (now >= nextKeySweep) {
+            for (auto it = client_keys.begin(); it != client_keys.end();) {
+                it = now >= it->second.expires ? client_keys.erase(it) : std::next(it);
+            }
+            nextKeySweep = now + KEY_ANNOUNCEMENT_MEMORY;
+        }
+
+        // The client announces its AES key and IV as two bare datagrams before any request.
+        if (received == AES_KEY_SIZE || received == AES_IV_SIZE) {
+            ClientKeys& keys = client_keys[clientId];
+            (received == AES_KEY_SIZE ? keys.key : keys.iv).assign(reinterpret_cast<const char*>(wire), static_cast<size_t>(received));
+            keys.expires = std::max(keys.expires, now + KEY_ANNOUNCEMENT_MEMORY);
+            continue;
+        }
+        Packet packet;
+        if (!decode_packet(wire, received, packet)) {
+            log_error("Malformed request of " + std::to_string(received) + " bytes ignored.", clientAddr);
+            continue;
+        }
 
-        ssize_t received = recvfrom(sockfd, (char*)&packet, sizeof(Packet), 0, (struct sockaddr*)&clientAddr, &clientLen);
-        if (received > 0) {
-            std::lock_guard<std::mutex> lock(client_mutex);
-            std::thread(handle_client, sockfd, clientAddr, packet, key, iv).detach();
+        // Generate AES key and IV for clients that did not announce one
+        ClientKeys& keys = client_keys[clientId];
+        keys.expires = now + CLIENT_KEY_MEMORY;
+        if (keys.key.empty()) {
+            keys.key.assign(AES_KEY_SIZE, '\0');
+            RAND_bytes(reinterpret_cast<uint8_t*>(&keys.key[0]), keys.key.size());
+        }
+        if (keys.iv.empty()) {
+            keys.iv.assign(AES_IV_SIZE, '\0');
+            RAND_bytes(reinterpret_cast<uint8_t*>(&keys.iv[0]), keys.iv.size());
+        }
+        std::string requestKey = request_key(clientAddr, wire, static_cast<size_t>(received));
+        if (!begin_request(requestKey, sockfd, clientAddr)) {
+            continue; // Retransmission of a request being served or just answered
         }
+        std::thread(handle_client, clientAddr, packet, keys.key, keys.iv, receivedUs, requestKey).detach();
     }
 
     CLOSE_SOCKET(sockfd);
@@ -192,9 +3439,37 @@ void start_server(int port) {
 
 /**
  * @brief Main entry point of the server application.
+ * @details Usage: `server [--root DIR]... [--migrate] [--reindex]`. Every `--root` adds a
+ * storage root (typically one per drive; default: the working directory). `--migrate`
+ * moves a flat store into the sharded layout and exits. `--reindex` rebuilds the persistent
+ * index from the files (needed only after changing the store behind the server's back).
+ * `--buffered-uploads` writes uploads of known size through a stream instead of a memory map.
  */
-int main() {
+int main(int argc, char* argv[]) {
+    std::vector<std::string> roots;
+    bool migrate = false, reindex = false;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--root" && i + 1 < argc) {
+            std::string root = argv[++i];
+            roots.push_back(root.back() == '/' ? root : root + "/");
+        } else if (arg == "--migrate") {
+            migrate = true;
+        } else if (arg == "--reindex") {
+            reindex = true;
+        } else if (arg == "--buffered-uploads") {
+            mapped_uploads = false;
+        } else {
+            std::cerr << "Usage: " << argv[0] << " [--root DIR]... [--migrate] [--reindex] [--buffered-uploads]" << std::endl;
+            return 1;
+        }
+    }
+    storage_roots.assign(roots.empty() ? std::vector<std::string>{"./"} : roots);
+    if (migrate) {
+        return migrate_flat_store();
+    }
+
     int port = 12345;
-    start_server(port);
+    start_server(port, reindex);
     return 0;
 }
@@ -0,0 +1,598 @@
+/**
+ * @file storage.cpp
+ * @brief Storage roots and the on-disk layout of the server's storage directories
+ */
+
+#include "storage.hpp"
+#include <filesystem>
+#include <algorithm>
+#include <cstdio>
+#include <system_error>
+
+/**
+ * @brief Computes the 32-bit FNV-1a hash of a string.
+ * @details Stable across runs and platforms, unlike std::hash, and cheap enough to
+ * compute on every lookup.
+ *
+ * @param text The string to hash.
+ * @param hash The starting value (to chain several strings).
+ * @return uint32_t The hash.
+ */
+static uint32_t fnv1a(const std::string& text, uint32_t hash = 2166136261u) {
+    for (unsigned char c : text) {
+        hash = (hash ^ c) * 16777619u;
+    }
+    return hash;
+}
+
+/**
+ * @brief Recognizes names of files that are being written or belong to another tool.
+ * @details Dotfiles, editor backups ("name~", "#name#"), temporary files (".tmp", also with
+ * the thread suffix the server appends), partial downloads and journals, and the suffixes
+ * of the server's own sidecar, delta and cold files are never stored names.
+ *
+ * @param name The entry name without the layout's extension.
+ * @return True if the name must not be adopted as a stored file.
+ */
+static bool is_temporary_name(const std::string& name) {
+    static const char* const suffixes[] = {".part", ".swp", ".swx", ".crdownload", ".journal", ".merkle", ".rdelta", ".zst"};
+    if (name.empty() || name.front() == '.' || name.back() == '~' || (name.size() > 1 && name.front() == '#' && name.back() == '#')) {
+        return true;
+    }
+    size_t tmp = name.rfind(".tmp");
+    if (tmp != std::string::npos && name.find_first_not_of("0123456789", tmp + 4) == std::string::npos) {
+        return true;
+    }
+    for (const char* suffix : suffixes) {
+        size_t length = std::char_traits<char>::length(suffix);
+        if (name.size() >= length && name.compare(name.size() - length, length, suffix) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * @brief Strips the version suffix ("_vYYYYMMDDHHMMSS" or "_vYYYYMMDDHHMMSS-N") from a stored name.
+ *
+ * @param storedName The stored file name.
+ * @return std::string The logical name, or the stored name itself if it carries no version.
+ */
+static std::string logical_name(const std::string& storedName) {
+    size_t pos = storedName.rfind("_v");
+    if (pos == std::string::npos || storedName.size() < pos + 16) {
+        return storedName;
+    }
+    size_t digits = storedName.find_first_not_of("0123456789", pos + 2);
+    bool versioned = digits == std::string::npos ? storedName.size() == pos + 16
+                                                 : digits == pos + 16 && storedName[digits] == '-' && digits + 1 < storedName.size() &&
+                                                   storedName.find_first_not_of("0123456789", digits + 1) == std::string::npos;
+    return versioned ? storedName.substr(0, pos) : storedName;
+}
+
+/**
+ * @brief Starts the worker thread.
+ */
+IoQueue::IoQueue() : worker_(&IoQueue::run, this) {}
+
+/**
+ * @brief Stops and joins the worker thread.
+ */
+IoQueue::~IoQueue() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+        jobs_.clear();
+    }
+    ready_.notify_one();
+    worker_.join();
+}
+
+/**
+ * @brief Queues a job.
+ *
+ * @param job The job to run on the worker thread.
+ */
+void IoQueue::submit(std::function<void()> job) {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        jobs_.push_back(std::move(job));
+    }
+    ready_.notify_one();
+}
+
+/**
+ * @brief Runs queued jobs until the queue is destroyed.
+ */
+void IoQueue::run() {
+    while (true) {
+        std::function<void()> job;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            ready_.wait(lock, [this] { return stopping_ || !jobs_.empty(); });
+            if (stopping_) {
+                return;
+            }
+            job = std::move(jobs_.front());
+            jobs_.pop_front();
+        }
+        job();
+    }
+}
+
+/**
+ * @brief Starts the workers.
+ *
+ * @param threads The number of workers.
+ * @param depth The queue-depth limit.
+ */
+IoPool::IoPool(size_t threads, size_t depth) : depth_(std::max<size_t>(depth, 1)) {
+    for (size_t i = 0; i < std::max<size_t>(threads, 1); ++i) {
+        workers_.emplace_back(&IoPool::work, this);
+    }
+}
+
+/**
+ * @brief Stops and joins the workers.
+ */
+IoPool::~IoPool() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+        jobs_.clear();
+    }
+    ready_.notify_all();
+    for (std::thread& worker : workers_) {
+        worker.join();
+    }
+}
+
+/**
+ * @brief Runs a job on a worker and waits for it.
+ *
+ * @param job The job.
+ */
+void IoPool::run(const std::function<void()>& job) {
+    std::mutex doneMutex;
+    std::condition_variable doneSignal;
+    bool done = false;
+    acquire();
+    post([&] {
+        job();
+        release();
+        std::lock_guard<std::mutex> lock(doneMutex);
+        done = true;
+        doneSignal.notify_one();
+    });
+    std::unique_lock<std::mutex> lock(doneMutex);
+    doneSignal.wait(lock, [&done] { return done; });
+}
+
+/**
+ * @brief Waits for room below the depth limit and takes it.
+ */
+void IoPool::acquire() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    room_.wait(lock, [this] { return pending_ < depth_; });
+    ++pending_;
+}
+
+/**
+ * @brief Gives back the room of a finished job.
+ */
+void IoPool::release() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        --pending_;
+    }
+    room_.notify_one();
+}
+
+/**
+ * @brief Queues a job for the workers.
+ *
+ * @param job The job.
+ */
+void IoPool::post(std::function<void()> job) {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        jobs_.push_back(std::move(job));
+    }
+    ready_.notify_one();
+}
+
+/**
+ * @brief Runs queued jobs until the pool is destroyed.
+ */
+void IoPool::work() {
+    while (true) {
+        std::function<void()> job;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            ready_.wait(lock, [this] { return stopping_ || !jobs_.empty(); });
+            if (stopping_) {
+                return;
+            }
+            job = std::move(jobs_.front());
+            jobs_.pop_front();
+        }
+        job();
+    }
+}
+
+/**
+ * @brief Queues a job after the strand's earlier ones.
+ * @details Waits first for room in the pool, so the depth limit covers queued strand jobs.
+ *
+ * @param job The job.
+ */
+void IoStrand::submit(std::function<void()> job) {
+    pool_.acquire();
+    bool schedule = false;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        jobs_.push_back(std::move(job));
+        schedule = !scheduled_;
+        scheduled_ = true;
+    }
+    if (schedule) {
+        pool_.post([this] { drain(); });
+    }
+}
+
+/**
+ * @brief Waits until every submitted job has run.
+ */
+void IoStrand::wait() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    idle_.wait(lock, [this] { return !scheduled_; });
+}
+
+/**
+ * @brief Runs up to IO_STRAND_BATCH jobs, then queues itself again behind other work if more are left.
+ */
+void IoStrand::drain() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    for (size_t ran = 0; ran < IO_STRAND_BATCH && !jobs_.empty(); ++ran) {
+        std::function<void()> job = std::move(jobs_.front());
+        jobs_.pop_front();
+        lock.unlock();
+        job();
+        pool_.release();
+        lock.lock();
+    }
+    if (!jobs_.empty()) {
+        lock.unlock();
+        pool_.post([this] { drain(); });
+        return;
+    }
+    scheduled_ = false;
+    idle_.notify_all();
+}
+
+/**
+ * @brief Sets the roots and starts one I/O queue and one I/O pool per root.
+ *
+ * @param roots The root directories, each with a trailing slash.
+ */
+void StorageRoots::assign(std::vector<std::string> roots) {
+    roots_ = std::move(roots);
+    space_.assign(roots_.size(), SpaceCheck());
+    queues_.clear();
+    pools_.clear();
+    for (size_t i = 0; i < roots_.size(); ++i) {
+        queues_.push_back(std::make_unique<IoQueue>());
+        pools_.push_back(std::make_unique<IoPool>());
+    }
+}
+
+/**
+ * @brief Orders the roots by rendezvous hash of the logical name of a stored name.
+ * @details Every version of a name gets the same order, so versions land on one root.
+ *
+ * @param storedName The stored file name.
+ * @return std::vector<size_t> Root indexes, most preferred first.
+ */
+std::vector<size_t> StorageRoots::placement_order(const std::string& storedName) const {
+    std::string name = logical_name(storedName);
+    std::vector<size_t> order(roots_.size());
+    std::vector<uint32_t> weight(roots_.size());
+    for (size_t i = 0; i < roots_.size(); ++i) {
+        order[i] = i;
+        weight[i] = fnv1a(name, fnv1a(roots_[i] + '\0'));
+    }
+    std::sort(order.begin(), order.end(), [&weight](size_t a, size_t b) { return weight[a] > weight[b]; });
+    return order;
+}
+
+/**
+ * @brief Checks whether a root may take new files.
+ *
+ * @param root The root index.
+ * @return True if it has at least STORAGE_RESERVE bytes available.
+ */
+bool StorageRoots::has_free_space(size_t root) const {
+    auto now = std::chrono::steady_clock::now();
+    {
+        std::lock_guard<std::mutex> lock(spaceMutex_);
+        if (root < space_.size() && space_[root].at != std::chrono::steady_clock::time_point() &&
+            now - space_[root].at < FREE_SPACE_CHECK_INTERVAL) {
+            return space_[root].enough;
+        }
+    }
+    std::error_code ec;
+    std::filesystem::space_info space = std::filesystem::space(roots_[root], ec);
+    bool enough = !ec && space.available >= STORAGE_RESERVE;
+    std::lock_guard<std::mutex> lock(spaceMutex_);
+    if (root < space_.size()) {
+        space_[root] = {now, enough};
+    }
+    return enough;
+}
+
+/**
+ * @brief Finds the root holding a path.
+ *
+ * @param path A path inside one of the roots.
+ * @return size_t The index of the longest root that prefixes the path, 0 if none does.
+ */
+size_t StorageRoots::root_of(const std::string& path) const {
+    size_t best = 0, bestLength = 0;
+    for (size_t i = 0; i < roots_.size(); ++i) {
+        if (roots_[i].size() > bestLength && path.compare(0, roots_[i].size(), roots_[i]) == 0) {
+            best = i;
+            bestLength = roots_[i].size();
+        }
+    }
+    return best;
+}
+
+/**
+ * @brief Runs a job on the I/O queue of a root.
+ *
+ * @param root The root index.
+ * @param job The job.
+ */
+void StorageRoots::submit(size_t root, std::function<void()> job) {
+    if (queues_.empty()) {
+        job(); // assign() was never called: no workers
+        return;
+    }
+    queues_[root % queues_.size()]->submit(std::move(job));
+}
+
+/**
+ * @brief Returns the pool doing transfer I/O on the root holding a path.
+ *
+ * @param path A path inside one of the roots.
+ * @return IoPool& The pool.
+ */
+IoPool& StorageRoots::io_pool(const std::string& path) {
+    if (pools_.empty()) {
+        static IoPool fallback; // assign() was never called
+        return fallback;
+    }
+    return *pools_[root_of(path) % pools_.size()];
+}
+
+/**
+ * @brief Describes a storage directory present in every root.
+ *
+ * @param roots The storage roots.
+ * @param directory The directory inside each root, with a trailing slash.
+ * @param extension Appended to every stored name, empty for none.
+ */
+StorageLayout::StorageLayout(const StorageRoots& roots, std::string directory, std::string extension)
+    : roots_(roots), directory_(std::move(directory)), extension_(std::move(extension)) {}
+
+/**
+ * @brief Returns the shard directory name of a stored name.
+ *
+ * @param storedName The stored file name.
+ * @return std::string Two lowercase hex digits.
+ */
+std::string StorageLayout::shard_of(const std::string& storedName) {
+    uint32_t hash = fnv1a(storedName);
+    char shard[3];
+    std::snprintf(shard, sizeof(shard), "%02x", static_cast<unsigned>((hash ^ (hash >> 8) ^ (hash >> 16) ^ (hash >> 24)) % STORAGE_SHARDS));
+    return shard;
+}
+
+/**
+ * @brief Returns the path of a stored name in a given root.
+ *
+ * @param root The root index.
+ * @param storedName The stored file name.
+ * @return std::string The sharded path.
+ */
+std::string StorageLayout::path_in(size_t root, const std::string& storedName) const {
+    return roots_.list()[root] + directory_ + shard_of(storedName) + "/" + storedName + extension_;
+}
+
+/**
+ * @brief Returns the path of a stored name.
+ *
+ * @param storedName The stored file name.
+ * @return std::string The path of the existing file, or where a new one should go.
+ */
+std::string StorageLayout::path(const std::string& storedName) const {
+    if (roots_.list().size() == 1) {
+        return path_in(0, storedName);
+    }
+    {
+        std::lock_guard<std::mutex> lock(placementMutex_);
+        auto cached = placement_.find(storedName);
+        if (cached != placement_.end()) {
+            return path_in(cached->second, storedName);
+        }
+    }
+
+    std::vector<size_t> order = roots_.placement_order(storedName);
+    size_t chosen = order.front(); // Every root is full; let the write fail there
+    bool found = false;
+    std::error_code ec;
+    for (size_t root : order) {
+        if (std::filesystem::exists(path_in(root, storedName), ec)) {
+            chosen = root;
+            found = true;
+            break;
+        }
+    }
+    for (size_t i = 0; !found && i < order.size(); ++i) {
+        if (roots_.has_free_space(order[i])) {
+            chosen = order[i];
+            found = true;
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(placementMutex_);
+    if (placement_.size() >= PLACEMENT_CACHE_SIZE) {
+        placement_.clear();
+    }
+    placement_[storedName] = chosen;
+    return path_in(chosen, storedName);
+}
+
+/**
+ * @brief Forgets the remembered root of a stored name.
+ *
+ * @param storedName The stored file name.
+ */
+void StorageLayout::forget(const std::string& storedName) const {
+    std::lock_guard<std::mutex> lock(placementMutex_);
+    placement_.erase(storedName);
+}
+
+/**
+ * @brief Extracts the stored name from the name of an entry in a shard.
+ *
+ * @param fileName The entry name.
+ * @param storedName Receives the stored name.
+ * @return True if the entry carries the extension and is not a temporary or foreign file.
+ */
+bool StorageLayout::stored_name(const std::string& fileName, std::string& storedName) const {
+    if (fileName.size() <= extension_.size() ||
+        fileName.compare(fileName.size() - extension_.size(), extension_.size(), extension_) != 0) {
+        return false;
+    }
+    storedName = fileName.substr(0, fileName.size() - extension_.size());
+    return !is_temporary_name(storedName);
+}
+
+/**
+ * @brief Lists the shard directories of every root.
+ *
+ * @return std::vector<std::string> The directory paths, without trailing slash.
+ */
+std::vector<std::string> StorageLayout::shard_directories() const {
+    std::vector<std::string> directories;
+    for (const std::string& root : roots_.list()) {
+        for (size_t shard = 0; shard < STORAGE_SHARDS; ++shard) {
+            char name[3];
+            std::snprintf(name, sizeof(name), "%02x", static_cast<unsigned>(shard));
+            directories.push_back(root + directory_ + name);
+        }
+    }
+    return directories;
+}
+
+/**
+ * @brief Creates the directory and all shard directories in every root.
+ *
+ * @return True on success.
+ */
+bool StorageLayout::create() const {
+    std::error_code ec;
+    for (const std::string& directory : shard_directories()) {
+        std::filesystem::create_directories(directory, ec);
+        if (ec) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief Visits every stored name in the shards of every root.
+ *
+ * @param visit The callback.
+ */
+void StorageLayout::for_each(const std::function<void(const std::string& storedName)>& visit) const {
+    std::error_code ec;
+    for (const std::string& root : roots_.list()) {
+        for (const auto& shard : std::filesystem::directory_iterator(root + directory_, ec)) {
+            if (!shard.is_directory(ec)) {
+                continue;
+            }
+            for (const auto& entry : std::filesystem::directory_iterator(shard.path(), ec)) {
+                std::string storedName;
+                if (entry.is_regular_file(ec) && stored_name(entry.path().filename().string(), storedName)) {
+                    visit(storedName);
+                }
+            }
+        }
+    }
+}
+
+/**
+ * @brief Counts entries lying directly in the directory of every root.
+ *
+ * @return size_t The number of regular files outside the shards.
+ */
+size_t StorageLayout::count_flat() const {
+    size_t count = 0;
+    std::error_code ec;
+    for (const std::string& root : roots_.list()) {
+        for (const auto& entry : std::filesystem::directory_iterator(root + directory_, ec)) {
+            if (entry.is_regular_file(ec)) {
+                ++count;
+            }
+        }
+    }
+    return count;
+}
+
+/**
+ * @brief Moves every entry lying directly in the directory into its shard.
+ * @details Files stay on the root they are on: moving between drives is a copy, and
+ * lookups probe every root anyway.
+ *
+ * @param moved Receives the number of entries moved.
+ * @return True if every entry was moved.
+ */
+bool StorageLayout::migrate_flat(size_t& moved) const {
+    moved = 0;
+    if (!create()) {
+        return false;
+    }
+
+    bool complete = true;
+    for (const std::string& root : roots_.list()) {
+        // List first: renaming entries out of a directory while iterating it is unspecified.
+        std::string directory = root + directory_;
+        std::vector<std::string> names;
+        std::error_code ec;
+        for (const auto& entry : std::filesystem::directory_iterator(directory, ec)) {
+            if (entry.is_regular_file(ec)) {
+                names.push_back(entry.path().filename().string());
+            }
+        }
+        complete = complete && !ec;
+
+        for (const std::string& name : names) {
+            std::string storedName = name;
+            if (!extension_.empty() && name.size() > extension_.size() &&
+                name.compare(name.size() - extension_.size(), extension_.size(), extension_) == 0) {
+                storedName = name.substr(0, name.size() - extension_.size());
+            }
+            std::error_code moveError;
+            std::filesystem::rename(directory + name, directory + shard_of(storedName) + "/" + name, moveError);
+            if (moveError) {
+                complete = false;
+            } else {
+                ++moved;
+            }
+        }
+    }
+    return complete;
+}
@@ -0,0 +1,339 @@
+/**
+ * @file storage.hpp
+ * @brief Storage roots and the on-disk layout of the server's storage directories
+ */
+
+#ifndef STORAGE_HPP
+#define STORAGE_HPP
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <unordered_map>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+/// Number of hash-prefix subdirectories in every storage directory.
+constexpr size_t STORAGE_SHARDS = 256;
+
+/// New files skip a storage root with less free space than this.
+constexpr uint64_t STORAGE_RESERVE = 1024ull * 1024 * 1024;
+
+/// How long a root's free-space check is reused before the filesystem is asked again.
+constexpr std::chrono::seconds FREE_SPACE_CHECK_INTERVAL(1);
+
+/// Stored names whose root each storage layout remembers; the cache is dropped when full.
+constexpr size_t PLACEMENT_CACHE_SIZE = 1 << 16;
+
+/// Threads doing the file I/O of transfers on each storage root.
+constexpr size_t IO_THREADS_PER_ROOT = 4;
+
+/// Transfer I/O jobs that may be queued or running on each storage root.
+constexpr size_t IO_QUEUE_DEPTH = 64;
+
+/// Jobs of one IoStrand run per turn before other sessions get a worker.
+constexpr size_t IO_STRAND_BATCH = 16;
+
+/**
+ * @class IoQueue
+ * @brief A worker thread that runs queued jobs in order.
+ * @details Each storage root gets one, so background I/O on one drive never waits
+ * behind work on another.
+ */
+class IoQueue {
+public:
+    IoQueue();
+
+    /// Finishes the running job, drops the rest and joins the worker.
+    ~IoQueue();
+
+    IoQueue(const IoQueue&) = delete;
+    IoQueue& operator=(const IoQueue&) = delete;
+
+    /**
+     * @brief Queues a job.
+     * @param job The job to run on the worker thread.
+     */
+    void submit(std::function<void()> job);
+
+private:
+    /// Worker loop.
+    void run();
+
+    std::mutex mutex_;
+    std::condition_variable ready_;
+    std::deque<std::function<void()>> jobs_;
+    bool stopping_ = false;
+    std::thread worker_;
+};
+
+/**
+ * @class IoPool
+ * @brief Worker threads that do the file I/O of transfers on one storage root.
+ * @details Sessions hand their reads and writes to the pool of the root they touch, so
+ * the threads that process ACKs never wait for a disk, and a slow drive delays only its
+ * own jobs. At most `depth` jobs are queued or running; submitting more waits for room,
+ * which slows the senders down instead of buffering without bound.
+ */
+class IoPool {
+public:
+    /**
+     * @brief Starts the workers.
+     * @param threads The number of workers.
+     * @param depth The queue-depth limit.
+     */
+    explicit IoPool(size_t threads = IO_THREADS_PER_ROOT, size_t depth = IO_QUEUE_DEPTH);
+
+    /// Finishes the running jobs, drops the rest and joins the workers.
+    ~IoPool();
+
+    IoPool(const IoPool&) = delete;
+    IoPool& operator=(const IoPool&) = delete;
+
+    /**
+     * @brief Runs a job on a worker and waits for it.
+     * @param job The job.
+     */
+    void run(const std::function<void()>& job);
+
+private:
+    friend class IoStrand;
+
+    /// Waits until fewer than `depth` jobs are queued or running, then counts one more.
+    void acquire();
+
+    /// Counts a job as finished.
+    void release();
+
+    /// Queues a job without counting it against the depth (IoStrand counts its own).
+    void post(std::function<void()> job);
+
+    /// Worker loop.
+    void work();
+
+    std::mutex mutex_;
+    std::condition_variable ready_; ///< Workers wait for jobs
+    std::condition_variable room_;  ///< Submitters wait for the depth to drop
+    std::deque<std::function<void()>> jobs_;
+    size_t depth_;
+    size_t pending_ = 0; ///< Jobs counted against the depth
+    bool stopping_ = false;
+    std::vector<std::thread> workers_;
+};
+
+/**
+ * @class IoStrand
+ * @brief Runs one session's jobs on an IoPool, one at a time in the order they were submitted.
+ * @details Every job counts against the pool's depth until it has run. A strand gives its
+ * worker up after IO_STRAND_BATCH jobs, so a busy session cannot hold one for good.
+ */
+class IoStrand {
+public:
+    /// @param pool The pool to run on.
+    explicit IoStrand(IoPool& pool) : pool_(pool) {}
+
+    /// Waits for the submitted jobs.
+    ~IoStrand() { wait(); }
+
+    IoStrand(const IoStrand&) = delete;
+    IoStrand& operator=(const IoStrand&) = delete;
+
+    /**
+     * @brief Queues a job after the strand's earlier ones; waits while the pool is full.
+     * @param job The job.
+     */
+    void submit(std::function<void()> job);
+
+    /// Waits until every submitted job has run.
+    void wait();
+
+private:
+    /// Runs queued jobs on a pool worker.
+    void drain();
+
+    IoPool& pool_;
+    std::mutex mutex_;
+    std::condition_variable idle_;
+    std::deque<std::function<void()>> jobs_;
+    bool scheduled_ = false; ///< A drain is queued or running
+};
+
+/**
+ * @class StorageRoots
+ * @brief The directories (typically one per drive) that hold the store.
+ * @details Files are placed by rendezvous (highest random weight) hashing of their logical
+ * name (the stored name without its version suffix) over the roots: every name has a stable
+ * preference order of roots, all versions of a name prefer the same root (so they can share
+ * data through hard links and reflinks), and adding a root only moves the names that now
+ * prefer it. A root below STORAGE_RESERVE of free space is skipped for new files; the check
+ * is repeated at most every FREE_SPACE_CHECK_INTERVAL. Lookups probe the roots in preference
+ * order, so files stay reachable after roots are added or a file spilled over.
+ */
+class StorageRoots {
+public:
+    /**
+     * @brief Sets the roots and starts one I/O queue and one I/O pool per root. Call once, before any lookup.
+     * @param roots The root directories, each with a trailing slash.
+     */
+    void assign(std::vector<std::string> roots);
+
+    /// @return The root directories.
+    const std::vector<std::string>& list() const { return roots_; }
+
+    /**
+     * @brief Orders the roots by preference for a stored name.
+     * @param storedName The stored file name; only its logical name counts.
+     * @return Root indexes, most preferred first.
+     */
+    std::vector<size_t> placement_order(const std::string& storedName) const;
+
+    /**
+     * @brief Checks whether a root may take new files.
+     * @param root The root index.
+     * @return True if it has at least STORAGE_RESERVE bytes available.
+     */
+    bool has_free_space(size_t root) const;
+
+    /**
+     * @brief Finds the root holding a path.
+     * @param path A path inside one of the roots.
+     * @return The root index (the longest matching root; 0 if none matches).
+     */
+    size_t root_of(const std::string& path) const;
+
+    /**
+     * @brief Runs a job on the I/O queue of a root.
+     * @param root The root index.
+     * @param job The job.
+     */
+    void submit(size_t root, std::function<void()> job);
+
+    /**
+     * @brief Returns the pool doing transfer I/O on the root holding a path.
+     * @param path A path inside one of the roots.
+     * @return The pool.
+     */
+    IoPool& io_pool(const std::string& path);
+
+private:
+    std::vector<std::string> roots_ = {"./"};
+    std::vector<std::unique_ptr<IoQueue>> queues_;
+    std::vector<std::unique_ptr<IoPool>> pools_;
+
+    /// Last free-space check of a root.
+    struct SpaceCheck {
+        std::chrono::steady_clock::time_point at;
+        bool enough = false;
+    };
+    mutable std::mutex spaceMutex_;
+    mutable std::vector<SpaceCheck> space_; ///< Per root; empty entries are checked on first use
+};
+
+/**
+ * @class StorageLayout
+ * @brief Maps stored file names to paths in a storage directory fanned out by hash prefix.
+ * @details "report.txt_v20241119124624" is kept as "<root><directory>3f/report.txt_v20241119124624<extension>",
+ * where "3f" is derived from a hash of the stored name and the root is chosen by
+ * StorageRoots. Every directory then holds about 1/STORAGE_SHARDS of a root's share of
+ * the store, so create, lookup and listing stay fast on ext4/xfs with hundreds of
+ * thousands of versions.
+ */
+class StorageLayout {
+public:
+    /**
+     * @brief Describes a storage directory present in every root.
+     * @param roots The storage roots.
+     * @param directory The directory inside each root, with a trailing slash (e.g. "server_files/").
+     * @param extension Appended to every stored name (e.g. ".merkle"), empty for none.
+     */
+    StorageLayout(const StorageRoots& roots, std::string directory, std::string extension = "");
+
+    /**
+     * @brief Returns the path of a stored name; nothing is created.
+     * @details An existing file is found on whichever root holds it; otherwise the path is
+     * on the root where a new file should go. With several roots, the answer is remembered,
+     * so later lookups of the name touch no filesystem.
+     * @param storedName The stored file name (no directories).
+     * @return The sharded path.
+     */
+    std::string path(const std::string& storedName) const;
+
+    /**
+     * @brief Forgets the remembered root of a stored name, after it was changed outside the server.
+     * @param storedName The stored file name.
+     */
+    void forget(const std::string& storedName) const;
+
+    /// @return The directory inside each root.
+    const std::string& directory() const { return directory_; }
+
+    /**
+     * @brief Creates the directory and all shard directories in every root if they do not exist.
+     * @return True on success.
+     */
+    bool create() const;
+
+    /**
+     * @brief Extracts the stored name from the name of an entry in a shard.
+     * @param fileName The entry name (no directories).
+     * @param storedName Receives the stored name.
+     * @return False for entries without the extension, and for dotfiles, temporary, partial and
+     * backup files and the server's own sidecar, delta and cold suffixes.
+     */
+    bool stored_name(const std::string& fileName, std::string& storedName) const;
+
+    /// @return The paths of all shard directories in every root (no trailing slash).
+    std::vector<std::string> shard_directories() const;
+
+    /**
+     * @brief Calls `visit` with the stored name of every entry that carries the extension, in every root.
+     * @param visit The callback.
+     */
+    void for_each(const std::function<void(const std::string& storedName)>& visit) const;
+
+    /**
+     * @brief Counts entries still lying directly in the directory (a flat store from before sharding).
+     * @return The number of such entries over all roots.
+     */
+    size_t count_flat() const;
+
+    /**
+     * @brief Moves every entry lying directly in the directory into its shard (one-time migration).
+     * @details Uses rename(2) within each root, so it is cheap and each file is either moved
+     * or left in place; the migration can be interrupted and run again.
+     * @param moved Receives the number of entries moved.
+     * @return True if every entry was moved.
+     */
+    bool migrate_flat(size_t& moved) const;
+
+private:
+    /**
+     * @brief Returns the shard directory name of a stored name (two hex digits).
+     * @param storedName The stored file name.
+     * @return The shard name.
+     */
+    static std::string shard_of(const std::string& storedName);
+
+    /**
+     * @brief Returns the path of a stored name in a given root.
+     * @param root The root index.
+     * @param storedName The stored file name.
+     * @return The sharded path.
+     */
+    std::string path_in(size_t root, const std::string& storedName) const;
+
+    const StorageRoots& roots_; ///< Where the directory lives
+    std::string directory_;     ///< Directory inside each root, with trailing slash
+    std::string extension_;     ///< Suffix of every entry
+
+    mutable std::mutex placementMutex_;
+    mutable std::unordered_map<std::string, size_t> placement_; ///< Root of recently resolved stored names
+};
+
+#endif // STORAGE_HPP
@@ -0,0 +1,284 @@
+/**
+ * @file store_test.cpp
+ * @brief Checks of the server's on-disk formats: index recovery, upload journals and deltas
+ * @details Each check simulates the crash or damage it covers on files in a scratch
+ * directory and reopens them as the server would on restart. Exits with 1 if any fails.
+ */
+
+#include "udp_file_transfer.hpp"
+#include "index.hpp"
+#include "journal.hpp"
+#include <iostream>
+#include <fstream>
+#include <filesystem>
+#include <random>
+#include <iterator>
+#include <vector>
+#include <string>
+#include <set>
+
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+namespace fs = std::filesystem;
+
+static int failures = 0;
+
+/**
+ * @brief Reports a failed check.
+ */
+#define CHECK(condition)                                                                   \
+    do {                                                                                   \
+        if (!(condition)) {                                                                \
+            std::cerr << __FILE__ << ":" << __LINE__ << ": failed: " #condition << std::endl; \
+            ++failures;                                                                    \
+        }                                                                                  \
+    } while (0)
+
+/**
+ * @brief Reads a whole file.
+ *
+ * @param path The file.
+ * @return std::vector<uint8_t> Its contents (empty if it cannot be read).
+ */
+static std::vector<uint8_t> read_file(const fs::path& path) {
+    std::ifstream in(path, std::ios::binary);
+    return std::vector<uint8_t>((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+}
+
+/**
+ * @brief Replaces a file's contents.
+ *
+ * @param path The file.
+ * @param data The new contents.
+ */
+static void write_file(const fs::path& path, const std::vector<uint8_t>& data) {
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    out.write(reinterpret_cast<const char*>(data.data()), static_cast<std::streamsize>(data.size()));
+}
+
+/**
+ * @brief Generates reproducible pseudo-random bytes.
+ *
+ * @param length The number of bytes.
+ * @param seed The seed.
+ * @return std::vector<uint8_t> The bytes.
+ */
+static std::vector<uint8_t> random_bytes(size_t length, uint32_t seed) {
+    std::mt19937 generator(seed);
+    std::vector<uint8_t> bytes(length);
+    for (uint8_t& byte : bytes) {
+        byte = static_cast<uint8_t>(generator());
+    }
+    return bytes;
+}
+
+/**
+ * @brief Creates an index with a first (empty) snapshot, as the server does after rebuilding it.
+ *
+ * @param path The index path, without extension.
+ */
+static void create_index(const std::string& path) {
+    PersistentIndex index(2);
+    std::set<std::pair<size_t, std::string>> replayed;
+    CHECK(!index.open(path, replayed));
+    CHECK(index.checkpoint());
+}
+
+/**
+ * @brief A log whose last record is cut short replays the records before it, and is
+ * truncated there so that later records follow them.
+ *
+ * @param dir The scratch directory.
+ */
+static void check_torn_log(const fs::path& dir) {
+    std::string path = (dir / "torn").string();
+    create_index(path);
+    uint64_t intact = 0;
+    {
+        PersistentIndex index(2);
+        std::set<std::pair<size_t, std::string>> replayed;
+        CHECK(index.open(path, replayed));
+        CHECK(index.insert(0, "a", "1"));
+        CHECK(index.update({{true, 1, "b", "2"}, {true, 0, "c", "3"}}));
+        CHECK(index.sync());
+        intact = fs::file_size(path + ".wal");
+        CHECK(index.insert(0, "d", "4"));
+        CHECK(index.sync());
+    }
+    fs::resize_file(path + ".wal", intact + 5); // Crash in the middle of the last record
+
+    {
+        PersistentIndex index(2);
+        std::set<std::pair<size_t, std::string>> replayed;
+        CHECK(index.open(path, replayed));
+        CHECK(index.contains(0, "a", "1"));
+        CHECK(index.contains(1, "b", "2"));
+        CHECK(index.contains(0, "c", "3"));
+        CHECK(!index.contains(0, "d", "4"));
+        CHECK(replayed.size() == 3);
+        CHECK(fs::file_size(path + ".wal") == intact);
+        CHECK(index.insert(0, "e", "5"));
+        CHECK(index.sync());
+    }
+    {
+        PersistentIndex index(2);
+        std::set<std::pair<size_t, std::string>> replayed;
+        CHECK(index.open(path, replayed));
+        CHECK(index.contains(0, "a", "1"));
+        CHECK(index.contains(0, "e", "5"));
+        CHECK(!index.contains(0, "d", "4"));
+    }
+}
+
+/**
+ * @brief A crash between a checkpoint's snapshot rename and its log reset leaves the log of
+ * the previous generation over the new snapshot, holding changes made while the snapshot
+ * was written; it is replayed on top of it, and rewritten so that later records belong to
+ * the new snapshot.
+ *
+ * @param dir The scratch directory.
+ */
+static void check_checkpoint_crash(const fs::path& dir) {
+    std::string path = (dir / "checkpoint").string(), during = (dir / "during").string();
+    create_index(path);
+    {
+        PersistentIndex index(2);
+        std::set<std::pair<size_t, std::string>> replayed;
+        CHECK(index.open(path, replayed));
+        CHECK(index.insert(0, "x", "1"));
+        CHECK(index.insert(0, "y", "2"));
+        CHECK(index.insert(1, "z", "3"));
+        CHECK(index.sync());
+
+        // The old log as it stands once changes made during the snapshot write follow.
+        fs::copy_file(path + ".db", during + ".db");
+        fs::copy_file(path + ".wal", during + ".wal");
+        PersistentIndex writer(2);
+        std::set<std::pair<size_t, std::string>> ignored;
+        CHECK(writer.open(during, ignored));
+        CHECK(writer.erase(0, "x", "1"));
+        CHECK(writer.insert(0, "v", "5"));
+        CHECK(writer.sync());
+
+        CHECK(index.checkpoint());
+        CHECK(index.pending() == 0);
+    }
+    fs::copy_file(during + ".wal", path + ".wal", fs::copy_options::overwrite_existing); // The log reset never happened
+
+    {
+        PersistentIndex index(2);
+        std::set<std::pair<size_t, std::string>> replayed;
+        CHECK(index.open(path, replayed));
+        CHECK(!index.contains(0, "x", "1"));
+        CHECK(index.contains(0, "y", "2"));
+        CHECK(index.contains(1, "z", "3"));
+        CHECK(index.contains(0, "v", "5"));
+        CHECK(index.erase(1, "z", "3"));
+        CHECK(index.insert(0, "w", "4"));
+        CHECK(index.sync());
+    }
+    {
+        PersistentIndex index(2);
+        std::set<std::pair<size_t, std::string>> replayed;
+        CHECK(index.open(path, replayed));
+        CHECK(!index.contains(0, "x", "1"));
+        CHECK(index.contains(0, "y", "2"));
+        CHECK(!index.contains(1, "z", "3"));
+        CHECK(index.contains(0, "v", "5"));
+        CHECK(index.contains(0, "w", "4"));
+    }
+}
+
+/**
+ * @brief A saved journal loads back as it was, and one with a flipped byte or a cut-off
+ * tail is rejected.
+ *
+ * @param dir The scratch directory.
+ */
+static void check_journal(const fs::path& dir) {
+    std::string path = (dir / "upload.journal").string();
+    std::vector<uint8_t> data = random_bytes(2 * MERKLE_CHUNK_SIZE + 100, 1);
+    Hash digest{};
+    digest[0] = 0x42;
+    UploadJournal journal("notes.txt", 5 * MERKLE_CHUNK_SIZE, digest);
+    journal.append(data.data(), data.size());
+    CHECK(journal.save(path));
+
+    UploadJournal loaded("", 0, Hash{});
+    CHECK(UploadJournal::load(path, loaded));
+    CHECK(loaded.name() == "notes.txt");
+    CHECK(loaded.file_size() == 5 * MERKLE_CHUNK_SIZE);
+    CHECK(loaded.digest() == digest);
+    CHECK(loaded.committed() == 2 * MERKLE_CHUNK_SIZE);
+
+    std::vector<uint8_t> saved = read_file(path);
+    std::vector<uint8_t> corrupt = saved;
+    corrupt[8] ^= 0x01; // The file size, just past the magic: only the CRC tells
+    write_file(path, corrupt);
+    UploadJournal rejected("unchanged", 7, Hash{});
+    CHECK(!UploadJournal::load(path, rejected));
+    CHECK(rejected.name() == "unchanged");
+
+    saved.resize(saved.size() - 1);
+    write_file(path, saved);
+    CHECK(!UploadJournal::load(path, rejected));
+}
+
+/**
+ * @brief A delta and a prefix delta decode to the file they were encoded from.
+ *
+ * @param dir The scratch directory.
+ */
+static void check_delta(const fs::path& dir) {
+    std::vector<uint8_t> base = random_bytes(200000, 2);
+    std::vector<uint8_t> target(base.begin(), base.begin() + 50000);
+    std::vector<uint8_t> inserted = random_bytes(1234, 3);
+    target.insert(target.end(), inserted.begin(), inserted.end());
+    target.insert(target.end(), base.begin() + 60000, base.end()); // 10000 bytes dropped
+    target[150000] ^= 0xff;
+    target.push_back(7);
+
+    fs::path basePath = dir / "base", deltaPath = dir / "delta", outPath = dir / "out";
+    write_file(basePath, base);
+
+    std::vector<uint8_t> delta;
+    encode_delta(base, target, "base_v1", delta);
+    CHECK(delta.size() < target.size() / 10);
+    write_file(deltaPath, delta);
+    std::string baseVersion;
+    uint64_t targetSize = 0;
+    CHECK(read_delta_header(deltaPath.string(), baseVersion, targetSize));
+    CHECK(baseVersion == "base_v1");
+    CHECK(targetSize == target.size());
+    CHECK(apply_delta(basePath.string(), deltaPath.string(), outPath.string()));
+    CHECK(read_file(outPath) == target);
+
+    encode_prefix_delta(123457, "base_v2", delta);
+    write_file(deltaPath, delta);
+    CHECK(read_delta_header(deltaPath.string(), baseVersion, targetSize));
+    CHECK(baseVersion == "base_v2");
+    CHECK(targetSize == 123457);
+    CHECK(apply_delta(basePath.string(), deltaPath.string(), outPath.string()));
+    CHECK(read_file(outPath) == std::vector<uint8_t>(base.begin(), base.begin() + 123457));
+}
+
+int main() {
+    fs::path dir = fs::temp_directory_path() / ("store_test." + std::to_string(getpid()));
+    fs::remove_all(dir);
+    fs::create_directories(dir);
+
+    check_torn_log(dir);
+    check_checkpoint_crash(dir);
+    check_journal(dir);
+    check_delta(dir);
+
+    fs::remove_all(dir);
+    if (failures != 0) {
+        std::cerr << failures << " check(s) failed." << std::endl;
+        return 1;
+    }
+    std::cout << "All checks passed." << std::endl;
+    return 0;
+}
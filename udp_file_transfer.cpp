@@ -3,6 +3,7 @@
  * @brief UDP File Transfer System Implementation File
  */
 
+#include "udp_file_transfer.hpp"
 #include <vector>
 #include <iostream>
 #include <cstdint>
@@ -15,14 +16,112 @@
 #include <sstream>
 #include <iomanip>
 #include <chrono>
+#include <cerrno>
+#include <cstddef>
+#include <climits>
+#include <algorithm>
+#include <array>
+#include <deque>
+#include <cstdlib>
+#include <thread>
+#include <filesystem>
+#include <unordered_map>
+#include <map>
+#include <iterator>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <poll.h>
+#endif
+#ifdef __linux__
+#include <linux/net_tstamp.h>
+#include <sys/inotify.h>
+#endif
+#include <sys/stat.h>
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+/**
+ * @brief Computes the CRC-32 (IEEE 802.3, reflected) of a byte range.
+ * 
+ * @param data Pointer to the bytes.
+ * @param length Number of bytes.
+ * @return uint32_t The CRC-32 value.
+ */
+uint32_t crc32(const uint8_t* data, size_t length) {
+    static const auto table = [] {
+        std::array<uint32_t, 256> t{};
+        for (uint32_t i = 0; i < 256; ++i) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; ++k) {
+                c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+            }
+            t[i] = c;
+        }
+        return t;
+    }();
+
+    uint32_t crc = 0xFFFFFFFFu;
+    for (size_t i = 0; i < length; ++i) {
+        crc = table[(crc ^ data[i]) & 0xFFu] ^ (crc >> 8);
+    }
+    return crc ^ 0xFFFFFFFFu;
+}
+
+/**
+ * @brief Checks whether a byte range is all zero.
+ * 
+ * @param data Pointer to the bytes.
+ * @param length Number of bytes.
+ * @return true If every byte is zero.
+ * @return false Otherwise.
+ */
+bool is_all_zero(const uint8_t* data, size_t length) {
+    size_t i = 0;
+#if defined(__SSE2__) || defined(_M_X64)
+    // OR four vectors together per step and test once, so the loop is bound by loads.
+    for (; i + 64 <= length; i += 64) {
+        __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+        __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i + 16));
+        __m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i + 32));
+        __m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i + 48));
+        __m128i any = _mm_or_si128(_mm_or_si128(a, b), _mm_or_si128(c, d));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(any, _mm_setzero_si128())) != 0xFFFF) {
+            return false;
+        }
+    }
+#elif defined(__ARM_NEON)
+    for (; i + 64 <= length; i += 64) {
+        uint8x16_t any = vorrq_u8(vorrq_u8(vld1q_u8(data + i), vld1q_u8(data + i + 16)),
+                                  vorrq_u8(vld1q_u8(data + i + 32), vld1q_u8(data + i + 48)));
+        if (vmaxvq_u8(any) != 0) {
+            return false;
+        }
+    }
+#endif
+    uint8_t any = 0;
+    for (; i < length; ++i) {
+        any |= data[i];
+    }
+    return any == 0;
+}
 
 /**
  * @brief Calculates the checksum for a given data vector.
  * 
  * @param data A vector of bytes representing the data for which the checksum is calculated.
+ * @param algorithm The ChecksumAlgorithm to use.
  * @return uint32_t The computed checksum as a 32-bit unsigned integer.
  */
-uint32_t calculate_checksum(const std::vector<uint8_t>& data) {
+uint32_t calculate_checksum(const std::vector<uint8_t>& data, uint8_t algorithm) {
+    if (algorithm == CHECKSUM_CRC32) {
+        return crc32(data.data(), data.size());
+    }
     return std::accumulate(data.begin(), data.end(), 0u);
 }
 
@@ -31,11 +130,12 @@ uint32_t calculate_checksum(const std::vector<uint8_t>& data) {
  * 
  * @param data A vector of bytes representing the data to verify.
  * @param checksum The expected checksum value.
+ * @param algorithm The ChecksumAlgorithm to use.
  * @return true If the checksum matches the calculated checksum for the data.
  * @return false If the checksum does not match.
  */
-bool verify_checksum(const std::vector<uint8_t>& data, uint32_t checksum) {
-    return calculate_checksum(data) == checksum;
+bool verify_checksum(const std::vector<uint8_t>& data, uint32_t checksum, uint8_t algorithm) {
+    return calculate_checksum(data, algorithm) == checksum;
 }
 
 /**
@@ -92,6 +192,33 @@ std::vector<uint8_t> aes_decrypt(const std::vector<uint8_t>& data, const std::st
     return decrypted;
 }
 
+/**
+ * @brief Decrypts AES-256-CBC data into a caller's buffer.
+ * @details The plaintext is never longer than the ciphertext, and only plaintext bytes
+ * are written, so a buffer of `length` bytes is enough.
+ * 
+ * @param data The encrypted data.
+ * @param length The length of the encrypted data.
+ * @param key  The decryption key (must be 32 bytes for AES-256).
+ * @param iv   The initialization vector (16 bytes).
+ * @param out  The buffer.
+ * @param plainSize Receives the length of the plaintext.
+ * @return true If the data decrypted with valid padding.
+ */
+bool aes_decrypt_into(const uint8_t* data, size_t length, const std::string& key, const std::string& iv,
+                      uint8_t* out, size_t& plainSize) {
+    EVP_CIPHER_CTX* ctx = EVP_CIPHER_CTX_new();
+    int len = 0, finalLen = 0;
+
+    bool ok = ctx && length <= INT_MAX &&
+              EVP_DecryptInit_ex(ctx, EVP_aes_256_cbc(), nullptr, (const uint8_t*)key.data(), (const uint8_t*)iv.data()) == 1 &&
+              EVP_DecryptUpdate(ctx, out, &len, data, static_cast<int>(length)) == 1 &&
+              EVP_DecryptFinal_ex(ctx, out + len, &finalLen) == 1;
+    plainSize = ok ? static_cast<size_t>(len + finalLen) : 0;
+    EVP_CIPHER_CTX_free(ctx);
+    return ok;
+}
+
 /**
  * @brief Logs an error message to a file named `server_error.log`.
  * 
@@ -109,6 +236,326 @@ void log_error(const std::string& message) {
     }
 }
 
+/**
+ * @brief Computes the SHA-256 digest of a byte range.
+ * 
+ * @param data Pointer to the bytes.
+ * @param length Number of bytes.
+ * @return Hash The digest.
+ */
+Hash sha256(const uint8_t* data, size_t length) {
+    Hash digest{};
+    EVP_Digest(data, length, digest.data(), nullptr, EVP_sha256(), nullptr);
+    return digest;
+}
+
+/**
+ * @brief Hashes every MERKLE_CHUNK_SIZE chunk of a file on parallel threads.
+ * 
+ * @param path The file to hash.
+ * @param leaves Receives one leaf hash per chunk, SHA-256(0x00 || chunk).
+ * @return true On success.
+ * @return false If the file could not be read.
+ */
+bool compute_chunk_hashes(const std::string& path, std::vector<Hash>& leaves) {
+    std::error_code ec;
+    uint64_t size = std::filesystem::file_size(path, ec);
+    if (ec) {
+        return false;
+    }
+
+    size_t chunks = static_cast<size_t>((size + MERKLE_CHUNK_SIZE - 1) / MERKLE_CHUNK_SIZE);
+    leaves.assign(chunks, Hash{});
+    size_t threads = std::clamp<size_t>(std::thread::hardware_concurrency(), 1, 8);
+    threads = std::min(threads, std::max<size_t>(chunks, 1));
+    size_t perThread = (chunks + threads - 1) / threads;
+
+    std::vector<std::thread> workers;
+    std::vector<char> failed(threads, 0);
+    for (size_t t = 0; t < threads; ++t) {
+        workers.emplace_back([&, t] {
+            std::ifstream file(path, std::ios::binary);
+            std::vector<uint8_t> buffer(MERKLE_CHUNK_SIZE + 1);
+            size_t first = t * perThread;
+            size_t last = std::min(chunks, first + perThread);
+            file.seekg(static_cast<std::streamoff>(first * MERKLE_CHUNK_SIZE));
+            for (size_t i = first; i < last && file; ++i) {
+                buffer[0] = 0x00; // Leaf domain separator
+                file.read(reinterpret_cast<char*>(buffer.data() + 1), MERKLE_CHUNK_SIZE);
+                leaves[i] = sha256(buffer.data(), 1 + static_cast<size_t>(file.gcount()));
+            }
+            failed[t] = file.bad();
+        });
+    }
+    for (std::thread& worker : workers) {
+        worker.join();
+    }
+    return std::find(failed.begin(), failed.end(), 1) == failed.end();
+}
+
+/**
+ * @brief Computes the Merkle root over chunk hashes.
+ * 
+ * @param leaves The chunk hashes.
+ * @return Hash The root hash.
+ */
+Hash merkle_root(const std::vector<Hash>& leaves) {
+    if (leaves.empty()) {
+        return sha256(nullptr, 0);
+    }
+
+    std::vector<Hash> level = leaves;
+    while (level.size() > 1) {
+        std::vector<Hash> parents;
+        for (size_t i = 0; i < level.size(); i += 2) {
+            if (i + 1 == level.size()) {
+                parents.push_back(level[i]); // Unpaired node is promoted
+                continue;
+            }
+            uint8_t node[1 + 2 * HASH_SIZE];
+            node[0] = 0x01; // Inner node domain separator
+            std::memcpy(node + 1, level[i].data(), HASH_SIZE);
+            std::memcpy(node + 1 + HASH_SIZE, level[i + 1].data(), HASH_SIZE);
+            parents.push_back(sha256(node, sizeof(node)));
+        }
+        level.swap(parents);
+    }
+    return level.front();
+}
+
+/**
+ * @brief Formats a hash as lowercase hexadecimal.
+ * 
+ * @param hash The hash to format.
+ * @return std::string The 64-character hex string.
+ */
+std::string to_hex(const Hash& hash) {
+    std::ostringstream oss;
+    oss << std::hex << std::setfill('0');
+    for (uint8_t byte : hash) {
+        oss << std::setw(2) << static_cast<int>(byte);
+    }
+    return oss.str();
+}
+
+/// Magic bytes at the start of every delta file.
+static const char DELTA_MAGIC[4] = {'R', 'D', 'L', '1'};
+
+/// Delta instruction types.
+enum DeltaOp : uint8_t { DELTA_COPY = 'C', DELTA_INSERT = 'I' };
+
+/**
+ * @brief Appends a 64-bit value to a byte buffer (host byte order, like the sidecars).
+ */
+static void put_u64(std::vector<uint8_t>& out, uint64_t value) {
+    const uint8_t* bytes = reinterpret_cast<const uint8_t*>(&value);
+    out.insert(out.end(), bytes, bytes + sizeof(value));
+}
+
+/**
+ * @brief Computes the rolling checksum (Adler-32 style, two 16-bit sums) of a block.
+ * 
+ * @param data Pointer to the block.
+ * @param length Block length.
+ * @param a Receives the byte sum.
+ * @param b Receives the position-weighted sum.
+ * @return uint32_t The combined checksum.
+ */
+static uint32_t rolling_checksum(const uint8_t* data, size_t length, uint32_t& a, uint32_t& b) {
+    a = 0;
+    b = 0;
+    for (size_t i = 0; i < length; ++i) {
+        a += data[i];
+        b += static_cast<uint32_t>(length - i) * data[i];
+    }
+    a &= 0xFFFF;
+    b &= 0xFFFF;
+    return a | (b << 16);
+}
+
+/**
+ * @brief Starts a delta with its header: magic, target size and base version.
+ * 
+ * @param targetSize The size of the file the delta reconstructs.
+ * @param baseVersion Identifies the base (at most 255 bytes are kept).
+ * @param delta Receives the header, replacing its contents.
+ */
+static void write_delta_header(uint64_t targetSize, const std::string& baseVersion, std::vector<uint8_t>& delta) {
+    delta.assign(DELTA_MAGIC, DELTA_MAGIC + sizeof(DELTA_MAGIC));
+    put_u64(delta, targetSize);
+    delta.push_back(static_cast<uint8_t>(std::min<size_t>(baseVersion.size(), 255)));
+    delta.insert(delta.end(), baseVersion.begin(), baseVersion.begin() + delta.back());
+}
+
+/**
+ * @brief Encodes a file as a binary delta against a base file.
+ * 
+ * @param base The base file contents.
+ * @param target The contents to encode.
+ * @param baseVersion Identifies the base; stored in the header for the decoder.
+ * @param delta Receives the encoded delta.
+ */
+void encode_delta(const std::vector<uint8_t>& base, const std::vector<uint8_t>& target,
+                  const std::string& baseVersion, std::vector<uint8_t>& delta) {
+    write_delta_header(target.size(), baseVersion, delta);
+
+    const size_t block = DELTA_BLOCK_SIZE;
+    std::unordered_multimap<uint32_t, size_t> blocks;
+    uint32_t a, b;
+    for (size_t offset = 0; offset + block <= base.size(); offset += block) {
+        blocks.emplace(rolling_checksum(base.data() + offset, block, a, b), offset);
+    }
+
+    size_t literalStart = 0; // Target bytes [literalStart, pos) have no match yet
+    auto flush_literal = [&](size_t end) {
+        if (end > literalStart) {
+            delta.push_back(DELTA_INSERT);
+            put_u64(delta, end - literalStart);
+            delta.insert(delta.end(), target.begin() + literalStart, target.begin() + end);
+        }
+    };
+
+    size_t pos = 0;
+    uint32_t weak = target.size() >= block ? rolling_checksum(target.data(), block, a, b) : 0;
+    while (pos + block <= target.size()) {
+        size_t matchOffset = base.size();
+        auto range = blocks.equal_range(weak);
+        for (auto it = range.first; it != range.second; ++it) {
+            if (std::memcmp(base.data() + it->second, target.data() + pos, block) == 0) {
+                matchOffset = it->second;
+                break;
+            }
+        }
+
+        if (matchOffset == base.size()) {
+            // Roll the checksum one byte forward.
+            if (pos + block < target.size()) {
+                uint8_t out = target[pos], in = target[pos + block];
+                a = (a - out + in) & 0xFFFF;
+                b = (b - static_cast<uint32_t>(block) * out + a) & 0xFFFF;
+                weak = a | (b << 16);
+            }
+            ++pos;
+            continue;
+        }
+
+        // Extend the match backwards over unmatched bytes and forwards past the block.
+        size_t start = pos, offset = matchOffset;
+        while (start > literalStart && offset > 0 && base[offset - 1] == target[start - 1]) {
+            --start;
+            --offset;
+        }
+        size_t length = pos + block - start;
+        while (offset + length < base.size() && start + length < target.size() && base[offset + length] == target[start + length]) {
+            ++length;
+        }
+
+        flush_literal(start);
+        delta.push_back(DELTA_COPY);
+        put_u64(delta, offset);
+        put_u64(delta, length);
+        pos = literalStart = start + length;
+        if (pos + block <= target.size()) {
+            weak = rolling_checksum(target.data() + pos, block, a, b);
+        }
+    }
+    flush_literal(target.size());
+}
+
+/**
+ * @brief Encodes a file that is the first `size` bytes of its base.
+ * 
+ * @param size The size of the prefix.
+ * @param baseVersion Identifies the base; stored in the header for the decoder.
+ * @param delta Receives the encoded delta.
+ */
+void encode_prefix_delta(uint64_t size, const std::string& baseVersion, std::vector<uint8_t>& delta) {
+    write_delta_header(size, baseVersion, delta);
+    if (size > 0) {
+        delta.push_back(DELTA_COPY);
+        put_u64(delta, 0);
+        put_u64(delta, size);
+    }
+}
+
+/**
+ * @brief Reads the header of a delta file.
+ * 
+ * @param in The open delta file.
+ * @param baseVersion Receives the base version.
+ * @param targetSize Receives the reconstructed size.
+ * @return True if the header is valid.
+ */
+static bool read_delta_header(std::istream& in, std::string& baseVersion, uint64_t& targetSize) {
+    char magic[sizeof(DELTA_MAGIC)];
+    uint8_t length = 0;
+    in.read(magic, sizeof(magic));
+    in.read(reinterpret_cast<char*>(&targetSize), sizeof(targetSize));
+    in.read(reinterpret_cast<char*>(&length), 1);
+    baseVersion.assign(length, '\0');
+    in.read(&baseVersion[0], length);
+    return static_cast<bool>(in) && std::memcmp(magic, DELTA_MAGIC, sizeof(magic)) == 0;
+}
+
+/**
+ * @brief Reads the header of a delta file.
+ * 
+ * @param deltaPath The delta file.
+ * @param baseVersion Receives the base version it was encoded against.
+ * @param targetSize Receives the size of the file it reconstructs.
+ * @return True if the file is a valid delta.
+ */
+bool read_delta_header(const std::string& deltaPath, std::string& baseVersion, uint64_t& targetSize) {
+    std::ifstream in(deltaPath, std::ios::binary);
+    return in && read_delta_header(in, baseVersion, targetSize);
+}
+
+/**
+ * @brief Reconstructs a file from its base and a delta.
+ * 
+ * @param basePath The base file.
+ * @param deltaPath The delta file.
+ * @param outPath The file to write.
+ * @return True if the output was written with the expected size.
+ */
+bool apply_delta(const std::string& basePath, const std::string& deltaPath, const std::string& outPath) {
+    std::ifstream base(basePath, std::ios::binary);
+    std::ifstream delta(deltaPath, std::ios::binary);
+    std::string baseVersion;
+    uint64_t targetSize = 0;
+    if (!base || !delta || !read_delta_header(delta, baseVersion, targetSize)) {
+        return false;
+    }
+    std::ofstream out(outPath, std::ios::binary | std::ios::trunc);
+
+    std::vector<char> buffer(MERKLE_CHUNK_SIZE);
+    uint64_t written = 0;
+    uint8_t op;
+    while (out && delta.read(reinterpret_cast<char*>(&op), 1)) {
+        uint64_t offset = 0, length = 0;
+        if (op == DELTA_COPY) {
+            delta.read(reinterpret_cast<char*>(&offset), sizeof(offset));
+            base.clear();
+            base.seekg(static_cast<std::streamoff>(offset));
+        } else if (op != DELTA_INSERT) {
+            return false;
+        }
+        delta.read(reinterpret_cast<char*>(&length), sizeof(length));
+        std::istream& source = op == DELTA_COPY ? static_cast<std::istream&>(base) : delta;
+        while (length > 0 && source) {
+            source.read(buffer.data(), static_cast<std::streamsize>(std::min<uint64_t>(length, buffer.size())));
+            out.write(buffer.data(), source.gcount());
+            length -= static_cast<uint64_t>(source.gcount());
+            written += static_cast<uint64_t>(source.gcount());
+        }
+        if (length > 0) {
+            return false; // Truncated delta or base
+        }
+    }
+    out.close();
+    return static_cast<bool>(out) && written == targetSize;
+}
+
 /**
  * @brief Generates a versioned filename with a timestamp.
  * 
@@ -123,3 +570,1675 @@ void log_error(const std::string& message) {
     oss << filename << "_v" << std::put_time(std::localtime(&time), "%Y%m%d%H%M%S");
     return oss.str();
 }
+
+/**
+ * @brief Converts a SO_TIMESTAMPING control message to microseconds.
+ * 
+ * @param cmsg The control message.
+ * @return int64_t The software timestamp, or 0 if the message carries none.
+ */
+static int64_t timestamp_from_cmsg(const cmsghdr* cmsg) {
+#ifdef SO_TIMESTAMPING
+    if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SO_TIMESTAMPING) {
+        struct timespec ts[3]; // Layout of struct scm_timestamping; ts[0] is the software stamp
+        std::memcpy(ts, CMSG_DATA(cmsg), sizeof(ts));
+        return static_cast<int64_t>(ts[0].tv_sec) * 1000000 + ts[0].tv_nsec / 1000;
+    }
+#else
+    (void)cmsg;
+#endif
+    return 0;
+}
+
+/**
+ * @brief Drains the socket error queue and returns the latest TX timestamp found.
+ * 
+ * @param sockfd The socket file descriptor.
+ * @return int64_t The timestamp in microseconds, or 0 if none was queued.
+ */
+static int64_t read_tx_timestamp(int sockfd) {
+    int64_t latest = 0;
+#ifndef _WIN32
+    while (true) {
+        char data[64];
+        iovec iov = {data, sizeof(data)};
+        alignas(cmsghdr) char control[256];
+        msghdr msg = {};
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        if (recvmsg(sockfd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+            break;
+        }
+        for (cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg != nullptr; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            latest = std::max(latest, timestamp_from_cmsg(cmsg));
+        }
+    }
+#else
+    (void)sockfd;
+#endif
+    return latest;
+}
+
+/**
+ * @brief Waits until a socket has a datagram ready to be read.
+ * 
+ * @param sockfd The socket file descriptor.
+ * @param timeoutMs The maximum time to wait in milliseconds.
+ * @return true If the socket is readable.
+ * @return false On timeout or error.
+ */
+bool wait_readable(int sockfd, int timeoutMs) {
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs);
+    while (true) {
+        auto remaining = std::chrono::duration_cast<std::chrono::microseconds>(deadline - std::chrono::steady_clock::now());
+        if (remaining.count() < 0) {
+            return false;
+        }
+
+        fd_set readfds;
+        struct timeval timeout = {static_cast<long>(remaining.count() / 1000000), static_cast<long>(remaining.count() % 1000000)};
+        FD_ZERO(&readfds);
+        FD_SET(sockfd, &readfds);
+
+        int activity = select(sockfd + 1, &readfds, nullptr, nullptr, &timeout);
+        if (activity <= 0 || !FD_ISSET(sockfd, &readfds)) {
+            return false;
+        }
+#ifdef _WIN32
+        return true;
+#else
+        char probe;
+        if (recv(sockfd, &probe, sizeof(probe), MSG_PEEK | MSG_DONTWAIT) >= 0) {
+            return true;
+        }
+        read_tx_timestamp(sockfd); // Only error-queue entries were pending
+#endif
+    }
+}
+
+/**
+ * @brief Maps an errno value to the matching protocol error code.
+ * 
+ * @param err The errno value of the failed file operation.
+ * @return int The ErrorCode to report to the peer.
+ */
+int error_code_from_errno(int err) {
+    switch (err) {
+        case ENOENT:
+        case ENOTDIR:
+            return ERR_FILE_NOT_FOUND;
+        case EACCES:
+        case EPERM:
+        case EROFS:
+            return ERR_ACCESS_VIOLATION;
+        case ENOSPC:
+        case EFBIG:
+            return ERR_DISK_FULL;
+        case EEXIST:
+            return ERR_FILE_EXISTS;
+        default:
+            return ERR_NOT_DEFINED;
+    }
+}
+
+/// Bytes of an error packet before its message: operation and error code.
+constexpr size_t ERROR_HEADER_SIZE = 8;
+
+/**
+ * @brief Writes a 32-bit value big-endian (network byte order).
+ */
+static void put_be32(uint8_t* out, uint32_t value) {
+    for (int i = 3; i >= 0; --i, value >>= 8) {
+        out[i] = static_cast<uint8_t>(value);
+    }
+}
+
+/**
+ * @brief Reads a 32-bit big-endian value.
+ */
+static uint32_t get_be32(const uint8_t* in) {
+    return (uint32_t(in[0]) << 24) | (uint32_t(in[1]) << 16) | (uint32_t(in[2]) << 8) | uint32_t(in[3]);
+}
+
+/**
+ * @brief Sends a compact error packet (header plus NUL-terminated message).
+ * 
+ * @param sockfd The socket file descriptor.
+ * @param addr The peer address structure.
+ * @param errorCode The error code (see ErrorCode).
+ * @param message A short human-readable description.
+ */
+void send_error_packet(int sockfd, const sockaddr_in& addr, int errorCode, const std::string& message) {
+    uint8_t datagram[ERROR_HEADER_SIZE + sizeof(TFTPErrorPacket::errorMessage)] = {};
+    put_be32(datagram, static_cast<uint32_t>(ERROR_PACKET));
+    put_be32(datagram + 4, static_cast<uint32_t>(errorCode));
+    size_t messageLength = std::min(message.size(), sizeof(TFTPErrorPacket::errorMessage) - 1);
+    std::memcpy(datagram + ERROR_HEADER_SIZE, message.data(), messageLength);
+
+    size_t length = ERROR_HEADER_SIZE + messageLength + 1;
+    sendto(sockfd, (const char*)datagram, length, 0, (const struct sockaddr*)&addr, sizeof(addr));
+}
+
+/**
+ * @brief Checks whether a received datagram is an error packet.
+ * 
+ * @param buffer The received datagram.
+ * @param length The number of bytes received.
+ * @param error Optional output for the decoded error packet.
+ * @return true If the datagram is a well-formed error packet.
+ * @return false Otherwise.
+ */
+bool parse_error_packet(const void* buffer, long length, TFTPErrorPacket* error) {
+    const uint8_t* bytes = static_cast<const uint8_t*>(buffer);
+    if (length < static_cast<long>(ERROR_HEADER_SIZE) || static_cast<int32_t>(get_be32(bytes)) != ERROR_PACKET) {
+        return false;
+    }
+
+    TFTPErrorPacket decoded = {ERROR_PACKET, static_cast<int32_t>(get_be32(bytes + 4)), {}};
+    std::memcpy(decoded.errorMessage, bytes + ERROR_HEADER_SIZE,
+                std::min<size_t>(length - ERROR_HEADER_SIZE, sizeof(decoded.errorMessage) - 1));
+    if (error) *error = decoded;
+    return true;
+}
+
+/**
+ * @brief Encodes a packet in its wire format: the fields in declaration order, integers big-endian.
+ * 
+ * @param packet The packet.
+ * @param buffer Receives WIRE_PACKET_SIZE bytes.
+ */
+void encode_packet(const Packet& packet, uint8_t* buffer) {
+    uint8_t* at = buffer;
+    auto put = [&at](uint64_t value, size_t bytes) {
+        for (size_t i = bytes; i-- > 0; value >>= 8) {
+            at[i] = static_cast<uint8_t>(value);
+        }
+        at += bytes;
+    };
+    auto put_bytes = [&at](const void* bytes, size_t length) {
+        std::memcpy(at, bytes, length);
+        at += length;
+    };
+    put(static_cast<uint32_t>(packet.operationID), 4);
+    put_bytes(packet.filename, sizeof(packet.filename));
+    put_bytes(packet.data, sizeof(packet.data));
+    put(packet.checksum, 4);
+    put(packet.dataSize, 4);
+    put(packet.blockNumber, 8);
+    put(packet.flags, 4);
+    put(packet.fileSize, 8);
+    put(packet.optionsLength, 2);
+    put_bytes(packet.options, sizeof(packet.options));
+    put(packet.processingUs, 4);
+    put_bytes(packet.digest, sizeof(packet.digest));
+    put(packet.offset, 8);
+    put(packet.runLength, 8);
+    put(packet.timeoutMs, 4);
+}
+
+/**
+ * @brief Decodes a packet from its wire format.
+ * 
+ * @param buffer The received datagram.
+ * @param length The number of bytes received.
+ * @param packet Receives the decoded packet.
+ * @return true If the datagram has the size of an encoded packet.
+ * @return false Otherwise (e.g. an error packet or a truncated datagram); `packet` is left alone.
+ */
+bool decode_packet(const void* buffer, long length, Packet& packet) {
+    if (length != static_cast<long>(WIRE_PACKET_SIZE)) {
+        return false;
+    }
+    const uint8_t* at = static_cast<const uint8_t*>(buffer);
+    auto get = [&at](size_t bytes) {
+        uint64_t value = 0;
+        for (size_t i = 0; i < bytes; ++i) {
+            value = (value << 8) | at[i];
+        }
+        at += bytes;
+        return value;
+    };
+    auto get_bytes = [&at](void* bytes, size_t length) {
+        std::memcpy(bytes, at, length);
+        at += length;
+    };
+    packet.operationID = static_cast<int32_t>(get(4));
+    get_bytes(packet.filename, sizeof(packet.filename));
+    packet.filename[sizeof(packet.filename) - 1] = '\0';
+    get_bytes(packet.data, sizeof(packet.data));
+    packet.checksum = static_cast<uint32_t>(get(4));
+    packet.dataSize = static_cast<uint32_t>(get(4));
+    packet.blockNumber = get(8);
+    packet.flags = static_cast<uint32_t>(get(4));
+    packet.fileSize = get(8);
+    packet.optionsLength = static_cast<uint16_t>(get(2));
+    get_bytes(packet.options, sizeof(packet.options));
+    packet.processingUs = static_cast<uint32_t>(get(4));
+    get_bytes(packet.digest, sizeof(packet.digest));
+    packet.offset = get(8);
+    packet.runLength = get(8);
+    packet.timeoutMs = static_cast<uint32_t>(get(4));
+    return true;
+}
+
+/**
+ * @brief Encodes a packet and sends it as one datagram.
+ * 
+ * @param sockfd The socket file descriptor.
+ * @param packet The packet.
+ * @param peer The destination address.
+ * @return int64_t The kernel TX timestamp in microseconds, as send_datagram().
+ */
+int64_t send_packet(int sockfd, const Packet& packet, const sockaddr_in& peer) {
+    uint8_t wire[WIRE_PACKET_SIZE];
+    encode_packet(packet, wire);
+    return send_datagram(sockfd, wire, sizeof(wire), peer);
+}
+
+/**
+ * @brief Encodes transfer options as a TLV block (1-byte type, 1-byte length, big-endian value).
+ * 
+ * @param options The options to encode.
+ * @param buffer The output buffer.
+ * @param capacity The size of the output buffer.
+ * @return size_t The number of bytes written.
+ */
+size_t encode_options(const TransferOptions& options, uint8_t* buffer, size_t capacity) {
+    size_t offset = 0;
+    auto put = [&](uint8_t type, uint64_t value, uint8_t length) {
+        if (offset + 2 + length > capacity) {
+            return;
+        }
+        buffer[offset++] = type;
+        buffer[offset++] = length;
+        for (int i = length - 1; i >= 0; --i) {
+            buffer[offset++] = static_cast<uint8_t>(value >> (8 * i));
+        }
+    };
+
+    put(OPT_BLOCK_SIZE, options.blockSize, 4);
+    put(OPT_WINDOW_SIZE, options.windowSize, 4);
+    put(OPT_CIPHER, options.cipher, 1);
+    put(OPT_COMPRESSION, options.compression, 1);
+    put(OPT_FEC_RATIO, options.fecRatio, 1);
+    put(OPT_CHECKSUM, options.checksum, 1);
+    if (options.rangeOffset != 0 || options.rangeLength != 0) {
+        put(OPT_RANGE_OFFSET, options.rangeOffset, 8);
+        put(OPT_RANGE_LENGTH, options.rangeLength, 8);
+    }
+    if (options.resume) {
+        put(OPT_RESUME, options.resume, 1);
+    }
+    if (options.zeroRuns) {
+        put(OPT_ZERO_RUNS, options.zeroRuns, 1);
+    }
+    if (options.follow) {
+        put(OPT_FOLLOW, options.follow, 1);
+    }
+    return offset;
+}
+
+/**
+ * @brief Decodes a TLV options block; unknown types are skipped, missing ones keep their defaults.
+ * 
+ * @param buffer The TLV block.
+ * @param length The number of valid bytes in the block.
+ * @return TransferOptions The decoded options.
+ */
+TransferOptions decode_options(const uint8_t* buffer, size_t length) {
+    TransferOptions options;
+    size_t offset = 0;
+    while (offset + 2 <= length) {
+        uint8_t type = buffer[offset];
+        uint8_t size = buffer[offset + 1];
+        offset += 2;
+        if (offset + size > length || size > 8) {
+            break;
+        }
+
+        uint64_t value = 0;
+        for (uint8_t i = 0; i < size; ++i) {
+            value = (value << 8) | buffer[offset + i];
+        }
+        offset += size;
+
+        switch (type) {
+            case OPT_BLOCK_SIZE:  options.blockSize = static_cast<uint32_t>(value); break;
+            case OPT_WINDOW_SIZE: options.windowSize = static_cast<uint32_t>(value); break;
+            case OPT_CIPHER:      options.cipher = static_cast<uint8_t>(value); break;
+            case OPT_COMPRESSION: options.compression = static_cast<uint8_t>(value); break;
+            case OPT_FEC_RATIO:   options.fecRatio = static_cast<uint8_t>(value); break;
+            case OPT_CHECKSUM:    options.checksum = static_cast<uint8_t>(value); break;
+            case OPT_RANGE_OFFSET: options.rangeOffset = value; break;
+            case OPT_RANGE_LENGTH: options.rangeLength = value; break;
+            case OPT_RESUME:      options.resume = static_cast<uint8_t>(value != 0); break;
+            case OPT_ZERO_RUNS:   options.zeroRuns = static_cast<uint8_t>(value != 0); break;
+            case OPT_FOLLOW:      options.follow = static_cast<uint8_t>(value != 0); break;
+            default: break; // Unknown option, ignored
+        }
+    }
+    return options;
+}
+
+/**
+ * @brief Reduces requested options to what this implementation supports.
+ * 
+ * @param requested The options proposed by the peer.
+ * @return TransferOptions The options to acknowledge in the OACK.
+ */
+TransferOptions negotiate_options(const TransferOptions& requested) {
+    TransferOptions accepted;
+    accepted.blockSize = std::clamp<uint32_t>(requested.blockSize, MIN_BLOCK_SIZE, CHUNK_SIZE);
+    accepted.windowSize = std::clamp<uint32_t>(requested.windowSize, 1, MAX_WINDOW_SIZE);
+    if (requested.cipher == CIPHER_NONE || requested.cipher == CIPHER_AES_256_CBC) {
+        accepted.cipher = requested.cipher;
+    }
+    if (requested.checksum == CHECKSUM_SUM32 || requested.checksum == CHECKSUM_CRC32) {
+        accepted.checksum = requested.checksum;
+    }
+    // Compression and FEC are not implemented; the defaults (none) are acknowledged.
+    accepted.rangeOffset = requested.rangeOffset;
+    accepted.rangeLength = requested.rangeLength;
+    accepted.resume = requested.resume;
+    accepted.zeroRuns = requested.zeroRuns;
+    accepted.follow = requested.follow;
+    return accepted;
+}
+
+/**
+ * @brief Sends an acknowledgment for a block of the current session.
+ * 
+ * @param sockfd The socket file descriptor.
+ * @param addr The peer address structure.
+ * @param blockNumber The highest block received in order (0 acknowledges the request itself).
+ * @param fileSize The total file size to announce, if any.
+ * @param processingUs Time spent on the packet being answered, in microseconds.
+ */
+void send_ack(int sockfd, const sockaddr_in& addr, uint64_t blockNumber, uint64_t fileSize, uint32_t processingUs) {
+    Packet ack = {ACK, {}, {}, 0, 0, blockNumber, 0, fileSize};
+    ack.processingUs = processingUs;
+    uint8_t wire[WIRE_PACKET_SIZE];
+    encode_packet(ack, wire);
+    sendto(sockfd, (const char*)wire, sizeof(wire), 0, (const struct sockaddr*)&addr, sizeof(addr));
+}
+
+/**
+ * @brief Computes the checksum of a DATA block over its payload and the header fields that place it.
+ * @details Covers the block number, flags, file size, offset and run length (big-endian)
+ * after the payload, so a corrupted header cannot move a block, stretch a zero run or end
+ * the transfer early. The sender's retransmission timeout changes on every resend and is
+ * left out.
+ * 
+ * @param block The DATA block.
+ * @param algorithm The ChecksumAlgorithm to use.
+ * @return uint32_t The checksum to carry in block.checksum.
+ */
+static uint32_t block_checksum(const Packet& block, uint8_t algorithm) {
+    std::vector<uint8_t> covered(block.data, block.data + std::min<size_t>(block.dataSize, sizeof(block.data)));
+    auto put = [&covered](uint64_t value, int bytes) {
+        for (int shift = 8 * (bytes - 1); shift >= 0; shift -= 8) {
+            covered.push_back(static_cast<uint8_t>(value >> shift));
+        }
+    };
+    put(block.blockNumber, 8);
+    put(block.flags, 4);
+    put(block.fileSize, 8);
+    put(block.offset, 8);
+    put(block.runLength, 8);
+    return calculate_checksum(covered, algorithm);
+}
+
+/**
+ * @brief Applies the negotiated cipher to an outgoing payload.
+ */
+static std::vector<uint8_t> encrypt_payload(const std::vector<uint8_t>& plain, const TransferOptions& options,
+                                            const std::string& key, const std::string& iv) {
+    return options.cipher == CIPHER_AES_256_CBC ? aes_encrypt(plain, key, iv) : plain;
+}
+
+/**
+ * @brief Removes the negotiated cipher from an incoming payload.
+ */
+static std::vector<uint8_t> decrypt_payload(const std::vector<uint8_t>& payload, const TransferOptions& options,
+                                            const std::string& key, const std::string& iv) {
+    return options.cipher == CIPHER_AES_256_CBC ? aes_decrypt(payload, key, iv) : payload;
+}
+
+/**
+ * @brief Removes the negotiated cipher from an incoming payload, writing the plaintext to `out`.
+ */
+static bool decrypt_payload_into(const uint8_t* payload, size_t length, const TransferOptions& options,
+                                 const std::string& key, const std::string& iv, uint8_t* out, size_t& plainSize) {
+    if (options.cipher == CIPHER_AES_256_CBC) {
+        return aes_decrypt_into(payload, length, key, iv, out, plainSize);
+    }
+    std::memcpy(out, payload, length);
+    plainSize = length;
+    return true;
+}
+
+/// Produces the next DATA block of a transfer, waiting up to waitMs; returns false if none is ready yet.
+using PayloadSource = std::function<bool(BlockPayload& block, int waitMs)>;
+
+/**
+ * @brief Sends prepared DATA payloads with a sliding window (go-back-N).
+ * @details While the source has nothing to send and every block is acknowledged (a
+ * stalled pipe, a followed file that is not growing), a payload-less DATA block 0 is sent
+ * every half ACK_TIMEOUT; the receiver acknowledges it like a duplicate, so neither side
+ * gives up on the session, and a receiver that stops answering is still noticed.
+ * 
+ * @param sockfd The socket file descriptor.
+ * @param peer The session address of the receiver.
+ * @param options The negotiated transfer options.
+ * @param totalSize The number of plaintext bytes to send.
+ * @param next_payload Source of the blocks.
+ * @param error Receives a description of the failure.
+ * @param stats Optional statistics for the transfer.
+ * @return true Once the final block has been acknowledged.
+ * @return false If the receiver aborted or stopped acknowledging.
+ */
+static bool send_payloads(int sockfd, const sockaddr_in& peer, const TransferOptions& options, uint64_t totalSize,
+                          const PayloadSource& next_payload, std::string& error, TransferStats* stats) {
+    struct InFlight {
+        Packet packet;
+        int64_t sentUs;      ///< Kernel TX timestamp of the latest transmission
+        bool retransmitted;  ///< Excluded from RTT sampling (Karn's algorithm)
+    };
+
+    std::deque<InFlight> window;
+    BlockPayload payload;
+    RttEstimator rtt;
+    uint64_t blockNumber = 0;
+    uint64_t sent = 0;
+    bool lastQueued = false;
+    int timeouts = 0; // Consecutive timeouts of at least ACK_TIMEOUT since the last progress
+    auto lastProgress = std::chrono::steady_clock::now();
+    const auto giveUp = std::chrono::milliseconds(MAX_RETRIES * ACK_TIMEOUT); // Unanswered keepalives
+
+    while (true) {
+        // Fill the window with fresh blocks (without waiting for the source while blocks are in flight).
+        while (!lastQueued && window.size() < options.windowSize &&
+               next_payload(payload, window.empty() ? ACK_TIMEOUT / 2 : 0)) {
+            uint64_t offset = sent;
+            sent += payload.plainSize;
+            lastQueued = (!payload.zeroRun && !payload.partial && payload.plainSize < options.blockSize) || sent >= totalSize;
+
+            // The final block carries the number of bytes actually sent: the size of a stream is only known here.
+            uint32_t flags = (lastQueued ? FLAG_LAST_BLOCK : 0u) | (payload.zeroRun ? FLAG_ZERO_RUN : 0u);
+            Packet block = {DATA, {}, {}, 0, static_cast<uint32_t>(payload.bytes.size()), ++blockNumber, flags,
+                            lastQueued ? sent : totalSize};
+            std::memcpy(block.data, payload.bytes.data(), payload.bytes.size());
+            block.offset = offset;
+            block.runLength = payload.zeroRun ? payload.plainSize : 0;
+            block.checksum = block_checksum(block, options.checksum);
+            block.timeoutMs = static_cast<uint32_t>(rtt.timeout_ms());
+
+            int64_t sentUs = send_packet(sockfd, block, peer);
+            window.push_back({block, sentUs, false});
+        }
+        if (window.empty() && lastQueued) {
+            return true;
+        }
+        if (window.empty()) { // Source stalled: keep the session alive
+            while (wait_readable(sockfd, 0)) { // Answers to earlier keepalives
+                uint8_t wire[WIRE_PACKET_SIZE];
+                long received = receive_datagram(sockfd, wire, sizeof(wire), nullptr, stats);
+                TFTPErrorPacket peerError;
+                if (parse_error_packet(wire, received, &peerError)) {
+                    error = std::string("peer aborted: ") + peerError.errorMessage;
+                    return false;
+                }
+                Packet ack;
+                if (decode_packet(wire, received, ack) && ack.operationID == ACK) {
+                    lastProgress = std::chrono::steady_clock::now();
+                }
+            }
+            if (std::chrono::steady_clock::now() - lastProgress >= giveUp) {
+                error = "keepalives not acknowledged";
+                return false;
+            }
+            Packet keepalive = {DATA, {}, {}, 0, 0, 0, 0, totalSize};
+            send_packet(sockfd, keepalive, peer);
+            continue;
+        }
+
+        if (!wait_readable(sockfd, rtt.timeout_ms())) {
+            // The retry budget is counted in timeouts, not time: a backed-off timeout can exceed ACK_TIMEOUT.
+            if (rtt.timeout_ms() >= ACK_TIMEOUT && ++timeouts >= MAX_RETRIES) {
+                error = "block " + std::to_string(window.front().packet.blockNumber) + " not acknowledged";
+                return false;
+            }
+            rtt.backoff();
+            for (InFlight& block : window) { // Go-back-N retransmission
+                block.packet.timeoutMs = static_cast<uint32_t>(rtt.timeout_ms());
+                block.sentUs = send_packet(sockfd, block.packet, peer);
+                block.retransmitted = true;
+            }
+            if (stats) stats->retransmissions += static_cast<uint32_t>(window.size());
+            continue;
+        }
+
+        uint8_t wire[WIRE_PACKET_SIZE];
+        int64_t receivedUs = 0;
+        long received = receive_datagram(sockfd, wire, sizeof(wire), nullptr, stats, &receivedUs);
+        TFTPErrorPacket peerError;
+        if (parse_error_packet(wire, received, &peerError)) {
+            error = std::string("peer aborted: ") + peerError.errorMessage;
+            return false;
+        }
+        Packet ack;
+        if (!decode_packet(wire, received, ack) || ack.operationID != ACK) {
+            continue;
+        }
+
+        // Cumulative ACK: everything up to ack.blockNumber has arrived.
+        bool progress = false;
+        while (!window.empty() && window.front().packet.blockNumber <= ack.blockNumber) {
+            const InFlight& block = window.front();
+            if (block.packet.blockNumber == ack.blockNumber && !block.retransmitted) {
+                int64_t networkUs = receivedUs - block.sentUs - static_cast<int64_t>(ack.processingUs);
+                if (networkUs >= 0) {
+                    rtt.add_sample(networkUs);
+                    if (stats) {
+                        ++stats->rttSamples;
+                        stats->networkUs += static_cast<uint64_t>(networkUs);
+                        stats->processingUs += ack.processingUs;
+                    }
+                }
+            }
+            window.pop_front();
+            progress = true;
+        }
+        if (progress) {
+            lastProgress = std::chrono::steady_clock::now();
+            timeouts = 0;
+        }
+    }
+}
+
+/**
+ * @brief Sends a file's DATA blocks with a sliding window (go-back-N).
+ * 
+ * @param sockfd The socket file descriptor.
+ * @param peer The session address of the receiver.
+ * @param options The negotiated transfer options.
+ * @param key The AES encryption key.
+ * @param iv The AES initialization vector.
+ * @param totalSize The number of plaintext bytes to send.
+ * @param read_block Source of the plaintext.
+ * @param error Receives a description of the failure.
+ * @param stats Optional statistics for the transfer.
+ * @return true Once the final block has been acknowledged.
+ * @return false If the receiver aborted or stopped acknowledging.
+ */
+bool send_data_blocks(int sockfd, const sockaddr_in& peer, const TransferOptions& options,
+                      const std::string& key, const std::string& iv, uint64_t totalSize,
+                      const BlockReader& read_block, std::string& error, TransferStats* stats) {
+    std::vector<uint8_t> plain(options.blockSize);
+    size_t bytesRead = 0;
+    bool haveBlock = false; // plain holds a block read while extending a zero run
+    return send_payloads(sockfd, peer, options, totalSize,
+        [&](BlockPayload& payload, int) {
+            if (!haveBlock) {
+                bytesRead = read_block(plain.data(), plain.size());
+            }
+            haveBlock = false;
+            payload.zeroRun = options.zeroRuns && bytesRead > 0 && is_all_zero(plain.data(), bytesRead);
+            if (!payload.zeroRun) {
+                payload.plainSize = bytesRead;
+                payload.bytes = encrypt_payload(std::vector<uint8_t>(plain.begin(), plain.begin() + bytesRead), options, key, iv);
+                return true;
+            }
+
+            // Extend the run over the following zero blocks; the first other block is kept for the next call.
+            payload.plainSize = bytesRead;
+            payload.bytes.clear();
+            while (bytesRead == plain.size()) {
+                bytesRead = read_block(plain.data(), plain.size());
+                if (bytesRead == 0 || !is_all_zero(plain.data(), bytesRead)) {
+                    haveBlock = bytesRead > 0;
+                    break;
+                }
+                payload.plainSize += bytesRead;
+            }
+            return true;
+        }, error, stats);
+}
+
+/**
+ * @brief Sends a file's DATA blocks from a read-ahead stage.
+ * 
+ * @param sockfd The socket file descriptor.
+ * @param peer The session address of the receiver.
+ * @param options The negotiated transfer options.
+ * @param totalSize The number of plaintext bytes to send.
+ * @param source The prepared payloads.
+ * @param error Receives a description of the failure.
+ * @param stats Optional statistics for the transfer.
+ * @return true Once the final block has been acknowledged.
+ * @return false If the receiver aborted or stopped acknowledging.
+ */
+bool send_data_blocks(int sockfd, const sockaddr_in& peer, const TransferOptions& options, uint64_t totalSize,
+                      ReadAhead& source, std::string& error, TransferStats* stats) {
+    return send_payloads(sockfd, peer, options, totalSize,
+        [&source](BlockPayload& block, int waitMs) { return source.next(block, waitMs); }, error, stats);
+}
+
+/**
+ * @brief Stays on a finished transfer to answer retransmissions with the final ACK again.
+ * @details The final ACK may be lost like any datagram, and a sender that never gets it
+ * reports a failed transfer although every block arrived. Like TFTP's dally, the receiver
+ * waits two of the sender's retransmission timeouts (each DATA block carries the current
+ * one) and answers every DATA block with the final ACK; each retransmission restarts the
+ * wait with the sender's backed-off timeout, until the sender has used up its retry budget
+ * (MAX_RETRIES timeouts of at least ACK_TIMEOUT) or goes quiet.
+ * 
+ * @param sockfd The socket file descriptor.
+ * @param peer The session address of the sender.
+ * @param lastBlock The final block, acknowledged again.
+ * @param timeoutMs The sender's retransmission timeout carried by the final block.
+ */
+static void linger_after_final_ack(int sockfd, const sockaddr_in& peer, uint64_t lastBlock, uint32_t timeoutMs) {
+    int rounds = 0;
+    while (rounds <= MAX_RETRIES && wait_readable(sockfd, 2 * static_cast<int>(std::clamp<uint32_t>(timeoutMs, MIN_RTO, MAX_RTO)))) {
+        uint8_t wire[WIRE_PACKET_SIZE];
+        long length = receive_datagram(sockfd, wire, sizeof(wire), nullptr, nullptr);
+        Packet block;
+        if (!decode_packet(wire, length, block) || block.operationID != DATA) {
+            continue;
+        }
+        if (block.blockNumber == lastBlock) { // Go-back-N resends the final block once per timeout
+            timeoutMs = block.timeoutMs;
+            rounds += timeoutMs >= static_cast<uint32_t>(ACK_TIMEOUT) ? 1 : 0;
+        }
+        send_ack(sockfd, peer, lastBlock);
+    }
+}
+
+/**
+ * @brief Receives DATA blocks in any order, stores each at its offset, and acknowledges cumulatively.
+ * @details Blocks up to one window ahead of the first missing block are accepted and
+ * written as soon as they arrive, so a reordered or lost datagram only costs the
+ * retransmission of itself. Arrivals are tracked in a ring of one slot per window
+ * position; duplicates of blocks already stored are acknowledged and dropped. Each block
+ * names its offset, so a zero run can stand for any number of blocks; the offsets are
+ * checked against each other and the announced size, since a sink writes where they say.
+ * 
+ * @param sockfd The socket file descriptor.
+ * @param peer The session address of the sender.
+ * @param options The negotiated transfer options.
+ * @param key The AES encryption key.
+ * @param iv The AES initialization vector.
+ * @param totalSize The size announced for the transfer, or UNKNOWN_SIZE.
+ * @param write_at Sink for the decrypted blocks and their offsets.
+ * @param received Receives the number of plaintext bytes received without gaps.
+ * @param error Receives a description of the failure.
+ * @param stats Optional statistics for the transfer.
+ * @param write_zeros Optional sink for zero runs.
+ * @param place Optional destination of blocks, tried before `write_at`.
+ * @param barrier Optional wait for deferred writes, and commit, before the final ACK.
+ * @return true Once every block up to the one flagged FLAG_LAST_BLOCK has been stored.
+ * @return false If the sender aborted, went silent, or a write failed.
+ */
+bool receive_data_blocks_at(int sockfd, const sockaddr_in& peer, const TransferOptions& options,
+                            const std::string& key, const std::string& iv, uint64_t totalSize,
+                            const PositionalWriter& write_at, uint64_t& received, std::string& error,
+                            TransferStats* stats, const ZeroRunWriter& write_zeros, const BlockPlacer& place,
+                            const WriteBarrier& barrier) {
+    const uint32_t window = std::max<uint32_t>(options.windowSize, 1);
+    // Received-range bitmap of blocks [expected, expected + window), indexed by block number
+    // modulo the window: the bytes the block stands for plus one, or 0 while it is missing.
+    std::vector<uint64_t> arrived(window, 0);
+    std::vector<uint64_t> offsets(window, 0); // Offset each arrived block claimed, checked as it comes in order
+    // The announced size bounds every block; a followed file has none, and its short blocks may come anywhere.
+    const uint64_t limit = totalSize;
+    const bool aligned = !options.follow;
+    uint64_t expected = 1;
+    uint64_t lastBlock = 0; // Known once the block flagged FLAG_LAST_BLOCK has arrived
+    uint64_t finalSize = 0; // Bytes the sender sent in all, announced by that block
+    auto lastHeard = std::chrono::steady_clock::now();
+    received = 0;
+
+    while (true) {
+        if (!wait_readable(sockfd, ACK_TIMEOUT)) {
+            if (std::chrono::steady_clock::now() - lastHeard >= std::chrono::milliseconds(RECEIVE_TIMEOUT)) {
+                error = "timed out waiting for block " + std::to_string(expected);
+                return false;
+            }
+            send_ack(sockfd, peer, expected - 1); // Re-acknowledge what we have
+            continue;
+        }
+
+        uint8_t wire[WIRE_PACKET_SIZE];
+        int64_t receivedUs = 0;
+        long length = receive_datagram(sockfd, wire, sizeof(wire), nullptr, stats, &receivedUs);
+        TFTPErrorPacket peerError;
+        if (parse_error_packet(wire, length, &peerError)) {
+            error = std::string("peer aborted: ") + peerError.errorMessage;
+            return false;
+        }
+        Packet block;
+        if (!decode_packet(wire, length, block) || block.operationID != DATA || block.dataSize > sizeof(block.data)) {
+            continue;
+        }
+        lastHeard = std::chrono::steady_clock::now();
+
+        uint64_t number = block.blockNumber;
+        if (number >= expected && number - expected < window && arrived[number % window] == 0 &&
+            (lastBlock == 0 || number <= lastBlock)) {
+            if (block_checksum(block, options.checksum) != block.checksum) {
+                continue; // Not acknowledged, the sender retransmits
+            }
+            // A block that passed its checksum but does not fit the transfer was sent wrong, not damaged.
+            auto reject = [&](const std::string& reason) {
+                send_error_packet(sockfd, peer, ERR_ILLEGAL_OPERATION, "Invalid block.");
+                error = "block " + std::to_string(number) + " " + reason;
+                return false;
+            };
+            const bool last = (block.flags & FLAG_LAST_BLOCK) != 0;
+            const uint64_t offset = block.offset;
+            if (offset > limit || (number == expected ? offset != received : offset < received) ||
+                (aligned && offset % options.blockSize != 0)) {
+                return reject("at offset " + std::to_string(offset));
+            }
+            // Every block but the last one covers whole blocks, and nothing goes past the announced size.
+            auto fits = [&](uint64_t size, bool run) {
+                return size <= limit - offset && (last || (size != 0 &&
+                       (!aligned || (run ? size % options.blockSize == 0 : size == options.blockSize))));
+            };
+
+            std::vector<uint8_t> payload(block.data, block.data + block.dataSize);
+            uint64_t size = 0;
+            bool stored = true;
+            if (block.flags & FLAG_ZERO_RUN) {
+                size = block.runLength;
+                if (size == 0 || !fits(size, true)) {
+                    return reject("with a run of " + std::to_string(size) + " bytes");
+                }
+                if (write_zeros) {
+                    stored = write_zeros(offset, size);
+                } else {
+                    // Bounded by the check above: offset + size cannot wrap or pass the announced size.
+                    std::vector<uint8_t> zeros(std::min<uint64_t>(size, options.blockSize), 0);
+                    for (uint64_t done = 0; stored && done < size; done += zeros.size()) {
+                        zeros.resize(std::min<uint64_t>(zeros.size(), size - done));
+                        stored = write_at(offset + done, zeros);
+                    }
+                }
+            } else if (uint8_t* target = place ? place(offset, payload.size()) : nullptr) {
+                size_t plainSize = 0;
+                if (!decrypt_payload_into(payload.data(), payload.size(), options, key, iv, target, plainSize)) {
+                    return reject("that does not decrypt"); // Not a write failure: errno says nothing here
+                }
+                size = plainSize;
+                if (size > options.blockSize || !fits(size, false)) {
+                    return reject("of " + std::to_string(size) + " bytes");
+                }
+            } else {
+                std::vector<uint8_t> plain = decrypt_payload(payload, options, key, iv);
+                size = plain.size();
+                if (size > options.blockSize || !fits(size, false)) {
+                    return reject("of " + std::to_string(size) + " bytes");
+                }
+                stored = write_at(offset, plain);
+            }
+            if (!stored) {
+                send_error_packet(sockfd, peer, error_code_from_errno(errno), "Write failed.");
+                error = "write failed";
+                return false;
+            }
+            arrived[number % window] = size + 1;
+            offsets[number % window] = offset;
+            if (last) {
+                lastBlock = number;
+                finalSize = block.fileSize;
+            }
+
+            while (arrived[expected % window] != 0) {
+                if (offsets[expected % window] != received) { // Blocks must tile the transfer without gaps or overlaps
+                    number = expected;
+                    return reject("at offset " + std::to_string(offsets[expected % window]) +
+                                  ", expected " + std::to_string(received));
+                }
+                received += arrived[expected % window] - 1;
+                arrived[expected % window] = 0;
+                ++expected;
+            }
+            if (lastBlock != 0 && expected > lastBlock) {
+                if (received != finalSize) {
+                    send_error_packet(sockfd, peer, ERR_NOT_DEFINED, "Size mismatch.");
+                    error = "received " + std::to_string(received) + " bytes, sender announced " + std::to_string(finalSize);
+                    return false;
+                }
+                if (std::any_of(arrived.begin(), arrived.end(), [](uint64_t slot) { return slot != 0; })) {
+                    return reject("is followed by blocks past it");
+                }
+                std::string reason;
+                if (barrier && !barrier(reason)) {
+                    send_error_packet(sockfd, peer, error_code_from_errno(errno), reason.empty() ? "Write failed." : reason);
+                    error = reason.empty() ? "write failed" : "not committed: " + reason;
+                    return false;
+                }
+                send_ack(sockfd, peer, lastBlock, 0, static_cast<uint32_t>(std::max<int64_t>(0, now_us() - receivedUs)));
+                linger_after_final_ack(sockfd, peer, lastBlock, block.timeoutMs);
+                return true;
+            }
+        }
+        send_ack(sockfd, peer, expected - 1, 0, static_cast<uint32_t>(std::max<int64_t>(0, now_us() - receivedUs)));
+    }
+}
+
+/**
+ * @brief Receives DATA blocks and delivers them in order.
+ * @details Blocks that arrive ahead of a gap wait in a reorder buffer, which
+ * receive_data_blocks_at() bounds to one window.
+ * 
+ * @param sockfd The socket file descriptor.
+ * @param peer The session address of the sender.
+ * @param options The negotiated transfer options.
+ * @param key The AES encryption key.
+ * @param iv The AES initialization vector.
+ * @param totalSize The size announced for the transfer, or UNKNOWN_SIZE.
+ * @param write_block Sink for the decrypted blocks.
+ * @param received Receives the number of plaintext bytes delivered.
+ * @param error Receives a description of the failure.
+ * @param stats Optional statistics for the transfer.
+ * @param skip_zeros Optional sink for zero runs.
+ * @param barrier Optional wait for deferred writes, and commit, before the final ACK.
+ * @return true Once the block flagged FLAG_LAST_BLOCK has been delivered.
+ * @return false If the sender aborted, went silent, or a write failed.
+ */
+bool receive_data_blocks(int sockfd, const sockaddr_in& peer, const TransferOptions& options,
+                         const std::string& key, const std::string& iv, uint64_t totalSize,
+                         const BlockWriter& write_block, uint64_t& received, std::string& error,
+                         TransferStats* stats, const ZeroRunSink& skip_zeros, const WriteBarrier& barrier) {
+    struct Pending {
+        std::vector<uint8_t> bytes; ///< Plaintext block, empty for a zero run
+        uint64_t zeros;             ///< Length of a zero run
+    };
+    std::map<uint64_t, Pending> reorder; // Offset -> block not yet deliverable
+    uint64_t delivered = 0;
+    auto deliver = [&reorder, &delivered, &write_block, &skip_zeros]() {
+        for (auto next = reorder.begin(); next != reorder.end() && next->first == delivered; next = reorder.erase(next)) {
+            const Pending& block = next->second;
+            if (block.zeros != 0) {
+                if (!skip_zeros(block.zeros)) {
+                    return false;
+                }
+                delivered += block.zeros;
+            } else {
+                if (!write_block(block.bytes)) {
+                    return false;
+                }
+                delivered += block.bytes.size();
+            }
+        }
+        return true;
+    };
+    // Two blocks claiming one offset, or blocks left over at the end, mean the sender's offsets
+    // do not tile the transfer; receive_data_blocks_at() rejects that too, but only as they come in order.
+    return receive_data_blocks_at(sockfd, peer, options, key, iv, totalSize,
+        [&reorder, &deliver](uint64_t offset, const std::vector<uint8_t>& block) {
+            if (!reorder.emplace(offset, Pending{block, 0}).second) {
+                errno = EINVAL;
+                return false;
+            }
+            return deliver();
+        }, received, error, stats,
+        skip_zeros ? ZeroRunWriter([&reorder, &deliver](uint64_t offset, uint64_t length) {
+            if (!reorder.emplace(offset, Pending{{}, length}).second) {
+                errno = EINVAL;
+                return false;
+            }
+            return deliver();
+        }) : ZeroRunWriter(), nullptr,
+        [&reorder, &barrier](std::string& reason) {
+            if (!reorder.empty()) {
+                errno = EINVAL;
+                reason = "Blocks out of place.";
+                return false;
+            }
+            return !barrier || barrier(reason);
+        });
+}
+
+/**
+ * @brief Computes socket buffer sizes for a session's bandwidth-delay product.
+ * 
+ * @param options The negotiated transfer options.
+ * @return size_t Two windows of datagrams including kernel overhead, clamped to
+ * [MIN_SOCKET_BUFFER, MAX_SOCKET_BUFFER].
+ */
+size_t socket_buffer_size(const TransferOptions& options) {
+    size_t window = static_cast<size_t>(std::max<uint32_t>(options.windowSize, 1)) * (WIRE_PACKET_SIZE + DATAGRAM_OVERHEAD);
+    return std::clamp(2 * window, MIN_SOCKET_BUFFER, MAX_SOCKET_BUFFER);
+}
+
+/**
+ * @brief Reads back one buffer size of a socket.
+ * 
+ * @param sockfd The socket file descriptor.
+ * @param option SO_RCVBUF or SO_SNDBUF.
+ * @return size_t The usable size in bytes.
+ */
+static size_t granted_buffer_size(int sockfd, int option) {
+    int size = 0;
+    socklen_t length = sizeof(size);
+    if (getsockopt(sockfd, SOL_SOCKET, option, (char*)&size, &length) != 0 || size < 0) {
+        return 0;
+    }
+#ifdef __linux__
+    size /= 2; // Linux doubles the requested size to account for its own bookkeeping
+#endif
+    return static_cast<size_t>(size);
+}
+
+/**
+ * @brief Sets the send and receive buffer sizes of a socket.
+ * 
+ * @param sockfd The socket file descriptor.
+ * @param bytes The requested buffer size.
+ * @return size_t The smaller of the granted receive and send buffer sizes.
+ */
+size_t size_socket_buffers(int sockfd, size_t bytes) {
+    int size = static_cast<int>(std::min(bytes, MAX_SOCKET_BUFFER));
+
+#ifdef SO_RCVBUFFORCE
+    if (setsockopt(sockfd, SOL_SOCKET, SO_RCVBUFFORCE, &size, sizeof(size)) != 0)
+#endif
+        setsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, (const char*)&size, sizeof(size));
+
+#ifdef SO_SNDBUFFORCE
+    if (setsockopt(sockfd, SOL_SOCKET, SO_SNDBUFFORCE, &size, sizeof(size)) != 0)
+#endif
+        setsockopt(sockfd, SOL_SOCKET, SO_SNDBUF, (const char*)&size, sizeof(size));
+
+    return std::min(granted_buffer_size(sockfd, SO_RCVBUF), granted_buffer_size(sockfd, SO_SNDBUF));
+}
+
+/**
+ * @brief Enables the receive-queue drop counter (SO_RXQ_OVFL) on a socket.
+ * 
+ * @param sockfd The socket file descriptor.
+ */
+void enable_drop_monitoring(int sockfd) {
+#ifdef SO_RXQ_OVFL
+    int enable = 1;
+    setsockopt(sockfd, SOL_SOCKET, SO_RXQ_OVFL, &enable, sizeof(enable));
+#else
+    (void)sockfd;
+#endif
+}
+
+/**
+ * @brief Receives one datagram and collects the socket's ancillary counters.
+ * 
+ * @param sockfd The socket file descriptor.
+ * @param buffer The receive buffer.
+ * @param length The size of the receive buffer.
+ * @param from Optional output for the sender address.
+ * @param stats Optional statistics updated from the ancillary data.
+ * @return long The number of bytes received, or -1 on error.
+ */
+long receive_datagram(int sockfd, void* buffer, size_t length, sockaddr_in* from, TransferStats* stats,
+                      int64_t* timestampUs) {
+#ifdef _WIN32
+    (void)stats;
+    if (timestampUs) *timestampUs = now_us();
+    int fromLen = sizeof(sockaddr_in);
+    return recvfrom(sockfd, (char*)buffer, (int)length, 0, (struct sockaddr*)from, from ? &fromLen : nullptr);
+#else
+    iovec iov = {buffer, length};
+    alignas(cmsghdr) char control[256];
+    msghdr msg = {};
+    msg.msg_name = from;
+    msg.msg_namelen = from ? sizeof(sockaddr_in) : 0;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    ssize_t received = recvmsg(sockfd, &msg, 0);
+    if (timestampUs) *timestampUs = now_us();
+    if (received < 0) {
+        return received;
+    }
+
+    for (cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg != nullptr; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+#ifdef SO_RXQ_OVFL
+        if (stats && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SO_RXQ_OVFL) {
+            std::memcpy(&stats->kernelDrops, CMSG_DATA(cmsg), sizeof(uint32_t));
+        }
+#endif
+        int64_t kernelUs = timestamp_from_cmsg(cmsg);
+        if (timestampUs && kernelUs != 0) {
+            *timestampUs = kernelUs;
+        }
+    }
+    return received;
+#endif
+}
+
+/**
+ * @brief Formats transfer statistics for logs and reports.
+ * 
+ * @param stats The statistics to format.
+ * @return std::string A one-line summary.
+ */
+std::string format_transfer_stats(const TransferStats& stats) {
+    std::ostringstream oss;
+    oss << stats.retransmissions << " retransmitted blocks, "
+        << stats.kernelDrops << " kernel receive drops";
+    if (stats.rttSamples > 0) {
+        oss << std::fixed << std::setprecision(3)
+            << ", avg network RTT " << stats.networkUs / 1000.0 / stats.rttSamples << " ms"
+            << ", avg peer processing " << stats.processingUs / 1000.0 / stats.rttSamples << " ms";
+    }
+    return oss.str();
+}
+
+/**
+ * @brief Enables kernel software timestamps (SO_TIMESTAMPING) on a socket.
+ * 
+ * @param sockfd The socket file descriptor.
+ * @param transmit Also timestamp outgoing datagrams (reported on the error queue).
+ */
+void enable_timestamping(int sockfd, bool transmit) {
+#ifdef SO_TIMESTAMPING
+    int flags = SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE;
+    if (transmit) {
+        flags |= SOF_TIMESTAMPING_TX_SOFTWARE | SOF_TIMESTAMPING_OPT_TSONLY;
+    }
+    setsockopt(sockfd, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags));
+#else
+    (void)sockfd;
+    (void)transmit;
+#endif
+}
+
+/**
+ * @brief Current wall-clock time, on the same clock as kernel software timestamps.
+ * 
+ * @return int64_t Microseconds since the epoch.
+ */
+int64_t now_us() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+/**
+ * @brief Sends one datagram and returns when it left the host.
+ * 
+ * @param sockfd The socket file descriptor.
+ * @param buffer The datagram.
+ * @param length The datagram length.
+ * @param peer The destination address.
+ * @return int64_t The kernel TX timestamp in microseconds, or now_us() if none is available yet.
+ */
+int64_t send_datagram(int sockfd, const void* buffer, size_t length, const sockaddr_in& peer) {
+    int64_t beforeUs = now_us();
+    sendto(sockfd, (const char*)buffer, length, 0, (const struct sockaddr*)&peer, sizeof(peer));
+    int64_t kernelUs = read_tx_timestamp(sockfd);
+    return kernelUs >= beforeUs ? kernelUs : now_us();
+}
+
+/**
+ * @brief Adds a round-trip sample and updates SRTT/RTTVAR as in RFC 6298.
+ * 
+ * @param rttUs The measured round trip in microseconds.
+ */
+void RttEstimator::add_sample(int64_t rttUs) {
+    if (!hasSample_) {
+        srttUs_ = rttUs;
+        rttvarUs_ = rttUs / 2;
+        hasSample_ = true;
+    } else {
+        rttvarUs_ = (3 * rttvarUs_ + std::llabs(srttUs_ - rttUs)) / 4;
+        srttUs_ = (7 * srttUs_ + rttUs) / 8;
+    }
+    backoff_ = 1;
+}
+
+/**
+ * @brief Current retransmission timeout.
+ * @details The estimate is floored at MIN_RTO before it is backed off, so backoff grows
+ * the timeout even when round trips are far below a millisecond.
+ * 
+ * @return int The timeout in milliseconds, within [MIN_RTO, MAX_RTO].
+ */
+int RttEstimator::timeout_ms() const {
+    int64_t rtoMs = hasSample_ ? std::max<int64_t>((srttUs_ + 4 * rttvarUs_) / 1000, MIN_RTO) : ACK_TIMEOUT;
+    return static_cast<int>(std::min<int64_t>(rtoMs * backoff_, MAX_RTO));
+}
+
+/**
+ * @brief Doubles the retransmission timeout after a timeout.
+ */
+void RttEstimator::backoff() {
+    if (backoff_ < MAX_RTO / MIN_RTO) {
+        backoff_ *= 2;
+    }
+}
+
+/**
+ * @brief Opens a file and starts reading it.
+ * 
+ * @param path The file to send.
+ * @param offset First byte to send.
+ * @param length Number of bytes to send.
+ * @param options The negotiated transfer options (block size and cipher).
+ * @param key The AES encryption key.
+ * @param iv The AES initialization vector.
+ * @param io Optional executor for the reads.
+ */
+ReadAhead::ReadAhead(const std::string& path, uint64_t offset, uint64_t length, const TransferOptions& options,
+                     const std::string& key, const std::string& iv, IoExecutor io)
+    : ReadAhead(std::fopen(path.c_str(), "rb"), offset, length, options, key, iv, std::move(io)) {}
+
+/**
+ * @brief Takes over a file opened by the caller and starts reading it.
+ * 
+ * @param file The open file to send; it is closed with this object (null reports is_open() false).
+ * @param offset First byte to send.
+ * @param length Number of bytes to send.
+ * @param options The negotiated transfer options (block size and cipher).
+ * @param key The AES encryption key.
+ * @param iv The AES initialization vector.
+ * @param io Optional executor for the reads.
+ */
+ReadAhead::ReadAhead(std::FILE* file, uint64_t offset, uint64_t length, const TransferOptions& options,
+                     const std::string& key, const std::string& iv, IoExecutor io)
+    : file_(file), offset_(offset), length_(length), options_(options), key_(key), iv_(iv),
+      capacity_(2 * std::max<size_t>(READ_AHEAD_SIZE / options.blockSize, options.windowSize)), io_(std::move(io)) {
+    if (!file_) {
+        failed_ = true;
+        done_ = true;
+        return;
+    }
+    start();
+}
+
+/**
+ * @brief Takes over a file opened by the caller and follows it.
+ * @details The inotify watch is placed through /proc/self/fd, on the open file itself
+ * rather than on whatever its path names by now.
+ * 
+ * @param file The open file to follow; it is closed with this object (null reports is_open() false).
+ * @param offset First byte to send.
+ * @param options The negotiated transfer options (block size and cipher).
+ * @param key The AES encryption key.
+ * @param iv The AES initialization vector.
+ */
+ReadAhead::ReadAhead(std::FILE* file, uint64_t offset, const TransferOptions& options, const std::string& key, const std::string& iv,
+                     FollowSuccessor successor)
+    : file_(file), offset_(offset), length_(UNKNOWN_SIZE), options_(options), key_(key), iv_(iv),
+      capacity_(2 * std::max<size_t>(READ_AHEAD_SIZE / options.blockSize, options.windowSize)), follow_(true),
+      successor_(std::move(successor)) {
+    if (!file_) {
+        failed_ = true;
+        done_ = true;
+        return;
+    }
+    watch_followed();
+    start();
+}
+
+/**
+ * @brief Watches the followed file for appends, replacing any earlier watch.
+ * @details Without a watch, wait_for_change() falls back to polling the file.
+ */
+void ReadAhead::watch_followed() {
+#ifdef __linux__
+    if (inotify_ >= 0) {
+        close(inotify_);
+    }
+    std::string self = "/proc/self/fd/" + std::to_string(fileno(file_));
+    inotify_ = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (inotify_ >= 0 && inotify_add_watch(inotify_, self.c_str(), IN_MODIFY | IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF) < 0) {
+        close(inotify_);
+        inotify_ = -1;
+    }
+#endif
+}
+
+/**
+ * @brief Asks the successor whether the followed file goes on, switching to the file it returns.
+ * @details The new file is read from the position reached in the old one.
+ * 
+ * @return bool False if the follow ends.
+ */
+bool ReadAhead::follow_successor() {
+#ifdef _WIN32
+    int64_t position = _ftelli64(file_);
+#else
+    int64_t position = ftello(file_);
+#endif
+    std::FILE* next = position < 0 ? nullptr : successor_(file_, static_cast<uint64_t>(position));
+    if (!next || next == file_) {
+        return next != nullptr;
+    }
+    std::fclose(file_);
+    file_ = next;
+    std::setvbuf(file_, nullptr, _IONBF, 0);
+#ifdef _WIN32
+    bool positioned = _fseeki64(file_, position, SEEK_SET) == 0;
+#else
+    bool positioned = fseeko(file_, static_cast<off_t>(position), SEEK_SET) == 0;
+#endif
+    watch_followed();
+    return positioned;
+}
+
+/**
+ * @brief Starts reading the plaintext a reader produces.
+ * 
+ * @param reader Produces the bytes from its current position; it must outlive this object.
+ * @param length Number of bytes to send.
+ * @param options The negotiated transfer options (block size and cipher).
+ * @param key The AES encryption key.
+ * @param iv The AES initialization vector.
+ * @param io Optional executor for the reader's calls.
+ */
+ReadAhead::ReadAhead(BlockReader reader, uint64_t length, const TransferOptions& options, const std::string& key,
+                     const std::string& iv, IoExecutor io)
+    : reader_(std::move(reader)), offset_(0), length_(length), options_(options), key_(key), iv_(iv),
+      capacity_(2 * std::max<size_t>(READ_AHEAD_SIZE / options.blockSize, options.windowSize)), io_(std::move(io)) {
+    worker_ = std::thread(&ReadAhead::run, this);
+}
+
+/**
+ * @brief Positions an opened file at the offset and starts the worker.
+ */
+void ReadAhead::start() {
+    std::setvbuf(file_, nullptr, _IONBF, 0); // Reads are already large; skip the stdio copy
+#ifdef _WIN32
+    bool positioned = _fseeki64(file_, static_cast<__int64>(offset_), SEEK_SET) == 0;
+#else
+    bool positioned = fseeko(file_, static_cast<off_t>(offset_), SEEK_SET) == 0;
+#endif
+#ifdef __linux__
+    off_t advised = length_ == UNKNOWN_SIZE ? 0 : static_cast<off_t>(length_);
+    posix_fadvise(fileno(file_), static_cast<off_t>(offset_), advised, POSIX_FADV_SEQUENTIAL);
+#endif
+    if (!positioned) {
+        failed_ = true;
+        done_ = true;
+        return;
+    }
+    worker_ = std::thread(&ReadAhead::run, this);
+}
+
+/**
+ * @brief Starts reading a stream of unknown length up to its end.
+ * 
+ * @param stream The stream to send (e.g. stdin); it is not closed.
+ * @param options The negotiated transfer options (block size and cipher).
+ * @param key The AES encryption key.
+ * @param iv The AES initialization vector.
+ */
+ReadAhead::ReadAhead(std::FILE* stream, const TransferOptions& options, const std::string& key, const std::string& iv)
+    : file_(stream), offset_(0), length_(UNKNOWN_SIZE), options_(options), key_(key), iv_(iv),
+      capacity_(2 * std::max<size_t>(READ_AHEAD_SIZE / options.blockSize, options.windowSize)), stream_(true) {
+    worker_ = std::thread(&ReadAhead::run, this);
+}
+
+/**
+ * @brief Stops and joins the worker, and closes the file (not a stream).
+ */
+ReadAhead::~ReadAhead() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+    }
+    drained_.notify_all();
+    if (worker_.joinable()) {
+        worker_.join();
+    }
+    if (file_ && !stream_) {
+        std::fclose(file_);
+    }
+#ifdef __linux__
+    if (inotify_ >= 0) {
+        close(inotify_);
+    }
+#endif
+}
+
+/**
+ * @brief Reports whether a read failed.
+ * 
+ * @return True if a read failed before the requested length was read.
+ */
+bool ReadAhead::failed() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return failed_;
+}
+
+/**
+ * @brief Takes the next prepared block.
+ * 
+ * @param block Receives the block (an empty one past the end).
+ * @param timeoutMs How long to wait for the worker.
+ * @return true If a block was taken.
+ * @return false If none was ready in time.
+ */
+bool ReadAhead::next(BlockPayload& block, int timeoutMs) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (!ready_.wait_for(lock, std::chrono::milliseconds(timeoutMs), [this] { return done_ || !ring_.empty(); })) {
+        return false;
+    }
+    if (ring_.empty()) {
+        lock.unlock();
+        block = BlockPayload();
+        block.bytes = encrypt_payload({}, options_, key_, iv_);
+        return true;
+    }
+    block = std::move(ring_.front());
+    ring_.pop_front();
+    bool roomForRead = ring_.size() == capacity_ / 2; // Wake the worker once per read, not per block
+    lock.unlock();
+    if (roomForRead) {
+        drained_.notify_one();
+    }
+    return true;
+}
+
+/**
+ * @brief Finds the hole (if any) that starts at a position of the file.
+ * @details Uses SEEK_DATA/SEEK_HOLE where the platform has them; elsewhere the file is
+ * treated as one data extent and zero blocks are only found by scanning.
+ * 
+ * @param position Absolute file position.
+ * @param dataEnd Receives where the data starting at the returned position ends.
+ * @return uint64_t Where the next data starts (the file size if only a hole follows).
+ */
+uint64_t ReadAhead::skip_hole(uint64_t position, uint64_t& dataEnd) const {
+    dataEnd = UINT64_MAX;
+#if defined(SEEK_DATA) && defined(SEEK_HOLE)
+    int fd = fileno(file_);
+    off_t dataStart = lseek(fd, static_cast<off_t>(position), SEEK_DATA);
+    if (dataStart < 0) {
+        // ENXIO: nothing but a hole up to the end of the file. Anything else: no hole support.
+        off_t end = errno == ENXIO ? lseek(fd, 0, SEEK_END) : -1;
+        return end >= 0 ? std::max<uint64_t>(position, static_cast<uint64_t>(end)) : position;
+    }
+    off_t holeStart = lseek(fd, dataStart, SEEK_HOLE);
+    if (holeStart >= dataStart) {
+        dataEnd = static_cast<uint64_t>(holeStart);
+    }
+    return static_cast<uint64_t>(dataStart);
+#else
+    return position;
+#endif
+}
+
+/**
+ * @brief Reads a stream into a buffer.
+ * @details Returns early with the bytes read so far once the stream has been idle for a
+ * moment and at least one whole block is buffered, so a slow producer's data still flows.
+ * 
+ * @param buffer The buffer.
+ * @param filled Bytes already in the buffer.
+ * @param capacity The size of the buffer.
+ * @param end Set at the end of the stream, on a read error, or when the object is destroyed.
+ * @param failed Set on a read error.
+ * @return size_t The bytes now in the buffer.
+ */
+size_t ReadAhead::read_stream(uint8_t* buffer, size_t filled, size_t capacity, bool& end, bool& failed) {
+#ifdef _WIN32
+    size_t got = std::fread(buffer + filled, 1, capacity - filled, file_);
+    filled += got;
+    if (filled < capacity) {
+        end = true;
+        failed = std::ferror(file_) != 0;
+    }
+    return filled;
+#else
+    constexpr int idleMs = 100;
+    int fd = fileno(file_);
+    while (filled < capacity) {
+        pollfd input = {fd, POLLIN, 0};
+        int ready = poll(&input, 1, idleMs);
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (stopping_) {
+                end = true;
+                return filled;
+            }
+        }
+        if (ready == 0 || (ready < 0 && errno == EINTR)) {
+            if (ready == 0 && filled >= options_.blockSize) {
+                return filled;
+            }
+            continue;
+        }
+
+        ssize_t got = read(fd, buffer + filled, capacity - filled);
+        if (got < 0 && (errno == EINTR || errno == EAGAIN)) {
+            continue;
+        }
+        if (got <= 0) {
+            end = true;
+            failed = got < 0;
+            return filled;
+        }
+        filled += static_cast<size_t>(got);
+    }
+    return filled;
+#endif
+}
+
+/**
+ * @brief Reads a followed file, waiting for appends at its end.
+ * @details Appends are gathered until the buffer is full or FOLLOW_BATCH_MS have passed
+ * since the first of them, so a trickle of small writes still goes out in whole blocks.
+ * A deleted or moved file is read to its end once more; a truncated one ends at once.
+ * 
+ * @param buffer The buffer.
+ * @param capacity The size of the buffer.
+ * @param end Set when the file is gone or truncated, on a read error, or when the object is destroyed.
+ * @param failed Set on a read error.
+ * @return size_t The bytes read.
+ */
+size_t ReadAhead::read_appends(uint8_t* buffer, size_t capacity, bool& end, bool& failed) {
+    size_t filled = 0;
+    std::chrono::steady_clock::time_point batchStart;
+
+    while (filled < capacity) {
+        filled += std::fread(buffer + filled, 1, capacity - filled, file_);
+        if (filled == capacity) {
+            break;
+        }
+        if (std::ferror(file_)) {
+            end = failed = true;
+            return filled;
+        }
+        std::clearerr(file_); // At the end for now; later reads see what is appended
+
+        int waitMs = FOLLOW_BATCH_MS;
+        if (filled > 0) {
+            auto now = std::chrono::steady_clock::now();
+            if (batchStart == std::chrono::steady_clock::time_point()) {
+                batchStart = now;
+            }
+            waitMs -= static_cast<int>(std::chrono::duration_cast<std::chrono::milliseconds>(now - batchStart).count());
+            if (waitMs <= 0) {
+                break;
+            }
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (stopping_) {
+                end = true;
+                return filled;
+            }
+        }
+#ifndef _WIN32
+        struct stat status;
+        off_t position = ftello(file_);
+        if (fstat(fileno(file_), &status) == 0 && position >= 0 && status.st_size < position) {
+            end = true; // Truncated (e.g. rotated by copytruncate): what follows is not an append
+            return filled;
+        }
+#endif
+        int change = wait_for_change(waitMs);
+        if (change <= 0 && successor_) { // Moved away, deleted or idle: a newer version may go on with it
+            change = follow_successor() ? 1 : -1;
+        }
+        if (change < 0) {
+            filled += std::fread(buffer + filled, 1, capacity - filled, file_);
+            end = true;
+            failed = std::ferror(file_) != 0;
+            return filled;
+        }
+    }
+    return filled;
+}
+
+/**
+ * @brief Waits for a followed file to change.
+ * @details Uses the inotify watch where there is one; otherwise sleeps and lets the
+ * caller poll the file.
+ * 
+ * @param timeoutMs How long to wait.
+ * @return int 1 if it may have changed, 0 on timeout (or after waiting without a watch), -1 if it was deleted or moved away.
+ */
+int ReadAhead::wait_for_change(int timeoutMs) {
+    bool gone = false;
+    int changed = 1;
+#ifdef __linux__
+    if (inotify_ >= 0) {
+        pollfd watch = {inotify_, POLLIN, 0};
+        if (poll(&watch, 1, timeoutMs) <= 0) {
+            return 0;
+        }
+        alignas(inotify_event) char events[4096];
+        ssize_t got = read(inotify_, events, sizeof(events));
+        for (ssize_t at = 0; at + static_cast<ssize_t>(sizeof(inotify_event)) <= got;) {
+            const inotify_event* event = reinterpret_cast<const inotify_event*>(events + at);
+            gone = gone || (event->mask & (IN_MOVE_SELF | IN_DELETE_SELF | IN_IGNORED)) != 0;
+            at += static_cast<ssize_t>(sizeof(inotify_event) + event->len);
+        }
+    } else
+#endif
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(timeoutMs));
+        changed = 0; // The caller polls the file
+    }
+#ifndef _WIN32
+    struct stat status;
+    gone = gone || (fstat(fileno(file_), &status) == 0 && status.st_nlink == 0); // Unlinked (IN_ATTRIB)
+#endif
+    return gone ? -1 : changed;
+}
+
+/**
+ * @brief Reads the file in READ_AHEAD_SIZE pieces and queues their encrypted blocks.
+ * @details With zero runs negotiated, whole blocks inside a hole become one run without
+ * being read, reads stop at the next hole (rounded up to a whole block, so blocks stay
+ * aligned to the transfer), and all-zero blocks that were read are merged into runs.
+ * With an IoExecutor, the file reads run there (e.g. on the server's per-drive I/O pool).
+ * A stream is read as it comes; only whole blocks are queued until it ends. A followed
+ * file is queued batch by batch, its short blocks marked partial so the sender goes on.
+ */
+void ReadAhead::run() {
+    const size_t blockSize = options_.blockSize;
+    std::vector<uint8_t> buffer(std::max(READ_AHEAD_SIZE / blockSize, size_t(1)) * blockSize);
+    uint64_t done = 0;
+    size_t carried = 0; // Stream bytes short of a whole block, kept for the next read
+    bool failed = false;
+    bool end = false;
+
+    while (!end && done < length_) {
+        std::vector<BlockPayload> blocks;
+        size_t got = 0;
+
+        if (follow_) {
+            got = read_appends(buffer.data(), buffer.size(), end, failed);
+        } else if (stream_) {
+            size_t filled = read_stream(buffer.data(), carried, buffer.size(), end, failed);
+            got = end ? filled : filled - filled % blockSize;
+            carried = filled - got;
+        } else {
+            uint64_t position = offset_ + done;
+            uint64_t remaining = length_ - done;
+            size_t wanted = static_cast<size_t>(std::min<uint64_t>(buffer.size(), remaining));
+
+            if (options_.zeroRuns && file_) {
+                uint64_t dataEnd = 0;
+                uint64_t hole = std::min(skip_hole(position, dataEnd) - position, remaining);
+                if (hole < remaining) {
+                    hole -= hole % blockSize;
+                }
+                if (dataEnd != UINT64_MAX && dataEnd > position) {
+                    uint64_t extent = (dataEnd - position + blockSize - 1) / blockSize * blockSize;
+                    wanted = static_cast<size_t>(std::min<uint64_t>(wanted, extent));
+                }
+                if (hole > 0) {
+                    BlockPayload run;
+                    run.plainSize = hole;
+                    run.zeroRun = true;
+                    blocks.push_back(std::move(run));
+                    done += hole;
+                    wanted = 0;
+                }
+#ifdef _WIN32
+                failed = _fseeki64(file_, static_cast<__int64>(position), SEEK_SET) != 0; // Probing moved the file position
+#else
+                failed = fseeko(file_, static_cast<off_t>(position), SEEK_SET) != 0; // Probing moved the file position
+#endif
+                if (failed) {
+                    break;
+                }
+            }
+
+            if (wanted > 0) {
+                auto read = [&] { got = reader_ ? reader_(buffer.data(), wanted) : std::fread(buffer.data(), 1, wanted, file_); };
+                io_ ? io_(read) : read();
+            }
+            if (got < wanted) {
+                failed = reader_ || std::ferror(file_) != 0;
+                end = true; // Shorter than announced: the final block comes out short
+            }
+        }
+        done += got;
+
+        // Encrypt the whole read, then hand it over in one step.
+        for (size_t at = 0; at < got; at += blockSize) {
+            size_t plainSize = std::min(blockSize, got - at);
+            if (options_.zeroRuns && is_all_zero(buffer.data() + at, plainSize)) {
+                if (blocks.empty() || !blocks.back().zeroRun) {
+                    blocks.emplace_back();
+                    blocks.back().zeroRun = true;
+                }
+                blocks.back().plainSize += plainSize;
+                continue;
+            }
+            blocks.emplace_back();
+            blocks.back().plainSize = plainSize;
+            blocks.back().partial = follow_ && !end && plainSize < blockSize;
+            blocks.back().bytes = encrypt_payload(
+                std::vector<uint8_t>(buffer.begin() + at, buffer.begin() + at + plainSize), options_, key_, iv_);
+        }
+        std::memmove(buffer.data(), buffer.data() + got, carried);
+
+        std::unique_lock<std::mutex> lock(mutex_);
+        drained_.wait(lock, [this] { return stopping_ || ring_.size() <= capacity_ / 2; });
+        if (stopping_) {
+            return;
+        }
+        std::move(blocks.begin(), blocks.end(), std::back_inserter(ring_));
+        lock.unlock();
+        ready_.notify_one();
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        done_ = true;
+        failed_ = failed;
+    }
+    ready_.notify_one();
+}
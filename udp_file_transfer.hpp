@@ -13,6 +13,11 @@
 #include <mutex>
 #include <chrono>
 #include <cstring>
+#include <functional>
+#include <array>
+#include <deque>
+#include <cstdio>
+#include <condition_variable>
 #include <openssl/evp.h>
 #include <openssl/rand.h>
 
@@ -32,55 +37,475 @@ constexpr size_t PACKET_SIZE = 512;
 /// Acknowledgment timeout in milliseconds.
 constexpr int ACK_TIMEOUT = 1000;
 
+/// Lower bound of the adaptive retransmission timeout in milliseconds.
+constexpr int MIN_RTO = 20;
+
+/// Upper bound of the adaptive retransmission timeout in milliseconds (RFC 6298 allows 60 s or more).
+constexpr int MAX_RTO = 60 * 1000;
+
+/// Number of consecutive timeouts after which a transfer is abandoned; a sender counts
+/// only those of at least ACK_TIMEOUT, so a fast path's short timeouts back off first.
+constexpr int MAX_RETRIES = 3;
+
+/// Silence after which a receiver gives up, in milliseconds. A sender's backed-off
+/// retransmissions are less than 2 << (MAX_RETRIES - 1) timeouts of ACK_TIMEOUT apart
+/// before it gives up; the receiver waits twice that.
+constexpr int RECEIVE_TIMEOUT = (2 << MAX_RETRIES) * ACK_TIMEOUT;
+
 /// AES key and IV sizes.
 constexpr size_t AES_KEY_SIZE = 32; ///< 256-bit key
 constexpr size_t AES_IV_SIZE = 16; ///< 128-bit IV
 
+/// Plaintext bytes carried per data block (leaves room for the AES-CBC padding block).
+constexpr size_t CHUNK_SIZE = PACKET_SIZE - AES_IV_SIZE;
+
+/// Smallest block size a peer may negotiate.
+constexpr size_t MIN_BLOCK_SIZE = 64;
+
+/// Largest number of unacknowledged DATA blocks a peer may negotiate.
+constexpr uint32_t MAX_WINDOW_SIZE = 64;
+
+/// Capacity of the TLV options block carried by requests and OACK responses.
+constexpr size_t OPTIONS_SIZE = 64;
+
+/// Bytes of file content covered by one Merkle tree leaf.
+constexpr size_t MERKLE_CHUNK_SIZE = 64 * 1024;
+
+/// Size of a SHA-256 digest.
+constexpr size_t HASH_SIZE = 32;
+
+/// Block size used to find matching runs when delta-encoding a file against another.
+constexpr size_t DELTA_BLOCK_SIZE = 512;
+
+/// Bounds for automatically sized socket buffers, in bytes.
+constexpr size_t MIN_SOCKET_BUFFER = 64 * 1024;
+constexpr size_t MAX_SOCKET_BUFFER = 16 * 1024 * 1024;
+
+/// Receive buffer of the listening socket, sized for bursts of new requests.
+constexpr size_t LISTEN_SOCKET_BUFFER = 4 * 1024 * 1024;
+
+/// Kernel accounting overhead per queued datagram (skb), in bytes.
+constexpr size_t DATAGRAM_OVERHEAD = 1024;
+
+/// Bytes an upload reads from disk at a time, ahead of the sender.
+constexpr size_t READ_AHEAD_SIZE = 1024 * 1024;
+
+/// WRQ file size of a stream, whose length is only known when its final block is sent.
+constexpr uint64_t UNKNOWN_SIZE = UINT64_MAX;
+
+/// How long a followed file's appends are gathered into blocks before a partial block is sent.
+constexpr int FOLLOW_BATCH_MS = 200;
+
 /// Enumeration of operation codes for client-server communication.
 enum OperationCode {
     RRQ = 1, ///< Read Request (Download a file)
     WRQ,     ///< Write Request (Upload a file)
     DEL,     ///< Delete Request (Remove a file)
     ACK,     ///< Acknowledgment Packet
-    ERROR_PACKET ///< Error Packet
+    ERROR_PACKET, ///< Error Packet
+    DATA,    ///< Data block of an RRQ/WRQ session
+    OACK,    ///< Option Acknowledgment (accepted transfer options)
+    HASHQ,   ///< Hash Query (Merkle leaf hashes of a file, starting at blockNumber)
+    COPY,    ///< Copy Request (new version of the name in data, same content as filename)
+    RENAME,  ///< Rename Request (every version of filename moves to the name in data)
+    RESTORE, ///< Restore Request (version suffix in data becomes the latest version of filename)
+    APPEND   ///< Append Request (DATA blocks extend the latest version of filename into a new one)
+};
+
+/// Option types of the TLV options block (1-byte type, 1-byte length, big-endian value).
+enum OptionType : uint8_t {
+    OPT_BLOCK_SIZE = 1, ///< Plaintext bytes per DATA block
+    OPT_WINDOW_SIZE,    ///< DATA blocks in flight before an ACK is required
+    OPT_CIPHER,         ///< Payload cipher suite (see CipherSuite)
+    OPT_COMPRESSION,    ///< Payload compression (see Compression)
+    OPT_FEC_RATIO,      ///< Repair blocks per 100 DATA blocks
+    OPT_CHECKSUM,       ///< Checksum algorithm (see ChecksumAlgorithm)
+    OPT_RANGE_OFFSET,   ///< RRQ: first byte of the requested range
+    OPT_RANGE_LENGTH,   ///< RRQ: length of the requested range (0 = to the end of the file)
+    OPT_RESUME,         ///< WRQ: the client can continue an interrupted upload
+    OPT_ZERO_RUNS,      ///< Runs of zero bytes may be sent as FLAG_ZERO_RUN descriptors
+    OPT_FOLLOW          ///< RRQ: after the end of the file, keep sending what is appended to it
+};
+
+/// Payload cipher suites.
+enum CipherSuite : uint8_t {
+    CIPHER_NONE = 0,        ///< Payload sent in the clear
+    CIPHER_AES_256_CBC = 1  ///< AES-256-CBC with the session key and IV
+};
+
+/// Payload compression algorithms.
+enum Compression : uint8_t {
+    COMPRESSION_NONE = 0 ///< No compression
+};
+
+/// Packet checksum algorithms.
+enum ChecksumAlgorithm : uint8_t {
+    CHECKSUM_SUM32 = 0, ///< 32-bit byte sum
+    CHECKSUM_CRC32 = 1  ///< CRC-32 (IEEE 802.3)
+};
+
+/**
+ * @class TransferOptions
+ * @brief Parameters a session agrees on in its first round trip.
+ * @details The defaults are what a peer that sends no options gets.
+ */
+struct TransferOptions {
+    uint32_t blockSize = CHUNK_SIZE;        ///< Plaintext bytes per DATA block
+    uint32_t windowSize = 1;                ///< DATA blocks in flight
+    uint8_t cipher = CIPHER_AES_256_CBC;    ///< CipherSuite
+    uint8_t compression = COMPRESSION_NONE; ///< Compression
+    uint8_t fecRatio = 0;                   ///< Repair blocks per 100 DATA blocks
+    uint8_t checksum = CHECKSUM_SUM32;      ///< ChecksumAlgorithm
+    uint64_t rangeOffset = 0;               ///< RRQ range start
+    uint64_t rangeLength = 0;               ///< RRQ range length (0 = to the end)
+    uint8_t resume = 0;                     ///< WRQ: 1 if resuming is supported; the OACK's rangeOffset is then where DATA starts
+    uint8_t zeroRuns = 0;                   ///< 1 if the sender may replace zero blocks with FLAG_ZERO_RUN descriptors
+    uint8_t follow = 0;                     ///< RRQ: 1 to follow the file as it grows (like tail -f)
+};
+
+/// SHA-256 digest.
+using Hash = std::array<uint8_t, HASH_SIZE>;
+
+/// Bit flags carried in Packet::flags.
+enum PacketFlags : uint32_t {
+    FLAG_LAST_BLOCK = 1u << 0,     ///< Final data block of a transfer
+    FLAG_CONTENT_EXISTS = 1u << 1, ///< WRQ response: content already stored, no DATA follows
+    FLAG_ZERO_RUN = 1u << 2        ///< DATA without payload standing for runLength zero bytes
+};
+
+/// Error codes carried in TFTPErrorPacket::errorCode (numbered as in TFTP, RFC 1350).
+enum ErrorCode {
+    ERR_NOT_DEFINED = 0,       ///< Not defined, see the error message
+    ERR_FILE_NOT_FOUND,        ///< File not found
+    ERR_ACCESS_VIOLATION,      ///< Permission denied
+    ERR_DISK_FULL,             ///< Disk full or allocation exceeded
+    ERR_ILLEGAL_OPERATION,     ///< Unknown or malformed operation
+    ERR_UNKNOWN_TRANSFER,      ///< Packet does not belong to the session
+    ERR_FILE_EXISTS            ///< File already exists
 };
 
 /**
  * @class Packet
  * @brief Represents a packet used in the UDP File Transfer System.
+ * @details Never sent as it lies in memory: encode_packet() and decode_packet() convert it
+ * to and from WIRE_PACKET_SIZE bytes, every field at a fixed offset in declaration order,
+ * integers big-endian, so peers of any compiler, ABI or byte order understand each other.
  */
 struct Packet {
     int operationID;           ///< Operation code (e.g., RRQ, WRQ, DEL, ACK, ERROR_PACKET)
     char filename[256];        ///< File name to operate on
     uint8_t data[PACKET_SIZE]; ///< Data payload (for WRQ or RRQ responses)
     uint32_t checksum;         ///< Checksum for integrity verification
-    size_t dataSize;           ///< Size of valid data in the packet
+    uint32_t dataSize;         ///< Size of valid data in the packet
+    uint64_t blockNumber;      ///< DATA sequence number (1-based, never wraps), or the block acknowledged by an ACK
+    uint32_t flags;            ///< Bitwise OR of PacketFlags
+    uint64_t fileSize;         ///< Total file size (WRQ request and RRQ response), leaf count in a HASHQ reply
+    uint16_t optionsLength;    ///< Valid bytes in options (0 = use defaults)
+    uint8_t options[OPTIONS_SIZE]; ///< TLV options block (requests and OACK)
+    uint32_t processingUs;     ///< ACK/OACK: time the sender of this reply held the packet it answers
+    uint8_t digest[HASH_SIZE]; ///< Merkle root of the file: RRQ response, or WRQ content to upload (all zero if unknown)
+    uint64_t offset;           ///< DATA: byte offset of the block in the transfer
+    uint64_t runLength;        ///< DATA with FLAG_ZERO_RUN: number of zero bytes the block stands for
+    uint32_t timeoutMs;        ///< DATA: the sender's retransmission timeout when it sent the block
 };
 
+/// Bytes of an encoded Packet: the fields back to back without padding.
+constexpr size_t WIRE_PACKET_SIZE = 4 + sizeof(Packet::filename) + sizeof(Packet::data) + 4 + 4 + 8 + 4 + 8 + 2 +
+                                    sizeof(Packet::options) + 4 + sizeof(Packet::digest) + 8 + 8 + 4;
+static_assert(WIRE_PACKET_SIZE == 922, "the wire format changed: update encode_packet() and decode_packet()");
+static_assert(WIRE_PACKET_SIZE != AES_KEY_SIZE && WIRE_PACKET_SIZE != AES_IV_SIZE,
+              "key and IV datagrams are told from packets by their size");
+
 /**
  * @class TFTPErrorPacket
  * @brief Represents an error packet used in the UDP File Transfer System.
+ * @details Only the header (operation and error code, 4 bytes each, big-endian) and the
+ * NUL-terminated message are sent, so the datagram is as short as the message allows.
  */
 struct TFTPErrorPacket {
-    int operationID;         ///< Operation code (ERROR)
-    int errorCode;           ///< Error code
-    char errorMessage[512];  ///< Error message
+    int operationID;         ///< Operation code (ERROR_PACKET)
+    int errorCode;           ///< Error code (see ErrorCode)
+    char errorMessage[128];  ///< Error message
+};
+
+/**
+ * @class TransferStats
+ * @brief Counters collected while a transfer runs.
+ * @details Retransmissions count every loss the sender noticed; kernel drops are the
+ * part of it that happened in the local receive buffer rather than on the path.
+ */
+struct TransferStats {
+    uint32_t retransmissions = 0; ///< DATA blocks resent after a timeout
+    uint32_t kernelDrops = 0;     ///< Socket receive-queue drops (SO_RXQ_OVFL counter)
+    uint32_t rttSamples = 0;      ///< Round trips measured
+    uint64_t networkUs = 0;       ///< Sum of measured round trips minus peer processing
+    uint64_t processingUs = 0;    ///< Sum of peer processing time reported in ACKs
+};
+
+/**
+ * @class RttEstimator
+ * @brief Smoothed round-trip time and retransmission timeout (RFC 6298).
+ * @details Fed with kernel timestamps, so samples exclude local scheduling delays.
+ */
+class RttEstimator {
+public:
+    /**
+     * @brief Adds a round-trip sample (only for packets that were not retransmitted).
+     * @param rttUs The measured round trip in microseconds.
+     */
+    void add_sample(int64_t rttUs);
+
+    /**
+     * @brief Current retransmission timeout.
+     * @return The timeout in milliseconds, ACK_TIMEOUT until the first sample, backed off up to MAX_RTO.
+     */
+    int timeout_ms() const;
+
+    /**
+     * @brief Doubles the retransmission timeout after a timeout (Karn's backoff).
+     */
+    void backoff();
+
+private:
+    int64_t srttUs_ = 0;   ///< Smoothed RTT
+    int64_t rttvarUs_ = 0; ///< RTT variation
+    int backoff_ = 1;      ///< Backoff multiplier since the last sample
+    bool hasSample_ = false;
 };
 
+/**
+ * @class BlockPayload
+ * @brief One DATA block ready to be sent.
+ */
+struct BlockPayload {
+    std::vector<uint8_t> bytes; ///< Encrypted payload (empty for a zero run)
+    uint64_t plainSize = 0;     ///< Plaintext bytes the block stands for
+    bool zeroRun = false;       ///< plainSize zero bytes, sent as a FLAG_ZERO_RUN descriptor
+    bool partial = false;       ///< Shorter than a block without ending the transfer (followed file)
+};
+
+/// Runs a file operation to completion, e.g. on an I/O pool; returns once it has run.
+using IoExecutor = std::function<void(const std::function<void()>& job)>;
+
+/// Fills a buffer with the next plaintext bytes of a transfer and returns how many were read.
+using BlockReader = std::function<size_t(uint8_t* buffer, size_t capacity)>;
+
+/// Given a followed file that was moved away, deleted or idle, and how far it has been read,
+/// returns that file to go on with it, another open file holding the same bytes up to there
+/// to go on with that one instead, or null to end the follow.
+using FollowSuccessor = std::function<std::FILE*(std::FILE* file, uint64_t position)>;
+
+/**
+ * @class ReadAhead
+ * @brief Reads a file ahead of its sender and prepares the DATA payloads on a background thread.
+ * @details The worker reads READ_AHEAD_SIZE bytes at a time (the kernel is told the access
+ * is sequential), cuts them into blocks and encrypts them into a ring that holds two reads'
+ * worth of blocks: one being sent while the next is read, so disk latency overlaps the
+ * network instead of adding to every block. If the options allow zero runs, holes are
+ * found with SEEK_DATA/SEEK_HOLE and skipped without being read, and all-zero blocks are
+ * coalesced into runs. A stream (a pipe) is read the same way up to its end, so memory
+ * stays bounded by the ring whatever its length. A followed file is read like a stream
+ * that ends only when the file is deleted, moved away or truncated (or as a FollowSuccessor
+ * decides): at its end the worker waits for appends (inotify on Linux) and gathers them for
+ * up to FOLLOW_BATCH_MS.
+ */
+class ReadAhead {
+public:
+    /**
+     * @brief Opens a file and starts reading it.
+     * @param path The file to send.
+     * @param offset First byte to send.
+     * @param length Number of bytes to send.
+     * @param options The negotiated transfer options (block size and cipher).
+     * @param key The AES encryption key.
+     * @param iv The AES initialization vector.
+     * @param io Optional executor for the reads.
+     */
+    ReadAhead(const std::string& path, uint64_t offset, uint64_t length, const TransferOptions& options,
+              const std::string& key, const std::string& iv, IoExecutor io = nullptr);
+
+    /**
+     * @brief Starts reading a stream of unknown length (e.g. stdin) up to its end.
+     * @param stream The stream to send; it is not closed.
+     * @param options The negotiated transfer options (block size and cipher).
+     * @param key The AES encryption key.
+     * @param iv The AES initialization vector.
+     */
+    ReadAhead(std::FILE* stream, const TransferOptions& options, const std::string& key, const std::string& iv);
+
+    /**
+     * @brief Takes over a file opened by the caller (e.g. under a lock) and starts reading it.
+     * @param file The open file to send; it is closed with this object.
+     * @param offset First byte to send.
+     * @param length Number of bytes to send.
+     * @param options The negotiated transfer options (block size and cipher).
+     * @param key The AES encryption key.
+     * @param iv The AES initialization vector.
+     * @param io Optional executor for the reads.
+     */
+    ReadAhead(std::FILE* file, uint64_t offset, uint64_t length, const TransferOptions& options,
+              const std::string& key, const std::string& iv, IoExecutor io);
+
+    /**
+     * @brief Takes over a file opened by the caller (e.g. under a lock) and follows it.
+     * @details Sends the file from the offset on, then whatever is appended to it, until it
+     * is deleted, moved away or truncated. Nothing is looked up by path again, so the file
+     * can be renamed or evicted once it is open. With a successor, the follow goes on as the
+     * successor decides instead (e.g. into the version an append made).
+     * @param file The open file to follow; it is closed with this object.
+     * @param offset First byte to send.
+     * @param options The negotiated transfer options (block size and cipher).
+     * @param key The AES encryption key.
+     * @param iv The AES initialization vector.
+     * @param successor Optional: asked whenever the file is moved away, deleted or idle.
+     */
+    ReadAhead(std::FILE* file, uint64_t offset, const TransferOptions& options, const std::string& key, const std::string& iv,
+              FollowSuccessor successor = nullptr);
+
+    /**
+     * @brief Starts reading the plaintext a reader produces (e.g. a decompressor), from its current position.
+     * @param reader Produces the bytes; it must stay valid for the life of this object.
+     * @param length Number of bytes to send (fewer from the reader is a failure).
+     * @param options The negotiated transfer options (block size and cipher).
+     * @param key The AES encryption key.
+     * @param iv The AES initialization vector.
+     * @param io Optional executor for the reader's calls.
+     */
+    ReadAhead(BlockReader reader, uint64_t length, const TransferOptions& options, const std::string& key,
+              const std::string& iv, IoExecutor io);
+
+    /// Stops and joins the worker.
+    ~ReadAhead();
+
+    ReadAhead(const ReadAhead&) = delete;
+    ReadAhead& operator=(const ReadAhead&) = delete;
+
+    /// @return True if the file could be opened.
+    bool is_open() const { return file_ != nullptr || reader_ != nullptr; }
+
+    /// @return True if a read failed before the requested length was read.
+    bool failed() const;
+
+    /**
+     * @brief Takes the next prepared block, waiting for the worker if the ring is empty.
+     * @details Past the end, yields an empty block, as a reader at EOF would.
+     * @param block Receives the block.
+     * @param timeoutMs How long to wait for the worker.
+     * @return False if no block was ready in time (a stalled stream).
+     */
+    bool next(BlockPayload& block, int timeoutMs);
+
+private:
+    /// Positions the opened file at the offset and starts the worker.
+    void start();
+
+    /// Worker: fills the ring until the length is read, a read fails, or the object is destroyed.
+    void run();
+
+    /**
+     * @brief Finds the hole (if any) that starts at a position of the file.
+     * @param position Absolute file position.
+     * @param dataEnd Receives where the data starting at position ends (the next hole).
+     * @return Where the next data starts: position itself if it is not in a hole.
+     */
+    uint64_t skip_hole(uint64_t position, uint64_t& dataEnd) const;
+
+    /**
+     * @brief Reads a stream until the buffer is full, or it ends, or it idles with whole blocks buffered.
+     * @param buffer The buffer.
+     * @param filled Bytes already in the buffer.
+     * @param capacity The size of the buffer.
+     * @param end Set at the end of the stream, on a read error, or when the object is destroyed.
+     * @param failed Set on a read error.
+     * @return The bytes now in the buffer.
+     */
+    size_t read_stream(uint8_t* buffer, size_t filled, size_t capacity, bool& end, bool& failed);
+
+    /**
+     * @brief Reads a followed file, waiting for appends at its end.
+     * @details Returns once the buffer is full, or once appends have been gathered for
+     * FOLLOW_BATCH_MS, or when the file stops being followable.
+     * @param buffer The buffer.
+     * @param capacity The size of the buffer.
+     * @param end Set when the file is gone or truncated, on a read error, or when the object is destroyed.
+     * @param failed Set on a read error.
+     * @return The bytes read.
+     */
+    size_t read_appends(uint8_t* buffer, size_t capacity, bool& end, bool& failed);
+
+    /**
+     * @brief Waits for a followed file to change.
+     * @param timeoutMs How long to wait.
+     * @return 1 if it changed, 0 on timeout (or after waiting without a watch), -1 if it was deleted or moved away.
+     */
+    int wait_for_change(int timeoutMs);
+
+    /// Watches the followed file for appends (inotify on Linux), replacing any earlier watch.
+    void watch_followed();
+
+    /**
+     * @brief Asks the successor whether the followed file goes on, switching to the file it returns.
+     * @return False if the follow ends.
+     */
+    bool follow_successor();
+
+    std::FILE* file_ = nullptr;
+    BlockReader reader_;  ///< Produces the bytes instead of file_ (no holes to probe)
+    uint64_t offset_;
+    uint64_t length_;
+    TransferOptions options_;
+    std::string key_;
+    std::string iv_;
+    size_t capacity_; ///< Blocks the ring holds
+    bool stream_ = false; ///< Reading a stream: no seeking, length unknown, not closed
+    bool follow_ = false; ///< Following a growing file
+    int inotify_ = -1;    ///< Watch on the followed file
+    FollowSuccessor successor_; ///< Decides where a followed file goes on
+    IoExecutor io_;       ///< Runs file reads (in place without one)
+
+    mutable std::mutex mutex_;
+    std::condition_variable ready_;   ///< Signalled when a block is added or the worker ends
+    std::condition_variable drained_; ///< Signalled when a block is taken or the object is destroyed
+    std::deque<BlockPayload> ring_;
+    bool done_ = false;
+    bool failed_ = false;
+    bool stopping_ = false;
+    std::thread worker_;
+};
+
+/**
+ * @brief Computes the CRC-32 (IEEE 802.3, reflected) of a byte range.
+ * @param data Pointer to the bytes.
+ * @param length Number of bytes.
+ * @return The CRC-32 value.
+ */
+uint32_t crc32(const uint8_t* data, size_t length);
+
+/**
+ * @brief Checks whether a byte range is all zero.
+ * @details Scans 16 bytes at a time with SSE2 (or NEON) where available.
+ * @param data Pointer to the bytes.
+ * @param length Number of bytes.
+ * @return True if every byte is zero.
+ */
+bool is_all_zero(const uint8_t* data, size_t length);
+
 /**
  * @brief Computes a checksum for a given data vector.
  * @param data The data vector for which the checksum is to be computed.
+ * @param algorithm The ChecksumAlgorithm to use.
  * @return The computed checksum as a 32-bit unsigned integer.
  */
-uint32_t calculate_checksum(const std::vector<uint8_t>& data);
+uint32_t calculate_checksum(const std::vector<uint8_t>& data, uint8_t algorithm = CHECKSUM_SUM32);
 
 /**
  * @brief Verifies the checksum of a given data block.
  * @param data The data vector to verify.
  * @param checksum The expected checksum.
+ * @param algorithm The ChecksumAlgorithm to use.
  * @return True if the checksum is valid, false otherwise.
  */
-bool verify_checksum(const std::vector<uint8_t>& data, uint32_t checksum);
+bool verify_checksum(const std::vector<uint8_t>& data, uint32_t checksum, uint8_t algorithm = CHECKSUM_SUM32);
 
 /**
  * @brief Encrypts data using AES-256-CBC.
@@ -100,6 +525,196 @@ std::vector<uint8_t> aes_encrypt(const std::vector<uint8_t>& data, const std::st
  */
 std::vector<uint8_t> aes_decrypt(const std::vector<uint8_t>& data, const std::string& key, const std::string& iv);
 
+/**
+ * @brief Decrypts AES-256-CBC data into a caller's buffer.
+ * @param data The encrypted data.
+ * @param length The length of the encrypted data.
+ * @param key The AES encryption key (32 bytes).
+ * @param iv The AES initialization vector (16 bytes).
+ * @param out The buffer; it must have room for `length` bytes.
+ * @param plainSize Receives the length of the plaintext.
+ * @return True if the data decrypted with valid padding.
+ */
+bool aes_decrypt_into(const uint8_t* data, size_t length, const std::string& key, const std::string& iv,
+                      uint8_t* out, size_t& plainSize);
+
+/**
+ * @brief Encodes transfer options as a TLV block.
+ * @param options The options to encode.
+ * @param buffer The output buffer.
+ * @param capacity The size of the output buffer.
+ * @return The number of bytes written.
+ */
+size_t encode_options(const TransferOptions& options, uint8_t* buffer, size_t capacity);
+
+/**
+ * @brief Decodes a TLV options block.
+ * @details Unknown option types are skipped and missing ones keep their defaults,
+ * so peers with different option sets interoperate.
+ * @param buffer The TLV block.
+ * @param length The number of valid bytes in the block.
+ * @return The decoded options.
+ */
+TransferOptions decode_options(const uint8_t* buffer, size_t length);
+
+/**
+ * @brief Reduces requested options to what this implementation supports.
+ * @param requested The options proposed by the peer.
+ * @return The options to acknowledge in the OACK.
+ */
+TransferOptions negotiate_options(const TransferOptions& requested);
+
+/**
+ * @brief Sends an acknowledgment for a block of the current session.
+ * @param sockfd The socket file descriptor.
+ * @param addr The peer address structure.
+ * @param blockNumber The highest block received in order (0 acknowledges the request itself).
+ * @param fileSize The total file size to announce, if any.
+ * @param processingUs Time spent on the packet being answered, in microseconds.
+ */
+void send_ack(int sockfd, const sockaddr_in& addr, uint64_t blockNumber, uint64_t fileSize = 0, uint32_t processingUs = 0);
+
+/// Consumes the next in-order plaintext block of a transfer; returns false on a write failure.
+using BlockWriter = std::function<bool(const std::vector<uint8_t>& block)>;
+
+/// Stores a plaintext block at its byte offset in the transfer; returns false on a write failure.
+using PositionalWriter = std::function<bool(uint64_t offset, const std::vector<uint8_t>& block)>;
+
+/// Returns where a block of at most `length` plaintext bytes at `offset` is to be decrypted,
+/// or nullptr to have it decrypted into a vector and passed to the PositionalWriter.
+using BlockPlacer = std::function<uint8_t*(uint64_t offset, size_t length)>;
+
+/// Stores a run of zero bytes at its byte offset in the transfer (e.g. as a hole); returns false on failure.
+using ZeroRunWriter = std::function<bool(uint64_t offset, uint64_t length)>;
+
+/// Consumes the next in-order run of zero bytes of a transfer; returns false on a write failure.
+using ZeroRunSink = std::function<bool(uint64_t length)>;
+
+/// Waits for a transfer's deferred writes, and commits what was received, before its final ACK;
+/// returns false if that failed, with errno and a message for the sender in `reason` (default "Write failed.").
+using WriteBarrier = std::function<bool(std::string& reason)>;
+
+/**
+ * @brief Sends a file's DATA blocks with a sliding window (go-back-N).
+ * @details Up to options.windowSize blocks are in flight; ACKs are cumulative and a
+ * timeout resends every unacknowledged block. The retransmission timeout adapts to
+ * round trips measured from kernel TX/RX timestamps minus the receiver's processing time;
+ * the transfer is abandoned after MAX_RETRIES timeouts of at least ACK_TIMEOUT without progress. The block that reaches totalSize, or
+ * a short read, carries FLAG_LAST_BLOCK. If options.zeroRuns is set, consecutive all-zero
+ * blocks are sent as one FLAG_ZERO_RUN descriptor instead of their payloads.
+ * @param sockfd The socket file descriptor.
+ * @param peer The session address of the receiver.
+ * @param options The negotiated transfer options.
+ * @param key The AES encryption key.
+ * @param iv The AES initialization vector.
+ * @param totalSize The number of plaintext bytes to send.
+ * @param read_block Source of the plaintext.
+ * @param error Receives a description of the failure.
+ * @param stats Optional statistics for the transfer.
+ * @return True once the final block has been acknowledged.
+ */
+bool send_data_blocks(int sockfd, const sockaddr_in& peer, const TransferOptions& options,
+                      const std::string& key, const std::string& iv, uint64_t totalSize,
+                      const BlockReader& read_block, std::string& error, TransferStats* stats = nullptr);
+
+/**
+ * @brief Sends a file's DATA blocks from a read-ahead stage.
+ * @details As the other overload, with payloads read and encrypted ahead by `source`.
+ * @param sockfd The socket file descriptor.
+ * @param peer The session address of the receiver.
+ * @param options The negotiated transfer options (those `source` was created with).
+ * @param totalSize The number of plaintext bytes to send.
+ * @param source The prepared payloads.
+ * @param error Receives a description of the failure.
+ * @param stats Optional statistics for the transfer.
+ * @return True once the final block has been acknowledged.
+ */
+bool send_data_blocks(int sockfd, const sockaddr_in& peer, const TransferOptions& options, uint64_t totalSize,
+                      ReadAhead& source, std::string& error, TransferStats* stats = nullptr);
+
+/**
+ * @brief Receives DATA blocks in any order, stores each at its offset, and acknowledges cumulatively.
+ * @details Blocks up to options.windowSize ahead of the first missing one are written as
+ * they arrive and recorded in a received-range bitmap; the cumulative ACK names the last
+ * block before the first gap. Writes may therefore come out of order, but each block is
+ * written once. Zero runs go to `write_zeros`, or are written out as zero bytes without one.
+ * With `place`, a block is decrypted straight into the memory it names (e.g. a mapped file).
+ * Each block's offset must continue the blocks before it, every block but the last must
+ * cover whole blocks (except in a followed file), and none may pass `totalSize`; a block
+ * that breaks this is answered with an ERROR. The checksum covers the header fields that
+ * place a block as well as its payload.
+ * @param sockfd The socket file descriptor.
+ * @param peer The session address of the sender.
+ * @param options The negotiated transfer options.
+ * @param key The AES encryption key.
+ * @param iv The AES initialization vector.
+ * @param totalSize The size announced for the transfer, or UNKNOWN_SIZE.
+ * @param write_at Sink for the decrypted blocks and their offsets.
+ * @param received Receives the number of plaintext bytes received without gaps.
+ * @param error Receives a description of the failure.
+ * @param stats Optional statistics for the transfer.
+ * @param write_zeros Optional sink for zero runs.
+ * @param place Optional destination of blocks, tried before `write_at`.
+ * @param barrier Optional wait for writes deferred by the sinks and commit of the result, so the sender is told of a late failure.
+ * @return True once every block up to the one flagged FLAG_LAST_BLOCK has been stored. The final ACK
+ * is repeated for retransmissions arriving within two of the sender's timeouts after it, so returns
+ * are that much later than the last block.
+ */
+bool receive_data_blocks_at(int sockfd, const sockaddr_in& peer, const TransferOptions& options,
+                            const std::string& key, const std::string& iv, uint64_t totalSize,
+                            const PositionalWriter& write_at, uint64_t& received, std::string& error,
+                            TransferStats* stats = nullptr, const ZeroRunWriter& write_zeros = nullptr,
+                            const BlockPlacer& place = nullptr, const WriteBarrier& barrier = nullptr);
+
+/**
+ * @brief Receives DATA blocks and delivers them in order, acknowledging them cumulatively.
+ * @details Built on receive_data_blocks_at(): blocks that arrive ahead of a gap are held
+ * in a reorder buffer of at most one window, which must be empty once the last block is in.
+ * @param sockfd The socket file descriptor.
+ * @param peer The session address of the sender.
+ * @param options The negotiated transfer options.
+ * @param key The AES encryption key.
+ * @param iv The AES initialization vector.
+ * @param totalSize The size announced for the transfer, or UNKNOWN_SIZE.
+ * @param write_block Sink for the decrypted blocks.
+ * @param received Receives the number of plaintext bytes delivered.
+ * @param error Receives a description of the failure.
+ * @param stats Optional statistics for the transfer.
+ * @param skip_zeros Optional sink for zero runs; without one they reach write_block as zero bytes.
+ * @param barrier Optional wait for writes deferred by the sinks and commit of the result, so the sender is told of a late failure.
+ * @return True once the block flagged FLAG_LAST_BLOCK has been delivered.
+ */
+bool receive_data_blocks(int sockfd, const sockaddr_in& peer, const TransferOptions& options,
+                         const std::string& key, const std::string& iv, uint64_t totalSize,
+                         const BlockWriter& write_block, uint64_t& received, std::string& error,
+                         TransferStats* stats = nullptr, const ZeroRunSink& skip_zeros = nullptr,
+                         const WriteBarrier& barrier = nullptr);
+
+/**
+ * @brief Maps an errno value to the matching protocol error code.
+ * @param err The errno value of the failed file operation.
+ * @return The ErrorCode to report to the peer.
+ */
+int error_code_from_errno(int err);
+
+/**
+ * @brief Sends a compact error packet.
+ * @param sockfd The socket file descriptor.
+ * @param addr The peer address structure.
+ * @param errorCode The error code (see ErrorCode).
+ * @param message A short human-readable description.
+ */
+void send_error_packet(int sockfd, const sockaddr_in& addr, int errorCode, const std::string& message);
+
+/**
+ * @brief Checks whether a received datagram is an error packet.
+ * @param buffer The received datagram.
+ * @param length The number of bytes received.
+ * @param error Optional output for the decoded error packet.
+ * @return True if the datagram is a well-formed error packet.
+ */
+bool parse_error_packet(const void* buffer, long length, TFTPErrorPacket* error = nullptr);
+
 /**
  * @brief Logs an error message to a file.
  * @param message The error message to log.
@@ -107,12 +722,90 @@ std::vector<uint8_t> aes_decrypt(const std::vector<uint8_t>& data, const std::st
  */
 void log_error(const std::string& message, const sockaddr_in& clientAddr);
 
+/**
+ * @brief Logs an error message that has no client context (e.g. background work).
+ * @param message The error message to log.
+ */
+void log_error(const std::string& message);
+
 /**
  * @brief Validates the existence of necessary directories for file storage.
  * @details Creates directories if they do not exist.
  */
 void validate_directories();
 
+/**
+ * @brief Computes the SHA-256 digest of a byte range.
+ * @param data Pointer to the bytes.
+ * @param length Number of bytes.
+ * @return The digest.
+ */
+Hash sha256(const uint8_t* data, size_t length);
+
+/**
+ * @brief Hashes every MERKLE_CHUNK_SIZE chunk of a file (the Merkle tree leaves).
+ * @details Chunks are split into contiguous ranges hashed on parallel threads.
+ * @param path The file to hash.
+ * @param leaves Receives one leaf hash per chunk.
+ * @return True on success, false if the file could not be read.
+ */
+bool compute_chunk_hashes(const std::string& path, std::vector<Hash>& leaves);
+
+/**
+ * @brief Computes the Merkle root over chunk hashes.
+ * @details Inner nodes are SHA-256(0x01 || left || right); an unpaired node is promoted
+ * unchanged. A file without chunks has the root SHA-256 of the empty string.
+ * @param leaves The chunk hashes.
+ * @return The root hash.
+ */
+Hash merkle_root(const std::vector<Hash>& leaves);
+
+/**
+ * @brief Formats a hash as lowercase hexadecimal.
+ * @param hash The hash to format.
+ * @return The 64-character hex string.
+ */
+std::string to_hex(const Hash& hash);
+
+/**
+ * @brief Encodes a file as a binary delta against a base file.
+ * @details The delta is a header ("RDL1", target size, base version) followed by COPY
+ * (base offset, length) and INSERT (length, bytes) instructions. Matches are found with a
+ * rolling checksum over DELTA_BLOCK_SIZE blocks of the base and extended byte by byte.
+ * @param base The base file contents.
+ * @param target The contents to encode.
+ * @param baseVersion Identifies the base; stored in the header for the decoder.
+ * @param delta Receives the encoded delta.
+ */
+void encode_delta(const std::vector<uint8_t>& base, const std::vector<uint8_t>& target,
+                  const std::string& baseVersion, std::vector<uint8_t>& delta);
+
+/**
+ * @brief Encodes a file that is the first `size` bytes of its base: one COPY instruction.
+ * @param size The size of the prefix.
+ * @param baseVersion Identifies the base; stored in the header for the decoder.
+ * @param delta Receives the encoded delta.
+ */
+void encode_prefix_delta(uint64_t size, const std::string& baseVersion, std::vector<uint8_t>& delta);
+
+/**
+ * @brief Reads the header of a delta file.
+ * @param deltaPath The delta file.
+ * @param baseVersion Receives the base version it was encoded against.
+ * @param targetSize Receives the size of the file it reconstructs.
+ * @return True if the file is a valid delta.
+ */
+bool read_delta_header(const std::string& deltaPath, std::string& baseVersion, uint64_t& targetSize);
+
+/**
+ * @brief Reconstructs a file from its base and a delta (streams, so memory use stays small).
+ * @param basePath The base file.
+ * @param deltaPath The delta file.
+ * @param outPath The file to write.
+ * @return True if the output was written with the expected size.
+ */
+bool apply_delta(const std::string& basePath, const std::string& deltaPath, const std::string& outPath);
+
 /**
  * @brief Generates a versioned filename with a timestamp.
  * @param filename The original filename.
@@ -120,6 +813,113 @@ void validate_directories();
  */
 std::string generate_versioned_filename(const std::string& filename);
 
+/**
+ * @brief Waits until a socket has a datagram ready to be read.
+ * @details Pending TX timestamps on the error queue wake select() as well; they are
+ * discarded so that a following blocking receive never stalls.
+ * @param sockfd The socket file descriptor.
+ * @param timeoutMs The maximum time to wait in milliseconds.
+ * @return True if the socket is readable, false on timeout or error.
+ */
+bool wait_readable(int sockfd, int timeoutMs);
+
+/**
+ * @brief Computes socket buffer sizes for a session's bandwidth-delay product.
+ * @details The negotiated window is the data a session keeps in flight per round trip,
+ * so it bounds the bandwidth-delay product the session can use whatever the path. The
+ * buffer holds two windows (one in flight, one retransmitted) of datagrams as the kernel
+ * accounts them: the whole packet whatever the block size, plus DATAGRAM_OVERHEAD.
+ * @param options The negotiated transfer options.
+ * @return The buffer size in bytes, within [MIN_SOCKET_BUFFER, MAX_SOCKET_BUFFER].
+ */
+size_t socket_buffer_size(const TransferOptions& options);
+
+/**
+ * @brief Sets the send and receive buffer sizes of a socket.
+ * @details Uses SO_RCVBUFFORCE/SO_SNDBUFFORCE where permitted (CAP_NET_ADMIN), so the
+ * size is not capped by net.core.rmem_max/wmem_max, and falls back to SO_RCVBUF/SO_SNDBUF,
+ * which the kernel silently caps.
+ * @param sockfd The socket file descriptor.
+ * @param bytes The requested buffer size.
+ * @return The smaller of the receive and send buffer sizes the kernel granted, so callers
+ * can report a cap below the request.
+ */
+size_t size_socket_buffers(int sockfd, size_t bytes);
+
+/**
+ * @brief Enables the receive-queue drop counter (SO_RXQ_OVFL) on a socket.
+ * @param sockfd The socket file descriptor.
+ */
+void enable_drop_monitoring(int sockfd);
+
+/**
+ * @brief Enables kernel software timestamps (SO_TIMESTAMPING) on a socket.
+ * @param sockfd The socket file descriptor.
+ * @param transmit Also timestamp outgoing datagrams (reported on the error queue).
+ */
+void enable_timestamping(int sockfd, bool transmit);
+
+/**
+ * @brief Current wall-clock time, on the same clock as kernel software timestamps.
+ * @return Microseconds since the epoch.
+ */
+int64_t now_us();
+
+/**
+ * @brief Sends one datagram and returns when it left the host.
+ * @param sockfd The socket file descriptor.
+ * @param buffer The datagram.
+ * @param length The datagram length.
+ * @param peer The destination address.
+ * @return The kernel TX timestamp in microseconds, or now_us() if none is available.
+ */
+int64_t send_datagram(int sockfd, const void* buffer, size_t length, const sockaddr_in& peer);
+
+/**
+ * @brief Encodes a packet in its wire format.
+ * @param packet The packet.
+ * @param buffer Receives WIRE_PACKET_SIZE bytes.
+ */
+void encode_packet(const Packet& packet, uint8_t* buffer);
+
+/**
+ * @brief Decodes a packet from its wire format.
+ * @param buffer The received datagram.
+ * @param length The number of bytes received.
+ * @param packet Receives the decoded packet.
+ * @return True if the datagram has the size of an encoded packet.
+ */
+bool decode_packet(const void* buffer, long length, Packet& packet);
+
+/**
+ * @brief Encodes a packet and sends it as one datagram.
+ * @param sockfd The socket file descriptor.
+ * @param packet The packet.
+ * @param peer The destination address.
+ * @return The kernel TX timestamp in microseconds, as send_datagram().
+ */
+int64_t send_packet(int sockfd, const Packet& packet, const sockaddr_in& peer);
+
+/**
+ * @brief Receives one datagram and collects the socket's ancillary data.
+ * @param sockfd The socket file descriptor.
+ * @param buffer The receive buffer.
+ * @param length The size of the receive buffer.
+ * @param from Optional output for the sender address.
+ * @param stats Optional statistics updated from the ancillary data.
+ * @param timestampUs Optional output for the kernel RX timestamp (now_us() if none).
+ * @return The number of bytes received, or -1 on error.
+ */
+long receive_datagram(int sockfd, void* buffer, size_t length, sockaddr_in* from, TransferStats* stats,
+                      int64_t* timestampUs = nullptr);
+
+/**
+ * @brief Formats transfer statistics for logs and reports.
+ * @param stats The statistics to format.
+ * @return A one-line summary.
+ */
+std::string format_transfer_stats(const TransferStats& stats);
+
 /**
  * @brief Cross-platform function to close a socket.
  */